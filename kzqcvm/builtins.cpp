@@ -53,6 +53,14 @@ void Kzqcvm::RemoveBuiltin(int number)
 	}
 }
 
+void Kzqcvm::SetBuiltinParallel(int number, bool parallel)
+{
+	if (parallel)
+		mParallelBuiltins.insert(number);
+	else
+		mParallelBuiltins.erase(number);
+}
+
 int Kzqcvm::FindBuiltinNumber(string name)
 {
 	for (int i=0; i<mHeader->functions_num; ++i)
@@ -70,6 +78,13 @@ int Kzqcvm::FindBuiltinNumber(string name)
 
 bool Kzqcvm::RunBuiltin(int builtinNum)
 {
+	if (mThinkWorker && mParallelBuiltins.find(builtinNum) == mParallelBuiltins.end())
+	{
+		// see SetThinkThreads; the think will be run again on the QCVM's own thread
+		mThinkAborted = true;
+		StartError(ERR_BUILTIN_ERROR, "Builtin not marked parallel");
+		return false;
+	}
 	map<int,BuiltinCallback>::iterator it = mBuiltins.find(-builtinNum);
 	if (it == mBuiltins.end())
 	{
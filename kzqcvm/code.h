@@ -0,0 +1,129 @@
+/*
+Kzqcvm QuakeC VM Interpreter
+Copyright (c) 2010 David Laurie
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+/*
+kzqcvm/code.h
+*/
+
+//-----------------------------------------------------------------------------
+#ifndef KZQCVM_CODE_H
+#define KZQCVM_CODE_H
+//-----------------------------------------------------------------------------
+
+#include <stdint.h>
+#include <vector>
+
+#include "instructions.h"
+
+//-----------------------------------------------------------------------------
+namespace kzqcvm {
+	using std::vector;
+//-----------------------------------------------------------------------------
+
+/*
+The progs as the interpreter runs it. Each QuakeC function is decoded once,
+when the image loads, into a run of CodeInstructions: the operands are
+widened, jumps are resolved to absolute indexes into the code, and calls to
+small leaf functions are replaced by the function's body.
+
+Globals which nothing can change are constants, and operands reading them
+are replaced by their values, so the instructions using them become the
+_IMM forms below, or are folded away entirely.
+
+Code instructions use the progs instruction numbers, with the operands in
+the same places (jump targets included), plus the interpreter's own
+instructions below.
+*/
+
+struct CodeInstruction {
+	int16_t opcode;
+	int32_t a;
+	int32_t b;
+	int32_t c;
+};
+
+// Where each code instruction came from, for error traces.
+struct CodeSource {
+	int32_t function;
+	int32_t statement;
+	// for inlined code, the CALL in the caller it replaced, else -1
+	int32_t callStatement;
+};
+
+struct CodeInstructions {
+	// if the function global a no longer holds function b, go to c to make
+	// the call after all; otherwise carry on into the inlined body
+	static const int16_t INLINE     = Instructions::MAX + 1;
+
+	// as the progs instruction, but with b the float value itself
+	static const int16_t EQ_F_IMM   = Instructions::MAX + 2;
+	static const int16_t NE_F_IMM   = Instructions::MAX + 3;
+	static const int16_t LE_IMM     = Instructions::MAX + 4;
+	static const int16_t GE_IMM     = Instructions::MAX + 5;
+	static const int16_t LT_IMM     = Instructions::MAX + 6;
+	static const int16_t GT_IMM     = Instructions::MAX + 7;
+	static const int16_t ADD_F_IMM  = Instructions::MAX + 8;
+	static const int16_t MUL_F_IMM  = Instructions::MAX + 9;
+	static const int16_t DIV_F_IMM  = Instructions::MAX + 10;
+
+	// as the progs instruction, but with b the field offset itself, which
+	// has been checked to lie within the entity, with room for the value
+	static const int16_t LOAD_F_IMM  = Instructions::MAX + 11;
+	static const int16_t LOAD_V_IMM  = Instructions::MAX + 12;
+	// LOAD_S, LOAD_ENT, LOAD_FLD and LOAD_FNC
+	static const int16_t LOAD_I_IMM  = Instructions::MAX + 13;
+	static const int16_t ADDRESS_IMM = Instructions::MAX + 14;
+
+	// global b = the bits of a, for any single word STORE
+	static const int16_t STORE_IMM  = Instructions::MAX + 15;
+
+	// as the progs instruction, but b can only hold 0 or addresses of fields
+	// with room for the value, so only the entity need be checked
+	static const int16_t STOREP_V_INBOUNDS = Instructions::MAX + 16;
+	// STOREP_F, STOREP_S, STOREP_ENT, STOREP_FLD and STOREP_FNC
+	static const int16_t STOREP_I_INBOUNDS = Instructions::MAX + 17;
+};
+
+// A whole decoded progs. The image decodes one with every constant it can
+// find, and an instance decodes its own when it has to give some up.
+struct Code {
+	Code() : globalsNum(0) { }
+
+	vector<CodeInstruction> instructions;
+	vector<CodeSource>      sources;
+	// where each function starts in instructions
+	vector<int32_t>         functionStarts;
+	// the globals including those added for inlining, which follow the
+	// progs' own and start out as extraGlobalData
+	int32_t                 globalsNum;
+	vector<float>           extraGlobalData;
+	// for each of the progs' globals, whether it was treated as a constant
+	vector<char>            constants;
+};
+
+//-----------------------------------------------------------------------------
+} // namespace
+//-----------------------------------------------------------------------------
+
+//-----------------------------------------------------------------------------
+#endif
+//-----------------------------------------------------------------------------
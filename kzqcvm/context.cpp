@@ -0,0 +1,135 @@
+/*
+Kzqcvm QuakeC VM Interpreter
+Copyright (c) 2010 David Laurie
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+/*
+kzqcvm/context.cpp
+*/
+
+#include "context.h"
+
+#include <stdint.h>
+#include <vector>
+#include <algorithm>
+
+//-----------------------------------------------------------------------------
+namespace kzqcvm {
+	using std::vector;
+	using std::sort;
+	using std::unique;
+//-----------------------------------------------------------------------------
+
+//-----------------------------------------------------------------------------
+// Structors
+//-----------------------------------------------------------------------------
+
+ExecutionContext::ExecutionContext(Kzqcvm &world, WritePolicy policy)
+	: mWorld(world), mPolicy(policy)
+{
+	mSyncCheckpoint = 0;
+	mVM = NULL;
+	if (!world.IsLoaded())
+	{
+		mVM = new Kzqcvm(world.GetImage());
+		return;
+	}
+	mSyncCheckpoint = world.Checkpoint();
+	mVM = world.Fork();
+	if (mVM->IsLoaded())
+		Begin();
+}
+
+ExecutionContext::~ExecutionContext()
+{
+	delete mVM;
+}
+
+// sets up the fork's entities for the policy, after forking
+void ExecutionContext::Begin()
+{
+	mVM->mEntityManager.SetWritable(mPolicy != WRITES_DENIED);
+	mVM->mEntityManager.SetAccessLog(NULL, mPolicy == WRITES_COMMITTED ? &mWrites : NULL);
+	mWrites.clear();
+}
+
+//-----------------------------------------------------------------------------
+// Entities
+//-----------------------------------------------------------------------------
+
+Entity ExecutionContext::ToContext(Entity entity)
+{
+	if (entity.qcvm != &mWorld)
+		return Entity();
+	return Entity(mVM, entity.entNum);
+}
+
+Entity ExecutionContext::ToWorld(Entity entity)
+{
+	if (entity.qcvm != mVM)
+		return Entity();
+	return Entity(&mWorld, entity.entNum);
+}
+
+//-----------------------------------------------------------------------------
+// Sync/Commit
+//-----------------------------------------------------------------------------
+
+void ExecutionContext::Sync()
+{
+	if (!mVM->IsLoaded())
+		return;
+	mSyncCheckpoint = mWorld.Checkpoint();
+	mWorld.SyncFork(mVM);
+	Begin();
+}
+
+int32_t ExecutionContext::Commit(vector<Entity> &rejected)
+{
+	if (mPolicy != WRITES_COMMITTED || !mVM->IsLoaded())
+		return 0;
+	sort(mWrites.begin(), mWrites.end());
+	mWrites.erase(unique(mWrites.begin(), mWrites.end()), mWrites.end());
+
+	EntityManager &world = mWorld.mEntityManager;
+	int32_t committed = 0;
+	for (size_t i=0; i<mWrites.size(); ++i)
+	{
+		int32_t slot = mWrites[i];
+		if (world.WrittenSince(slot, mSyncCheckpoint))
+		{
+			int32_t entityNum = world.GetSlotEntity(slot);
+			if (entityNum < 0)
+				entityNum = mVM->mEntityManager.GetSlotEntity(slot);
+			if (entityNum >= 0)
+				rejected.push_back(Entity(&mWorld, entityNum));
+			continue;
+		}
+		world.CopyEntity(mVM->mEntityManager, slot);
+		++committed;
+	}
+	// committing again would find our own writes since the sync
+	mWrites.clear();
+	return committed;
+}
+
+//-----------------------------------------------------------------------------
+} // namespace
+//-----------------------------------------------------------------------------
@@ -0,0 +1,141 @@
+/*
+Kzqcvm QuakeC VM Interpreter
+Copyright (c) 2010 David Laurie
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+/*
+kzqcvm/context.h
+*/
+
+//-----------------------------------------------------------------------------
+#ifndef KZQCVM_CONTEXT_H
+#define KZQCVM_CONTEXT_H
+//-----------------------------------------------------------------------------
+
+#include <stdint.h>
+#include <vector>
+
+#include "kzqcvm.h"
+#include "data.h"
+
+//-----------------------------------------------------------------------------
+namespace kzqcvm {
+	using std::vector;
+//-----------------------------------------------------------------------------
+
+/*
+An ExecutionContext runs QC against a world Kzqcvm from another thread. It
+holds a fork of the world with its own globals, stack, temp strings and
+errors, so any number of contexts can run at once, each on its own thread,
+while the world itself stays untouched.
+
+What a context sees is the world as it was at the last Sync(). Its writes to
+entities are governed by the policy it was made with:
+
+  WRITES_DENIED     every write to an entity field fails, as a write to an
+                    entity not in use would, and raises an error in the QC
+                    doing it
+  WRITES_PRIVATE    writes go to the context's own copy, and are discarded
+                    at the next Sync()
+  WRITES_COMMITTED  as private, but Commit() copies the entities written
+                    back into the world, unless the world has written the
+                    same entities since the Sync()
+
+Sync() and Commit() read or write the world, so they must be called on the
+world's thread while no QC is running in it, and the context must not be
+running at the time either. Handing the context to another thread and back
+is up to you, with a join or a lock, as with any other object. Globals are
+never committed, and nor are strings zoned within the context, so QC run
+with WRITES_COMMITTED should not store such strings in entities.
+*/
+class ExecutionContext {
+public:
+	enum WritePolicy {
+		WRITES_DENIED,
+		WRITES_PRIVATE,
+		WRITES_COMMITTED
+	};
+
+	/*
+	Forks world, as Sync() would. Construct it on the world's thread.
+	*/
+	ExecutionContext(Kzqcvm &world, WritePolicy policy);
+	~ExecutionContext();
+
+	/*
+	Returns true if the fork loaded. Don't use the context otherwise.
+	*/
+	bool IsLoaded() { return mVM->IsLoaded(); }
+	WritePolicy GetPolicy() const { return mPolicy; }
+
+	/*
+	The Kzqcvm to run QC in, from the context's thread. Its entities are
+	the world's entities, with the same numbers.
+	*/
+	Kzqcvm &GetVM() { return *mVM; }
+
+	/*
+	Entities are tied to the Kzqcvm they came from. These give the same
+	entity in the other one; an entity from anywhere else gives a null one.
+	*/
+	Entity ToContext(Entity entity);
+	Entity ToWorld(Entity entity);
+
+	/*
+	Discards everything done in the context since the last Sync() and
+	brings it up to date with the world: globals, entities, strings,
+	builtins and dataObject. Errors are cleared. Takes a checkpoint of the
+	world, as Kzqcvm::Checkpoint does, to know what it writes from then on;
+	checkpoints the host holds are unaffected. So does making the context.
+	*/
+	void Sync();
+
+	/*
+	With WRITES_COMMITTED, copies each entity written in the context since
+	the last Sync() into the world, whole, including its creation or
+	deletion. Entities the world has also written since then are left as
+	the world has them and listed in rejected, by their world numbers.
+	Returns the number copied. With the other policies it does nothing and
+	returns 0. Call Sync() before running the context again.
+	*/
+	int32_t Commit(vector<Entity> &rejected);
+
+private:
+	ExecutionContext(const ExecutionContext &);
+	ExecutionContext &operator=(const ExecutionContext &);
+
+	void Begin();
+
+	Kzqcvm          &mWorld;
+	Kzqcvm          *mVM;
+	WritePolicy      mPolicy;
+	// the world's checkpoint when last synced
+	uint32_t         mSyncCheckpoint;
+	// slots written in the context, see EntityManager::SetAccessLog
+	vector<int32_t>  mWrites;
+};
+
+//-----------------------------------------------------------------------------
+} // namespace
+//-----------------------------------------------------------------------------
+
+//-----------------------------------------------------------------------------
+#endif
+//-----------------------------------------------------------------------------
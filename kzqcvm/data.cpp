@@ -31,11 +31,14 @@ kzqcvm/data.cpp
 
 #include <assert.h>
 #include <map>
+#include <algorithm>
 #include <iostream>
 
 //-----------------------------------------------------------------------------
 namespace kzqcvm {
 	using std::pair;
+	using std::sort;
+	using std::lower_bound;
 	using std::cout;
 	using std::endl;
 //-----------------------------------------------------------------------------
@@ -51,9 +54,10 @@ float null_data[3] = { 0.0f, 0.0f, 0.0f };
 #define GLOBALPOINTERFUNC(returnType, cast, typeNum)\
 returnType Kzqcvm::Get ## returnType(string name) {\
 	for (int i=0; i<mHeader->globaldefs_num; ++i) {\
-		if ((mGlobalDefs[i].type & GLOBALDEF_TYPE_MASK) == typeNum) {\
-			if ((mGlobalDefData[i] & (GLOBAL_DEF_SPECIAL | GLOBAL_DEF_LOCAL)) == 0) {\
+		if ((mGlobalDefs[i].type & ProgsImage::GLOBALDEF_TYPE_MASK) == typeNum) {\
+			if ((mGlobalDefData[i] & (ProgsImage::GLOBAL_DEF_SPECIAL | ProgsImage::GLOBAL_DEF_LOCAL)) == 0) {\
 				if (name.compare(&mStringData[mGlobalDefs[i].nameOffset]) == 0) {\
+					ReleaseConstants(mGlobalDefs[i].offset, typeNum == VECTOR ? 3 : 1);\
 					return returnType(this, (cast)&mGlobalData[mGlobalDefs[i].offset]);\
 				}\
 			}\
@@ -88,6 +92,173 @@ void Kzqcvm::DeleteEntity(Entity entity, int64_t time)
 	mEntityManager.DeleteEntity(entity.entNum, time);
 }
 
+void Kzqcvm::CreateEntities(int32_t count, int64_t time, vector<Entity> &entities)
+{
+	if (count <= 0)
+		return;
+	vector<int32_t> entityNums(count);
+	mEntityManager.CreateEntities(count, time, &entityNums[0]);
+	entities.reserve(entities.size() + count);
+	for (int32_t i=0; i<count; ++i)
+	{
+		entities.push_back(Entity(this, entityNums[i]));
+	}
+}
+
+void Kzqcvm::DeleteEntities(const vector<Entity> &entities, int64_t time)
+{
+	vector<int32_t> entityNums(entities.size());
+	for (int i=0; i<(int)entities.size(); ++i)
+	{
+		assert(entities[i].qcvm == this);
+		entityNums[i] = entities[i].entNum;
+	}
+	if (!entityNums.empty())
+		mEntityManager.DeleteEntities(&entityNums[0], (int32_t)entityNums.size(), time);
+}
+
+bool Kzqcvm::SetEntitiesPerPage(int32_t entitiesPerPage)
+{
+	return mEntityManager.SetEntitiesPerPage(entitiesPerPage);
+}
+
+int32_t Kzqcvm::GetEntitiesPerPage()
+{
+	return mEntityManager.GetEntitiesPerPage();
+}
+
+bool Kzqcvm::SetEntityGenerations(int generationBits)
+{
+	return mEntityManager.SetEntityGenerations(generationBits);
+}
+
+int Kzqcvm::GetEntityGenerations()
+{
+	return mEntityManager.GetEntityGenerations();
+}
+
+// the offset and width in floats of each field, for GatherFields and
+// ScatterFields; false if any field is null or belongs to another Kzqcvm
+bool Kzqcvm::FieldColumns(const vector<Field> &fields, vector<int32_t> &offsets, vector<int32_t> &widths)
+{
+	offsets.resize(fields.size());
+	widths.resize(fields.size());
+	for (int i=0; i<(int)fields.size(); ++i)
+	{
+		if (fields[i].qcvm != this || fields[i].offset < 0)
+			return false;
+		offsets[i] = fields[i].offset;
+		widths[i]  = mFieldOffsetTypes[fields[i].offset] == VECTOR ? 3 : 1;
+	}
+	return true;
+}
+
+int32_t Kzqcvm::GatherFields(const vector<Field> &fields, float *const *columns, int32_t maxEntities,
+	vector<Entity> &entities)
+{
+	entities.clear();
+	vector<int32_t> offsets, widths;
+	if (!FieldColumns(fields, offsets, widths))
+		return -1;
+	if (maxEntities <= 0 || fields.empty())
+		return 0;
+	vector<int32_t> entityNums(maxEntities);
+	int32_t gathered = mEntityManager.Gather(&offsets[0], &widths[0], (int32_t)fields.size(),
+		columns, maxEntities, &entityNums[0]);
+	for (int32_t i=0; i<gathered; ++i)
+	{
+		entities.push_back(Entity(this, entityNums[i]));
+	}
+	return gathered;
+}
+
+bool Kzqcvm::ScatterFields(const vector<Field> &fields, const float *const *columns,
+	const vector<Entity> &entities)
+{
+	vector<int32_t> offsets, widths;
+	if (!FieldColumns(fields, offsets, widths))
+		return false;
+	if (entities.empty() || fields.empty())
+		return true;
+	vector<int32_t> entityNums(entities.size());
+	for (int i=0; i<(int)entities.size(); ++i)
+	{
+		assert(entities[i].qcvm == this);
+		entityNums[i] = entities[i].entNum;
+	}
+	return mEntityManager.Scatter(&offsets[0], &widths[0], (int32_t)fields.size(),
+		columns, (int32_t)entityNums.size(), &entityNums[0]);
+}
+
+float *Kzqcvm::GetEntityData(Entity &entity)
+{
+	assert(entity.qcvm == this);
+	return mEntityManager.GetPointer(entity.entNum, 0);
+}
+
+int32_t Kzqcvm::ReleaseFreeEntityPages(int64_t time)
+{
+	return mEntityManager.ReleaseFreePages(time);
+}
+
+void Kzqcvm::DefragmentEntities(int64_t time, vector<pair<Entity, Entity> > &moved)
+{
+	vector<int32_t> from, to;
+	mEntityManager.Defragment(time, from, to);
+	moved.clear();
+	if (from.empty())
+		return;
+
+	// sorted by old number, to look up QC's references
+	vector<pair<int32_t, int32_t> > remap;
+	for (int i=0; i<(int)from.size(); ++i)
+	{
+		remap.push_back(pair<int32_t, int32_t>(from[i], to[i]));
+		moved.push_back(pair<Entity, Entity>(Entity(this, from[i]), Entity(this, to[i])));
+	}
+	sort(remap.begin(), remap.end());
+
+	int32_t *intGlobalData = (int32_t*)mGlobalData;
+	for (int i=0; i<mHeader->globaldefs_num; ++i)
+	{
+		if ((mGlobalDefs[i].type & ProgsImage::GLOBALDEF_TYPE_MASK) != ENTITY)
+			continue;
+		int32_t offset = mGlobalDefs[i].offset;
+		vector<pair<int32_t, int32_t> >::iterator it = lower_bound(remap.begin(), remap.end(),
+			pair<int32_t, int32_t>(intGlobalData[offset], INT32_MIN));
+		if (it != remap.end() && it->first == intGlobalData[offset])
+		{
+			ReleaseConstants(offset, 1);
+			intGlobalData[offset] = it->second;
+		}
+	}
+
+	vector<int32_t> entityFields;
+	for (int i=0; i<mHeader->fielddefs_num; ++i)
+	{
+		if ((mFieldDefs[i].type & ProgsImage::GLOBALDEF_TYPE_MASK) == ENTITY)
+			entityFields.push_back(mFieldDefs[i].offset);
+	}
+	if (entityFields.empty())
+		return;
+	int32_t first = mEntityManager.GetFirstEntity();
+	int32_t entityNum = first;
+	do
+	{
+		for (int i=0; i<(int)entityFields.size(); ++i)
+		{
+			int value;
+			if (!mEntityManager.ReadInt(entityNum, entityFields[i], &value))
+				continue;
+			vector<pair<int32_t, int32_t> >::iterator it = lower_bound(remap.begin(), remap.end(),
+				pair<int32_t, int32_t>(value, INT32_MIN));
+			if (it != remap.end() && it->first == value)
+				mEntityManager.WriteInt(mEntityManager.GetAddress(entityNum, entityFields[i]), it->second);
+		}
+		entityNum = mEntityManager.GetNextEntity(entityNum);
+	} while (entityNum != first);
+}
+
 Field Kzqcvm::GetEntityField(string name)
 {
 	for (int i=0; i<mHeader->fielddefs_num; ++i)
@@ -176,13 +347,18 @@ String Kzqcvm::Alloc(String s)
 	return String(this, mStringManager.Zone(string(s.GetValue())));
 }
 
+String Kzqcvm::Alloc(string s)
+{
+	return String(this, mStringManager.Zone(s));
+}
+
 bool Kzqcvm::Free(String s)
 {
 	assert(s.qcvm == this);
 	return mStringManager.Unzone(s.stringNum);
 }
 
-char *Kzqcvm::GetStringValue(String s)
+const char *Kzqcvm::GetStringValue(String s)
 {
 	assert(s.qcvm == this);
 	return mStringManager.GetString(s.stringNum);
@@ -64,10 +64,15 @@ private:
 
 class Entity {
 	friend class Kzqcvm;
+	friend class PublishedState;
 	friend class EntityPointer;
+	friend class ExecutionContext;
+	friend class Mailbox;
 public:
 	Entity Next() { return qcvm->NextEntity(*this); }
 	operator bool() { return entNum >= 0; }
+	bool operator==(const Entity &other) const { return qcvm == other.qcvm && entNum == other.entNum; }
+	bool operator!=(const Entity &other) const { return !(*this == other); }
 	Entity() : qcvm(0), entNum(-1) { }
 private:
 	Entity(Kzqcvm *vm, int32_t ent) : qcvm(vm), entNum(ent) { }
@@ -77,6 +82,7 @@ private:
 
 class Field {
 	friend class Kzqcvm;
+	friend class PublishedState;
 	friend class FieldPointer;
 public:
 	QcvmDefinitionType Type() { return qcvm->GetFieldType(*this); }
@@ -111,6 +117,7 @@ extern float null_data[3];
 
 class FloatPointer {
 	friend class Kzqcvm;
+	friend class PublishedState;
 public:
 	float Get() { return *value; }
 	void Set(float f) { *value = f; }
@@ -124,6 +131,7 @@ private:
 
 class VectorPointer {
 	friend class Kzqcvm;
+	friend class PublishedState;
 public:
 	float Get(int i) { return value[i&3]; }
 	void  Set(int i, float f) { value[i&3] = f; }
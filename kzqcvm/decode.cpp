@@ -0,0 +1,672 @@
+/*
+Kzqcvm QuakeC VM Interpreter
+Copyright (c) 2010 David Laurie
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+/*
+kzqcvm/decode.cpp
+*/
+
+#include "progsimage.h"
+#include "instructions.h"
+#include "code.h"
+
+#include <string.h>
+
+#include <algorithm>
+#include <utility>
+
+//-----------------------------------------------------------------------------
+namespace kzqcvm {
+	using std::sort;
+	using std::lower_bound;
+	using std::pair;
+	using std::make_pair;
+//-----------------------------------------------------------------------------
+
+static const int16_t OFS_RETURN = 1;
+static const int16_t OFS_PARM0  = 4;
+// the null global, the return value and the parameters
+static const int32_t RESERVED_GLOBALS = 28;
+
+//-----------------------------------------------------------------------------
+// Helpers
+//-----------------------------------------------------------------------------
+
+// Collects the statements reachable from first, in order. reached must be
+// all clear, and is left that way.
+static void ReachStatements(const QcvmStatement *statements, int32_t first,
+	vector<char> &reached, vector<int32_t> &order)
+{
+	order.clear();
+	vector<int32_t> pending(1, first);
+	while (!pending.empty())
+	{
+		int32_t i = pending.back();
+		pending.pop_back();
+		if (reached[i])
+			continue;
+		reached[i] = 1;
+		order.push_back(i);
+
+		// the loader has checked every jump lands inside the progs, and
+		// that the last statement is DONE
+		const QcvmStatement &statement = statements[i];
+		switch (statement.instruction)
+		{
+		case Instructions::DONE:
+		case Instructions::RETURN:
+			break;
+		case Instructions::GOTO:
+			pending.push_back(i + statement.parameter[0]);
+			break;
+		case Instructions::IF:
+		case Instructions::IFNOT:
+			pending.push_back(i + statement.parameter[1]);
+			pending.push_back(i + 1);
+			break;
+		default:
+			if (statement.instruction >= Instructions::MIN && statement.instruction <= Instructions::MAX)
+				pending.push_back(i + 1);
+			break;
+		}
+	}
+	sort(order.begin(), order.end());
+	for (size_t i=0; i<order.size(); ++i)
+	{
+		reached[order[i]] = 0;
+	}
+}
+
+static bool IsGlobalOperand(InstructionParameterType type)
+{
+	return type != IT_NONE && type != IT_DIRECT;
+}
+
+static int32_t OperandWidth(InstructionParameterType type)
+{
+	return type == IT_VECTOR ? 3 : 1;
+}
+
+// Which operand an instruction stores to, or -1 for none. Calls and returns
+// store to the reserved globals, and STOREP and STATE to entities.
+static int DestinationOperand(int16_t instruction)
+{
+	if (instruction < Instructions::MIN || instruction > Instructions::MAX)
+		return -1;
+	if (instruction >= Instructions::STORE_F && instruction <= Instructions::STORE_FNC)
+		return 1;
+	if (IsGlobalOperand(GetInstructionInfo(instruction)->parm[2]))
+		return 2;
+	return -1;
+}
+
+static int32_t AddressRoom(const vector<int32_t> &addressRooms, int32_t offset)
+{
+	if (offset < 0 || offset >= (int32_t)addressRooms.size())
+		return 0;
+	return addressRooms[offset];
+}
+
+static int32_t AddGlobals(Code &code, int32_t count)
+{
+	int32_t offset = code.globalsNum;
+	code.extraGlobalData.resize(code.extraGlobalData.size() + count, 0.0f);
+	code.globalsNum += count;
+	return offset;
+}
+
+static bool IsConstant(const Code &code, int32_t offset)
+{
+	return offset >= 0 && offset < (int32_t)code.constants.size() && code.constants[offset];
+}
+
+static int32_t FloatBits(float value)
+{
+	int32_t bits;
+	memcpy(&bits, &value, sizeof(bits));
+	return bits;
+}
+
+// the _IMM form of a comparison, and of the comparison with its operands
+// swapped
+static int16_t CompareImmediate(int16_t opcode, bool swapped)
+{
+	switch (opcode)
+	{
+	case Instructions::EQ_F: return CodeInstructions::EQ_F_IMM;
+	case Instructions::NE_F: return CodeInstructions::NE_F_IMM;
+	case Instructions::LE:   return swapped ? CodeInstructions::GE_IMM : CodeInstructions::LE_IMM;
+	case Instructions::GE:   return swapped ? CodeInstructions::LE_IMM : CodeInstructions::GE_IMM;
+	case Instructions::LT:   return swapped ? CodeInstructions::GT_IMM : CodeInstructions::LT_IMM;
+	case Instructions::GT:   return swapped ? CodeInstructions::LT_IMM : CodeInstructions::GT_IMM;
+	default:                 return opcode;
+	}
+}
+
+// exactly as run.cpp would, so folding never changes a result
+static float FoldFloat(int16_t opcode, float a, float b)
+{
+	switch (opcode)
+	{
+	case Instructions::EQ_F:  return a == b;
+	case Instructions::NE_F:  return a != b;
+	case Instructions::LE:    return a <= b;
+	case Instructions::GE:    return a >= b;
+	case Instructions::LT:    return a <  b;
+	case Instructions::GT:    return a >  b;
+	case Instructions::ADD_F: return a + b;
+	case Instructions::SUB_F: return a - b;
+	case Instructions::MUL_F: return a * b;
+	case Instructions::DIV_F: return a / b;
+	default:                  return 0.0f;
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Constants
+//-----------------------------------------------------------------------------
+
+// A global is constant unless a statement stores to it, it holds a function's
+// locals, or it is one the engine sets: the reserved globals and the system
+// globals. The host can still reach the rest by name, so an instance gives
+// up any it hands out a pointer to, see Kzqcvm::ReleaseConstants.
+void ProgsImage::FindConstants(vector<char> &constants) const
+{
+	int32_t globalsNum = mHeader->globaldata_num;
+	constants.assign(globalsNum, 1);
+
+	for (int32_t i=0; i<RESERVED_GLOBALS && i<globalsNum; ++i)
+	{
+		constants[i] = 0;
+	}
+	for (int32_t f=0; f<mHeader->functions_num; ++f)
+	{
+		for (int32_t j=0; j<mFunctions[f].numLocals; ++j)
+		{
+			constants[mFunctions[f].offsetLocalsInGlobals+j] = 0;
+		}
+	}
+	for (int32_t i=0; i<mHeader->globaldefs_num; ++i)
+	{
+		if (!(mGlobalDefData[i] & GLOBAL_DEF_SYSTEM))
+			continue;
+		int32_t width = (mGlobalDefs[i].type & GLOBALDEF_TYPE_MASK) == VECTOR ? 3 : 1;
+		for (int32_t j=mGlobalDefs[i].offset; j<mGlobalDefs[i].offset+width && j<globalsNum; ++j)
+		{
+			constants[j] = 0;
+		}
+	}
+
+	for (int32_t i=0; i<mHeader->statements_num; ++i)
+	{
+		const QcvmStatement &statement = mStatements[i];
+		int destination = DestinationOperand(statement.instruction);
+		if (destination < 0)
+			continue;
+		const InstructionInfo *info = GetInstructionInfo(statement.instruction);
+		int32_t start = statement.parameter[destination];
+		int32_t end   = start + OperandWidth(info->parm[destination]);
+		for (int32_t j=start; j<end && j<globalsNum; ++j)
+		{
+			constants[j] = 0;
+		}
+	}
+}
+
+bool ProgsImage::FieldInBounds(int32_t fieldOffset, int32_t width) const
+{
+	return fieldOffset >= 0 && fieldOffset + width <= mHeader->entity_size;
+}
+
+// Works out which globals only ever hold 0 or addresses, and how much room
+// the fields they address leave: the least of (entity_size - field) over
+// every ADDRESS which sets them, with fields that are constants. A STOREP
+// through one needs no field check when what it stores fits in the room.
+// A global anything else could set has no room: one with an initial value,
+// a parameter, one the host can reach by name, or one any other statement
+// stores to.
+void ProgsImage::FindAddresses(const Code &code, vector<int32_t> &addressRooms) const
+{
+	int32_t globalsNum = mHeader->globaldata_num;
+	addressRooms.assign(globalsNum, INT32_MAX);
+
+	const int32_t *values = (const int32_t*)mGlobalData;
+	for (int32_t i=0; i<globalsNum; ++i)
+	{
+		if (i < RESERVED_GLOBALS || values[i] != 0)
+			addressRooms[i] = 0;
+	}
+	for (int32_t f=0; f<mHeader->functions_num; ++f)
+	{
+		int32_t parametersSize = 0;
+		for (int32_t j=0; j<mFunctions[f].numParameters && j<8; ++j)
+		{
+			parametersSize += mFunctions[f].parameterSizes[j];
+		}
+		for (int32_t j=0; j<parametersSize && j<mFunctions[f].numLocals; ++j)
+		{
+			addressRooms[mFunctions[f].offsetLocalsInGlobals+j] = 0;
+		}
+	}
+	for (int32_t i=0; i<mHeader->globaldefs_num; ++i)
+	{
+		if (mGlobalDefData[i] & (GLOBAL_DEF_SPECIAL | GLOBAL_DEF_LOCAL))
+			continue;
+		int32_t width = (mGlobalDefs[i].type & GLOBALDEF_TYPE_MASK) == VECTOR ? 3 : 1;
+		for (int32_t j=mGlobalDefs[i].offset; j<mGlobalDefs[i].offset+width && j<globalsNum; ++j)
+		{
+			addressRooms[j] = 0;
+		}
+	}
+
+	for (int32_t i=0; i<mHeader->statements_num; ++i)
+	{
+		const QcvmStatement &statement = mStatements[i];
+		int destination = DestinationOperand(statement.instruction);
+		if (destination < 0)
+			continue;
+		const InstructionInfo *info = GetInstructionInfo(statement.instruction);
+		int32_t start = statement.parameter[destination];
+		int32_t end   = start + OperandWidth(info->parm[destination]);
+		int32_t room  = 0;
+		if (statement.instruction == Instructions::ADDRESS && IsConstant(code, statement.parameter[1]) &&
+			FieldInBounds(values[statement.parameter[1]], 1))
+		{
+			room = mHeader->entity_size - values[statement.parameter[1]];
+		}
+		for (int32_t j=start; j<end && j<globalsNum; ++j)
+		{
+			if (room < addressRooms[j])
+				addressRooms[j] = room;
+		}
+	}
+}
+
+// Rewrites an instruction to take its constant operands as immediates.
+// Jumps on a constant are dealt with by DecodeStatements, which must
+// resolve their targets.
+void ProgsImage::Specialize(const Code &code, const vector<int32_t> &addressRooms,
+	CodeInstruction &instruction) const
+{
+	const int32_t *values = (const int32_t*)mGlobalData;
+	bool constantA = IsConstant(code, instruction.a);
+	bool constantB = IsConstant(code, instruction.b);
+
+	switch (instruction.opcode)
+	{
+	case Instructions::EQ_F:
+	case Instructions::NE_F:
+	case Instructions::LE:
+	case Instructions::GE:
+	case Instructions::LT:
+	case Instructions::GT:
+	case Instructions::ADD_F:
+	case Instructions::SUB_F:
+	case Instructions::MUL_F:
+	case Instructions::DIV_F:
+		if (constantA && constantB)
+		{
+			float result = FoldFloat(instruction.opcode, mGlobalData[instruction.a], mGlobalData[instruction.b]);
+			CodeInstruction folded = { CodeInstructions::STORE_IMM, FloatBits(result), instruction.c, 0 };
+			instruction = folded;
+		}
+		else if (constantB)
+		{
+			switch (instruction.opcode)
+			{
+			case Instructions::ADD_F: instruction.opcode = CodeInstructions::ADD_F_IMM; break;
+			case Instructions::MUL_F: instruction.opcode = CodeInstructions::MUL_F_IMM; break;
+			case Instructions::DIV_F: instruction.opcode = CodeInstructions::DIV_F_IMM; break;
+			case Instructions::SUB_F:
+				// a - b is exactly a + -b
+				instruction.opcode = CodeInstructions::ADD_F_IMM;
+				instruction.b = FloatBits(-mGlobalData[instruction.b]);
+				return;
+			default:
+				instruction.opcode = CompareImmediate(instruction.opcode, false);
+				break;
+			}
+			instruction.b = values[instruction.b];
+		}
+		else if (constantA && instruction.opcode != Instructions::SUB_F && instruction.opcode != Instructions::DIV_F)
+		{
+			switch (instruction.opcode)
+			{
+			case Instructions::ADD_F: instruction.opcode = CodeInstructions::ADD_F_IMM; break;
+			case Instructions::MUL_F: instruction.opcode = CodeInstructions::MUL_F_IMM; break;
+			default:
+				instruction.opcode = CompareImmediate(instruction.opcode, true);
+				break;
+			}
+			int32_t value = values[instruction.a];
+			instruction.a = instruction.b;
+			instruction.b = value;
+		}
+		break;
+	case Instructions::LOAD_F:
+	case Instructions::LOAD_V:
+	case Instructions::LOAD_S:
+	case Instructions::LOAD_ENT:
+	case Instructions::LOAD_FLD:
+	case Instructions::LOAD_FNC:
+	case Instructions::ADDRESS:
+		// a field outside the entity is left to fail at run time as ever
+		if (constantB && FieldInBounds(values[instruction.b],
+			instruction.opcode == Instructions::LOAD_V ? 3 : 1))
+		{
+			switch (instruction.opcode)
+			{
+			case Instructions::LOAD_F:  instruction.opcode = CodeInstructions::LOAD_F_IMM;  break;
+			case Instructions::LOAD_V:  instruction.opcode = CodeInstructions::LOAD_V_IMM;  break;
+			case Instructions::ADDRESS: instruction.opcode = CodeInstructions::ADDRESS_IMM; break;
+			default:                    instruction.opcode = CodeInstructions::LOAD_I_IMM;  break;
+			}
+			instruction.b = values[instruction.b];
+		}
+		break;
+	case Instructions::STORE_F:
+	case Instructions::STORE_S:
+	case Instructions::STORE_ENT:
+	case Instructions::STORE_FLD:
+	case Instructions::STORE_FNC:
+		if (constantA)
+		{
+			instruction.opcode = CodeInstructions::STORE_IMM;
+			instruction.a = values[instruction.a];
+		}
+		break;
+	case Instructions::STOREP_F:
+	case Instructions::STOREP_S:
+	case Instructions::STOREP_ENT:
+	case Instructions::STOREP_FLD:
+	case Instructions::STOREP_FNC:
+		if (AddressRoom(addressRooms, instruction.b) >= 1)
+			instruction.opcode = CodeInstructions::STOREP_I_INBOUNDS;
+		break;
+	case Instructions::STOREP_V:
+		if (AddressRoom(addressRooms, instruction.b) >= 3)
+			instruction.opcode = CodeInstructions::STOREP_V_INBOUNDS;
+		break;
+	default:
+		break;
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Decode
+//-----------------------------------------------------------------------------
+
+void ProgsImage::Decode()
+{
+	vector<char> constants;
+	FindConstants(constants);
+	Decode(mCode, constants);
+}
+
+void ProgsImage::Decode(Code &code, const vector<char> &constants) const
+{
+	code.instructions.clear();
+	code.sources.clear();
+	code.functionStarts.assign(mHeader->functions_num, 0);
+	code.extraGlobalData.clear();
+	code.globalsNum = mHeader->globaldata_num;
+	code.constants = constants;
+
+	// code 0 is never run, so a jump can always be made to land one before
+	// its target
+	CodeInstruction done = { Instructions::DONE, 0, 0, 0 };
+	CodeSource none = { 0, 0, -1 };
+	code.instructions.push_back(done);
+	code.sources.push_back(none);
+
+	vector<char> reached(mHeader->statements_num, 0);
+	vector<int32_t> order;
+
+	// each function to be inlined gets its own copy of its locals, so an
+	// inlined body never disturbs the locals of whatever it is inlined into
+	vector<int32_t> inlineLocals(mHeader->functions_num, -1);
+	for (int32_t f=1; f<mHeader->functions_num; ++f)
+	{
+		if (CanInline(f, reached, order))
+		{
+			// with room for a scalar return to read a vector's worth
+			inlineLocals[f] = AddGlobals(code, mFunctions[f].numLocals + 2);
+		}
+	}
+
+	vector<int32_t> addressRooms;
+	FindAddresses(code, addressRooms);
+
+	vector<int32_t> returns;
+	for (int32_t f=1; f<mHeader->functions_num; ++f)
+	{
+		if (mFunctions[f].offsetFirstStatement <= 0)
+			continue;
+		code.functionStarts[f] = code.instructions.size();
+		ReachStatements(mStatements, mFunctions[f].offsetFirstStatement, reached, order);
+		DecodeStatements(code, addressRooms, f, order, inlineLocals, reached, -1, -1, returns);
+	}
+}
+
+// Small, and calls nothing, so can't recurse. Its operands must each lie
+// wholly inside or outside its locals, as only whole operands are moved.
+bool ProgsImage::CanInline(int32_t functionNum, vector<char> &reached, vector<int32_t> &order) const
+{
+	const QcvmFunction &function = mFunctions[functionNum];
+	if (function.offsetFirstStatement <= 0)
+		return false;
+
+	ReachStatements(mStatements, function.offsetFirstStatement, reached, order);
+	if ((int32_t)order.size() > INLINE_MAX_STATEMENTS)
+		return false;
+
+	int32_t localsStart = function.offsetLocalsInGlobals;
+	int32_t localsEnd   = localsStart + function.numLocals;
+	for (size_t i=0; i<order.size(); ++i)
+	{
+		const QcvmStatement &statement = mStatements[order[i]];
+		if (statement.instruction < Instructions::MIN || statement.instruction > Instructions::MAX)
+			return false;
+		if ((statement.instruction >= Instructions::CALL0 && statement.instruction <= Instructions::CALL8) ||
+			statement.instruction == Instructions::STATE)
+			return false;
+
+		bool isReturn = statement.instruction == Instructions::RETURN || statement.instruction == Instructions::DONE;
+		const InstructionInfo *info = GetInstructionInfo(statement.instruction);
+		for (int j=0; j<3; ++j)
+		{
+			if (!IsGlobalOperand(info->parm[j]))
+				continue;
+			int32_t start = statement.parameter[j];
+			int32_t end   = start + OperandWidth(info->parm[j]);
+			bool inside = start >= localsStart && start < localsEnd;
+			// a return copies a vector whatever it returns
+			if (inside && end > localsEnd && !isReturn)
+				return false;
+			if (!inside && start < localsStart && end > localsStart)
+				return false;
+		}
+	}
+	return true;
+}
+
+// Appends the code for a function's statements, or for an inlined body when
+// callStatement is set; then the body's locals are moved to inlineStart, and
+// its returns store the value and jump to wherever the caller patches
+// returns to.
+void ProgsImage::DecodeStatements(Code &code, const vector<int32_t> &addressRooms, int32_t functionNum, const vector<int32_t> &order,
+	const vector<int32_t> &inlineLocals, vector<char> &reached, int32_t callStatement, int32_t inlineStart,
+	vector<int32_t> &returns) const
+{
+	const QcvmFunction &function = mFunctions[functionNum];
+	int32_t localsStart = function.offsetLocalsInGlobals;
+	int32_t localsEnd   = localsStart + function.numLocals;
+
+	vector<int32_t> codeIndex(order.size());
+	// (code index, statement) for jumps
+	vector<pair<int32_t, int32_t> > jumps;
+	returns.clear();
+
+	for (size_t k=0; k<order.size(); ++k)
+	{
+		int32_t i = order[k];
+		const QcvmStatement &statement = mStatements[i];
+		codeIndex[k] = code.instructions.size();
+
+		CodeInstruction instruction = { statement.instruction,
+			statement.parameter[0], statement.parameter[1], statement.parameter[2] };
+		CodeSource source = { functionNum, i, callStatement };
+
+		if (callStatement >= 0)
+		{
+			const InstructionInfo *info = GetInstructionInfo(statement.instruction);
+			int32_t *operands[3] = { &instruction.a, &instruction.b, &instruction.c };
+			for (int j=0; j<3; ++j)
+			{
+				if (IsGlobalOperand(info->parm[j]) && *operands[j] >= localsStart && *operands[j] < localsEnd)
+					*operands[j] += inlineStart - localsStart;
+			}
+			if (statement.instruction == Instructions::RETURN || statement.instruction == Instructions::DONE)
+			{
+				CodeInstruction store = { Instructions::STORE_V, instruction.a, OFS_RETURN, 0 };
+				code.instructions.push_back(store);
+				code.sources.push_back(source);
+				instruction.opcode = Instructions::GOTO;
+				instruction.a = 0;
+				returns.push_back(code.instructions.size());
+			}
+		}
+
+		switch (statement.instruction)
+		{
+		case Instructions::GOTO:
+			jumps.push_back(make_pair((int32_t)code.instructions.size(), i + statement.parameter[0]));
+			break;
+		case Instructions::IF:
+		case Instructions::IFNOT:
+			if (IsConstant(code, instruction.a))
+			{
+				// which way it goes is already known
+				bool taken = mGlobalData[instruction.a] ? statement.instruction == Instructions::IF :
+					statement.instruction == Instructions::IFNOT;
+				instruction.opcode = Instructions::GOTO;
+				jumps.push_back(make_pair((int32_t)code.instructions.size(), taken ? i + statement.parameter[1] : i + 1));
+			}
+			else
+			{
+				jumps.push_back(make_pair((int32_t)code.instructions.size(), i + statement.parameter[1]));
+			}
+			break;
+		default:
+			Specialize(code, addressRooms, instruction);
+			break;
+		}
+
+		// a call to something small enough is replaced by its body
+		int32_t callee = 0;
+		if (statement.instruction >= Instructions::CALL0 && statement.instruction <= Instructions::CALL8 &&
+			callStatement < 0)
+		{
+			const int32_t *initialValues = (const int32_t*)mGlobalData;
+			callee = initialValues[statement.parameter[0]];
+			if (callee <= 0 || callee >= mHeader->functions_num || inlineLocals[callee] < 0 || callee == functionNum)
+				callee = 0;
+		}
+		if (callee)
+		{
+			DecodeInline(code, addressRooms, functionNum, i, callee, inlineLocals, reached);
+			continue;
+		}
+
+		code.instructions.push_back(instruction);
+		code.sources.push_back(source);
+	}
+
+	// resolve the jumps now everything has a place
+	for (size_t j=0; j<jumps.size(); ++j)
+	{
+		CodeInstruction &instruction = code.instructions[jumps[j].first];
+		int32_t target = codeIndex[lower_bound(order.begin(), order.end(), jumps[j].second) - order.begin()];
+		if (instruction.opcode == Instructions::GOTO)
+			instruction.a = target;
+		else
+			instruction.b = target;
+	}
+}
+
+// Replaces a call with:
+//   INLINE     function global, callee, fallback
+//   copy the parameters into the callee's inline locals
+//   the callee's body, its returns going to end
+//   fallback: the original CALL
+//   end:
+// When the function global is a constant, it can only ever call the callee,
+// so there is no need for the INLINE or the fallback.
+void ProgsImage::DecodeInline(Code &code, const vector<int32_t> &addressRooms, int32_t functionNum, int32_t callStatement, int32_t callee,
+	const vector<int32_t> &inlineLocals, vector<char> &reached) const
+{
+	const QcvmStatement &call = mStatements[callStatement];
+	const QcvmFunction &function = mFunctions[callee];
+	int32_t inlineStart = inlineLocals[callee];
+	bool guarded = !IsConstant(code, call.parameter[0]);
+
+	CodeSource callSource = { functionNum, callStatement, -1 };
+	CodeSource calleeSource = { callee, function.offsetFirstStatement, callStatement };
+
+	int32_t guard = code.instructions.size();
+	if (guarded)
+	{
+		CodeInstruction inlineInstruction = { CodeInstructions::INLINE, call.parameter[0], callee, 0 };
+		code.instructions.push_back(inlineInstruction);
+		code.sources.push_back(callSource);
+	}
+
+	for (int i=0, ofs=0; i<function.numParameters; ++i)
+	{
+		for (int j=0; j<function.parameterSizes[i]; ++j, ++ofs)
+		{
+			CodeInstruction copy = { Instructions::STORE_F, OFS_PARM0 + (i*3) + j, inlineStart + ofs, 0 };
+			code.instructions.push_back(copy);
+			code.sources.push_back(calleeSource);
+		}
+	}
+
+	vector<int32_t> order;
+	vector<int32_t> returns;
+	ReachStatements(mStatements, function.offsetFirstStatement, reached, order);
+	DecodeStatements(code, addressRooms, callee, order, inlineLocals, reached, callStatement, inlineStart, returns);
+
+	if (guarded)
+	{
+		code.instructions[guard].c = code.instructions.size();
+		CodeInstruction callInstruction = { call.instruction, call.parameter[0], call.parameter[1], call.parameter[2] };
+		code.instructions.push_back(callInstruction);
+		code.sources.push_back(callSource);
+	}
+	for (size_t r=0; r<returns.size(); ++r)
+	{
+		code.instructions[returns[r]].a = code.instructions.size();
+	}
+}
+
+//-----------------------------------------------------------------------------
+} // namespace
+//-----------------------------------------------------------------------------
@@ -27,23 +27,18 @@ kzqcvm/manager.cpp
 #include "entitymanager.h"
 
 #include <cstring>
+#include <new>
 #include <stdint.h>
+#include <stdlib.h>
 #include <limits.h>
 #include <assert.h>
+#include <sys/mman.h>
 
 //-----------------------------------------------------------------------------
 namespace kzqcvm {
 //-----------------------------------------------------------------------------
 
-const int32_t ENTITIES_PER_PAGE = 0xff;
-const int32_t PAGENUMBER_MASK   = 0xffffff00;
-const int32_t PAGENUMBER_SHIFT  = 8;
-const int32_t ONPAGE_MASK       = 0x000000ff;
-
-// time is represented as a 64 bit int spread over two floats
-const int HEADER_SIZE = 2;
 #define ENTITY_TIME(ent) (*(int64_t*)(ent))
-const int64_t ENTITY_INUSE_VALUE = LLONG_MAX;
 
 //-----------------------------------------------------------------------------
 // Structors
@@ -52,14 +47,48 @@ const int64_t ENTITY_INUSE_VALUE = LLONG_MAX;
 EntityManager::EntityManager()
 {
 	mInit = false;
+	mWriteEpoch = 1;
+	mEntitiesPerPage = DEFAULT_ENTITIES_PER_PAGE;
+	for (mPageShift=0; (1 << mPageShift) < mEntitiesPerPage; ++mPageShift)
+		;
+	mOnPageMask = mEntitiesPerPage - 1;
+	mFirstFree  = 0;
+	mSlotBits   = 31;
+	mSlotMask   = INT32_MAX;
+	mZeroPage   = NULL;
+	mWatchedField = -1;
+	mReadLog    = NULL;
+	mWriteLog   = NULL;
+	mWritable   = true;
 }
 
 EntityManager::~EntityManager()
 {
-	for (int i=0; i<(int)mEntityPages.size(); ++i)
+	ReleasePages();
+}
+
+void EntityManager::ReleasePages()
+{
+	for (int i=0; i<(int)mPages.size(); ++i)
+	{
+		if (mPages[i] && --mPages[i]->refCount == 0)
+		{
+			FreePageData(mPages[i]->data);
+			delete mPages[i];
+		}
+	}
+	mPages.clear();
+	mEntityPages.clear();
+	mPageOwned.clear();
+	mPageStamps.clear();
+	mEntityStamps.clear();
+	mReleasedGenerations.clear();
+	if (mZeroPage && --mZeroPage->refCount == 0)
 	{
-		delete[] mEntityPages[i];
+		FreePageData(mZeroPage->data);
+		delete mZeroPage;
 	}
+	mZeroPage = NULL;
 }
 
 //-----------------------------------------------------------------------------
@@ -71,53 +100,352 @@ void EntityManager::Init(int32_t entitySize, float entityReuseTime)
 	mInit = true;
 
 	mEntitySize      = entitySize + HEADER_SIZE;
-	mPageSize        = ENTITIES_PER_PAGE * mEntitySize;
+	mPageSize        = mEntitiesPerPage * mEntitySize;
+	for (mFieldShift=0; (1 << mFieldShift) < mEntitySize; ++mFieldShift)
+		;
+	mFieldMask        = (1 << mFieldShift) - 1;
+	mMaxAddressEntity = (int32_t)(UINT32_MAX >> mFieldShift);
 	mEntityReuseTime = entityReuseTime;
 	CreateEntityPage();
 }
 
+bool EntityManager::SetEntitiesPerPage(int32_t entitiesPerPage)
+{
+	assert(mInit);
+	if (entitiesPerPage <= 0 || entitiesPerPage > MAX_ENTITIES_PER_PAGE ||
+		(entitiesPerPage & (entitiesPerPage - 1)) != 0)
+		return false;
+	int pageShift;
+	for (pageShift=0; (1 << pageShift) < entitiesPerPage; ++pageShift)
+		;
+	if (pageShift > mSlotBits || GetFirstEntity() >= 0)
+		return false;
+
+	// the old pages are unmapped at their own size
+	ReleasePages();
+	mEntitiesPerPage = entitiesPerPage;
+	mPageShift  = pageShift;
+	mOnPageMask = mEntitiesPerPage - 1;
+	mPageSize   = mEntitiesPerPage * mEntitySize;
+	ResetPages();
+	return true;
+}
+
+bool EntityManager::SetEntityGenerations(int generationBits)
+{
+	assert(mInit);
+	if (generationBits < 0 || generationBits > MAX_GENERATION_BITS ||
+		31 - generationBits < mPageShift || GetFirstEntity() >= 0)
+		return false;
+
+	mSlotBits = 31 - generationBits;
+	mSlotMask = (int32_t)(((uint32_t)1 << mSlotBits) - 1);
+	ResetPages();
+	return true;
+}
+
+// Starts again from a single empty page, dropping the reuse times and
+// generations of the free slots.
+void EntityManager::ResetPages()
+{
+	ReleasePages();
+	mFirstFree = 0;
+	CreateEntityPage();
+}
+
+//-----------------------------------------------------------------------------
+// Fork - copy on write
+//-----------------------------------------------------------------------------
+
+void EntityManager::Fork(EntityManager &source)
+{
+	assert(source.mInit);
+	ReleasePages();
+
+	mInit            = true;
+	mEntitySize      = source.mEntitySize;
+	mPageSize        = source.mPageSize;
+	mEntitiesPerPage = source.mEntitiesPerPage;
+	mPageShift       = source.mPageShift;
+	mOnPageMask      = source.mOnPageMask;
+	mFirstFree       = source.mFirstFree;
+	mSlotBits        = source.mSlotBits;
+	mSlotMask        = source.mSlotMask;
+	mFieldShift      = source.mFieldShift;
+	mFieldMask       = source.mFieldMask;
+	mMaxAddressEntity = source.mMaxAddressEntity;
+	mEntityReuseTime = source.mEntityReuseTime;
+
+	mPages       = source.mPages;
+	mEntityPages = source.mEntityPages;
+	mPageOwned.assign(mPages.size(), 0);
+	mZeroPage    = source.mZeroPage;
+	if (mZeroPage)
+		++mZeroPage->refCount;
+
+	// changes since a checkpoint mean the same thing on both sides
+	mWriteEpoch   = source.mWriteEpoch;
+	mPageStamps   = source.mPageStamps;
+	mEntityStamps = source.mEntityStamps;
+	mReleasedGenerations = source.mReleasedGenerations;
+	for (int i=0; i<(int)mPages.size(); ++i)
+	{
+		++mPages[i]->refCount;
+		source.mPageOwned[i] = 0;
+	}
+}
+
+void EntityManager::ReleaseSharedPages()
+{
+	for (int i=0; i<(int)mPages.size(); ++i)
+	{
+		if (mPageOwned[i] || !mPages[i])
+			continue;
+		if (--mPages[i]->refCount == 0)
+		{
+			FreePageData(mPages[i]->data);
+			delete mPages[i];
+		}
+		mPages[i]       = NULL;
+		mEntityPages[i] = NULL;
+	}
+	if (mZeroPage && --mZeroPage->refCount == 0)
+	{
+		FreePageData(mZeroPage->data);
+		delete mZeroPage;
+	}
+	mZeroPage = NULL;
+}
+
+void EntityManager::UnsharePage(int32_t pageNumber)
+{
+	EntityPage *page = mPages[pageNumber];
+	// if everyone else has copied it already then it's ours
+	if (page->refCount > 1)
+	{
+		EntityPage *copy = new EntityPage;
+		copy->refCount = 1;
+		copy->data     = AllocPageData();
+		memcpy(copy->data, page->data, mPageSize * sizeof(float));
+		if (--page->refCount == 0)
+		{
+			// lost a race with the other owner; it's still ours to free
+			FreePageData(page->data);
+			delete page;
+		}
+		mPages[pageNumber]       = copy;
+		mEntityPages[pageNumber] = copy->data;
+	}
+	mPageOwned[pageNumber] = 1;
+	// a released page gets its slots' generations back when first written
+	if (!mReleasedGenerations[pageNumber].empty())
+	{
+		WriteGenerations(mEntityPages[pageNumber], mReleasedGenerations[pageNumber]);
+		vector<int32_t>().swap(mReleasedGenerations[pageNumber]);
+	}
+}
+
+void EntityManager::WriteGenerations(float *page, const vector<int32_t> &generations)
+{
+	for (int j=0; j<mEntitiesPerPage; ++j)
+	{
+		ENTITY_TIME(&page[j*mEntitySize]) = -(int64_t)generations[j];
+	}
+}
+
+// The page as it would be once written, for saving.
+const float *EntityManager::PageForSave(int32_t pageNumber, vector<float> &scratch)
+{
+	if (mReleasedGenerations[pageNumber].empty())
+		return mEntityPages[pageNumber];
+	scratch.assign(mEntityPages[pageNumber], mEntityPages[pageNumber] + mPageSize);
+	WriteGenerations(&scratch[0], mReleasedGenerations[pageNumber]);
+	return &scratch[0];
+}
+
 //-----------------------------------------------------------------------------
 // Create/Delete
 //-----------------------------------------------------------------------------
 
+// Page data is mapped straight from the system, so it starts out zeroed and
+// freeing it gives the memory back rather than leaving it to the heap. Like
+// new, this throws if there is none, as its callers have nowhere to say so.
+float *EntityManager::AllocPageData()
+{
+	void *data = mmap(NULL, mPageSize * sizeof(float), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (data == MAP_FAILED)
+		throw std::bad_alloc();
+	return (float*)data;
+}
+
+void EntityManager::FreePageData(float *data)
+{
+	munmap(data, mPageSize * sizeof(float));
+}
+
+void EntityManager::ResizePages(int32_t numPages)
+{
+	while ((int32_t)mEntityPages.size() < numPages)
+	{
+		CreateEntityPage();
+	}
+	while ((int32_t)mEntityPages.size() > numPages)
+	{
+		if (--mPages.back()->refCount == 0)
+		{
+			FreePageData(mPages.back()->data);
+			delete mPages.back();
+		}
+		mPages.pop_back();
+		mEntityPages.pop_back();
+		mPageOwned.pop_back();
+		mPageStamps.pop_back();
+		mEntityStamps.pop_back();
+		mReleasedGenerations.pop_back();
+	}
+	if (mFirstFree > numPages << mPageShift)
+		mFirstFree = numPages << mPageShift;
+}
+
 void EntityManager::CreateEntityPage()
 {
-	assert(mEntityPages.size() < 0xffffff);
-	float *data = new float[mPageSize];
-	memset(data, 0, mPageSize * sizeof(float));
-	mEntityPages.push_back(data);
+	// slots must fit below the generation
+	assert((int64_t)mEntityPages.size() < ((int64_t)1 << (mSlotBits - mPageShift)));
+	EntityPage *page = new EntityPage;
+	page->refCount = 1;
+	page->data     = AllocPageData();
+	mPages.push_back(page);
+	mEntityPages.push_back(page->data);
+	mPageOwned.push_back(1);
+	mPageStamps.push_back(mWriteEpoch);
+	mEntityStamps.push_back(vector<uint32_t>(mEntitiesPerPage, mWriteEpoch));
+	mReleasedGenerations.push_back(vector<int32_t>());
 }
 
 int32_t EntityManager::CreateEntity(int64_t time)
+{
+	int32_t entityNum;
+	CreateEntities(1, time, &entityNum);
+	return entityNum;
+}
+
+void EntityManager::CreateEntities(int32_t count, int64_t time, int32_t *entities)
 {
 	assert(mInit);
-	for (int i=0; i<(int)mEntityPages.size(); ++i)
+	// mFirstFree follows the run of entities in use from the start, and
+	// stops at the first which isn't, even if it can't be reused yet
+	bool inUseSoFar = true;
+	bool generations = mSlotBits < 31;
+	int32_t created = 0;
+	int32_t numEntities = (int32_t)mEntityPages.size() << mPageShift;
+	for (int32_t slot=mFirstFree; slot<numEntities && created<count; )
 	{
-		for (int j=0; j<mPageSize; j += mEntitySize)
+		int32_t i = slot >> mPageShift;
+		int64_t entityTime = ENTITY_TIME(&mEntityPages[i][(slot & mOnPageMask) * mEntitySize]);
+		if (entityTime >= ENTITY_INUSE_MIN)
 		{
-			if (ENTITY_TIME(&mEntityPages[i][j]) <= time)
-			{
-				ENTITY_TIME(&mEntityPages[i][j]) = ENTITY_INUSE_VALUE;
-				for (int k=HEADER_SIZE; k<mEntitySize; ++k)
-				{
-					mEntityPages[i][j+k] = 0.0f;
-				}
-				return (i << PAGENUMBER_SHIFT) + (j / mEntitySize);
-			}
+			if (inUseSoFar)
+				mFirstFree = slot + 1;
+			++slot;
+			continue;
+		}
+		// a free slot's generation is its negated time, and it is reusable
+		// straight away
+		if (!generations && entityTime > time)
+		{
+			inUseSoFar = false;
+			++slot;
+			continue;
+		}
+
+		// take the run of reusable slots from here to the end of the page
+		int32_t first = slot;
+		int32_t end   = (i + 1) << mPageShift;
+		if (end - first > count - created)
+			end = first + count - created;
+		for (++slot; slot<end; ++slot)
+		{
+			entityTime = ENTITY_TIME(&mEntityPages[i][(slot & mOnPageMask) * mEntitySize]);
+			if (entityTime >= ENTITY_INUSE_MIN || (!generations && entityTime > time))
+				break;
 		}
+		float *page = PageForWrite(i, first & mOnPageMask);
+		for (int32_t k=first; k<slot; ++k)
+		{
+			float *entity = &page[(k & mOnPageMask) * mEntitySize];
+			int64_t generation = generations ? -ENTITY_TIME(entity) : 0;
+			ENTITY_TIME(entity) = ENTITY_INUSE_VALUE - generation;
+			memset(&entity[HEADER_SIZE], 0, (mEntitySize - HEADER_SIZE) * sizeof(float));
+			mEntityStamps[i][k & mOnPageMask] = mWriteEpoch;
+			entities[created++] = EntityNumber(k);
+		}
+		if (inUseSoFar)
+			mFirstFree = slot;
+	}
+
+	// the rest go on new pages, which start out zeroed
+	while (created < count)
+	{
+		CreateEntityPage();
+		float *page = mEntityPages.back();
+		int32_t onPage = count - created < mEntitiesPerPage ? count - created : mEntitiesPerPage;
+		for (int32_t j=0; j<onPage; ++j)
+		{
+			ENTITY_TIME(&page[j * mEntitySize]) = ENTITY_INUSE_VALUE;
+			entities[created++] = numEntities + j;
+		}
+		if (inUseSoFar)
+			mFirstFree = numEntities + onPage;
+		inUseSoFar = inUseSoFar && onPage == mEntitiesPerPage;
+		numEntities += mEntitiesPerPage;
 	}
-	CreateEntityPage();
-	ENTITY_TIME(&mEntityPages[mEntityPages.size()-1][0]) = ENTITY_INUSE_VALUE;
-	return (mEntityPages.size() - 1) << PAGENUMBER_SHIFT;
 }
 
 void EntityManager::DeleteEntity(int32_t entityNum, int64_t time)
 {
-	int pageNumber = (entityNum & PAGENUMBER_MASK) >> PAGENUMBER_SHIFT;
-	int index      = entityNum & ONPAGE_MASK;
-	assert(pageNumber >= 0 && pageNumber < (int)mEntityPages.size());
-	memset(&mEntityPages[pageNumber][index*mEntitySize], 0, mEntitySize*sizeof(float));
-	ENTITY_TIME(&mEntityPages[pageNumber][index*mEntitySize]) = time + mEntityReuseTime;
+	DeleteEntities(&entityNum, 1, time);
+}
+
+void EntityManager::DeleteEntities(const int32_t *entities, int32_t count, int64_t time)
+{
+	bool generations = mSlotBits < 31;
+	for (int32_t i=0; i<count; )
+	{
+		int32_t slot   = entities[i] & mSlotMask;
+		int pageNumber = slot >> mPageShift;
+		int index      = slot & mOnPageMask;
+		assert(pageNumber >= 0 && pageNumber < (int)mEntityPages.size());
+		// a stale number must not free the slot's new occupant
+		if (generations && !LiveEntity(entities[i]))
+		{
+			++i;
+			continue;
+		}
+
+		// clear runs of consecutive entities on a page together
+		int32_t n = 1;
+		while (i + n < count && (entities[i+n] & mSlotMask) == slot + n && index + n < mEntitiesPerPage &&
+			(!generations || LiveEntity(entities[i+n])))
+		{
+			++n;
+		}
+		float *page = PageForWrite(pageNumber, index);
+		memset(&page[index*mEntitySize], 0, n*mEntitySize*sizeof(float));
+		for (int32_t k=0; k<n; ++k)
+		{
+			int64_t header = time + mEntityReuseTime;
+			if (generations)
+			{
+				uint32_t generation = ((uint32_t)entities[i+k] >> mSlotBits) + 1;
+				header = -(int64_t)(generation & ((1u << (31 - mSlotBits)) - 1));
+			}
+			ENTITY_TIME(&page[(index+k)*mEntitySize]) = header;
+			mEntityStamps[pageNumber][index+k] = mWriteEpoch;
+		}
+		if (slot < mFirstFree)
+			mFirstFree = slot;
+		i += n;
+	}
 }
 
 //-----------------------------------------------------------------------------
@@ -131,52 +459,54 @@ void EntityManager::DeleteEntity(int32_t entityNum, int64_t time)
 // fieldOffset   = the offset of a field relative to the start of an entity
 // entityAddress = the base address of an entity
 
-// pageNumber        = (entityNum & PAGENUMBER_MASK) >> PAGENUMBER_SHIFT
-// entityNumOnPage   = entityNum & ONPAGE_MASK
+// pageNumber        = entityNum >> mPageShift
+// entityNumOnPage   = entityNum & mOnPageMask
 // entityIndexOnPage = entityNumOnPage*mEntitySize;
 // fieldIndexOnPage  = entityNumOnPage*mEntitySize) + fieldOffset
-#define PAGE_NUMBER(en) (((en) & PAGENUMBER_MASK) >> PAGENUMBER_SHIFT)
-#define ENT_NUM_ON_PAGE(en) ((en) & ONPAGE_MASK)
-#define ENT_INDEX_ON_PAGE(en) (((en) & ONPAGE_MASK) * mEntitySize)
-#define FIELD_INDEX_ON_PAGE(en,fl) ((((en) & ONPAGE_MASK) * mEntitySize) + fl)
+#define PAGE_NUMBER(en) ((en) >> mPageShift)
+#define ENT_NUM_ON_PAGE(en) ((en) & mOnPageMask)
+#define ENT_INDEX_ON_PAGE(en) (((en) & mOnPageMask) * mEntitySize)
+#define FIELD_INDEX_ON_PAGE(en,fl) ((((en) & mOnPageMask) * mEntitySize) + fl)
+
+// entityNum        =  address >> mFieldShift
+// fieldOffset      =  address &  mFieldMask
+// entityAddress    =  address & ~mFieldMask
 
-// entityNum        =  address / mEntitySize
-// fieldOffset      =  address % mEntitySize
-// entityAddress    =  address - fieldOffset
+// entityAddress    =  entityNumber  << mFieldShift
+// address          =  entityAddress |  fieldOffset
 
-// entityAddress    =  entityNumber  * mEntitySize
-// address          =  entityAddress + fieldOffset
+// mFieldShift is just wide enough for mEntitySize, so decoding an address
+// needs no division. Addresses use all 32 bits, unsigned, so entity numbers
+// up to mMaxAddressEntity fit (some 16 million for 256 fields). Beyond that
+// GetAddress fails.
 
-// number of entities to iterate = mEntityPages.size() * ENTITIES_PER_PAGE
+// number of entities to iterate = mEntityPages.size() * mEntitiesPerPage
 
 int32_t EntityManager::GetAddress(int32_t entityNum, int32_t fieldOffset)
 {
 	fieldOffset += HEADER_SIZE;
-	// bounds check page
-	int32_t pageNumber = PAGE_NUMBER(entityNum);
-	if (pageNumber < 0 || pageNumber >= (int32_t)mEntityPages.size())
+	if (fieldOffset < HEADER_SIZE || fieldOffset >= mEntitySize)
 		return 0;
-	// free check entity
-	int32_t entityIndex = ENT_INDEX_ON_PAGE(entityNum);
-	if (ENTITY_TIME(&mEntityPages[pageNumber][entityIndex]) != ENTITY_INUSE_VALUE)
+	// bounds and free check entity
+	int32_t slot = entityNum & mSlotMask;
+	if (!LiveEntity(entityNum) || slot > mMaxAddressEntity)
 		return 0;
-	return (entityNum * mEntitySize) + fieldOffset;
+	return (int32_t)(((uint32_t)slot << mFieldShift) | fieldOffset);
 }
 
 float *EntityManager::GetPointer(int32_t entityNum, int32_t fieldOffset)
 {
 	fieldOffset += HEADER_SIZE;
-	if (fieldOffset < HEADER_SIZE || fieldOffset >= mEntitySize)
+	if (fieldOffset < HEADER_SIZE || fieldOffset >= mEntitySize || !mWritable)
 		return 0;
-	// bounds check page
-	int32_t pageNumber  = PAGE_NUMBER(entityNum);
-	if (pageNumber < 0 || pageNumber >= (int32_t)mEntityPages.size())
+	// bounds and free check entity
+	if (!LiveEntity(entityNum))
 		return 0;
-	// free check entity
-	int32_t entityIndex = ENT_INDEX_ON_PAGE(entityNum);
-	if (ENTITY_TIME(&mEntityPages[pageNumber][entityIndex]) != ENTITY_INUSE_VALUE)
-		return 0;
-	return &mEntityPages[pageNumber][entityIndex + fieldOffset];
+	// the caller may write through this
+	int32_t slot = entityNum & mSlotMask;
+	if (mWatchedField >= 0 && (fieldOffset == mWatchedField || fieldOffset == HEADER_SIZE))
+		mWatchedWrites.push_back(slot);
+	return &PageForWrite(PAGE_NUMBER(slot), ENT_NUM_ON_PAGE(slot))[ENT_INDEX_ON_PAGE(slot) + fieldOffset];
 }
 
 //-----------------------------------------------------------------------------
@@ -188,34 +518,26 @@ bool EntityManager::ReadFloat(int32_t entityNum, int32_t fieldOffset, float *f)
 	fieldOffset += HEADER_SIZE;
 	if (fieldOffset < HEADER_SIZE || fieldOffset >= mEntitySize)
 		return false;
-	// bounds check page
-	int32_t pageNumber = PAGE_NUMBER(entityNum);
-	if (pageNumber < 0 || pageNumber >= (int32_t)mEntityPages.size())
-		return false;
-	// free check entity
-	int32_t entityIndex = ENT_INDEX_ON_PAGE(entityNum);
-	if (ENTITY_TIME(&mEntityPages[pageNumber][entityIndex]) != ENTITY_INUSE_VALUE)
+	// bounds and free check entity
+	const float *entity = LiveEntity(entityNum);
+	if (!entity)
 		return false;
-	*f = mEntityPages[pageNumber][entityIndex+fieldOffset];
+	*f = entity[fieldOffset];
 	return true;
 }
 
 bool EntityManager::ReadVector(int32_t entityNum, int32_t fieldOffset, float *v)
 {
 	fieldOffset += HEADER_SIZE;
-	if (fieldOffset < HEADER_SIZE || fieldOffset >= mEntitySize)
+	if (fieldOffset < HEADER_SIZE || fieldOffset + 3 > mEntitySize)
 		return false;
-	// bounds check page
-	int32_t pageNumber = PAGE_NUMBER(entityNum);
-	if (pageNumber < 0 || pageNumber >= (int32_t)mEntityPages.size())
+	// bounds and free check entity
+	const float *entity = LiveEntity(entityNum);
+	if (!entity)
 		return false;
-	// free check entity
-	int32_t entityIndex = ENT_INDEX_ON_PAGE(entityNum);
-	if (ENTITY_TIME(&mEntityPages[pageNumber][entityIndex]) != ENTITY_INUSE_VALUE)
-		return false;
-	v[0] = mEntityPages[pageNumber][entityIndex+fieldOffset  ];
-	v[1] = mEntityPages[pageNumber][entityIndex+fieldOffset+1];
-	v[2] = mEntityPages[pageNumber][entityIndex+fieldOffset+2];
+	v[0] = entity[fieldOffset  ];
+	v[1] = entity[fieldOffset+1];
+	v[2] = entity[fieldOffset+2];
 	return true;
 }
 
@@ -224,15 +546,11 @@ bool EntityManager::ReadInt(int32_t entityNum, int32_t fieldOffset, int *i)
 	fieldOffset += HEADER_SIZE;
 	if (fieldOffset < HEADER_SIZE || fieldOffset >= mEntitySize)
 		return false;
-	// bounds check page
-	int32_t pageNumber = PAGE_NUMBER(entityNum);
-	if (pageNumber < 0 || pageNumber >= (int32_t)mEntityPages.size())
-		return false;
-	// free check entity
-	int32_t entityIndex = ENT_INDEX_ON_PAGE(entityNum);
-	if (ENTITY_TIME(&mEntityPages[pageNumber][entityIndex]) != ENTITY_INUSE_VALUE)
+	// bounds and free check entity
+	const float *entity = LiveEntity(entityNum);
+	if (!entity)
 		return false;
-	*i = (int)mEntityPages[pageNumber][entityIndex+fieldOffset];
+	*i = ((const int32_t*)entity)[fieldOffset];
 	return true;
 }
 
@@ -242,70 +560,430 @@ bool EntityManager::ReadInt(int32_t entityNum, int32_t fieldOffset, int *i)
 
 bool EntityManager::WriteFloat (int32_t address, float f)
 {
-	int32_t entityNumber = address / mEntitySize;
-	int32_t fieldOffset  = address % mEntitySize;
+	int32_t fieldOffset = address & mFieldMask;
 	if (fieldOffset < HEADER_SIZE || fieldOffset >= mEntitySize)
 		return false;
-	// bounds check page
-	int32_t pageNumber = PAGE_NUMBER(entityNumber);
-	if (pageNumber < 0 || pageNumber >= (int32_t)mEntityPages.size())
+	float *field = LiveFieldForWrite(address);
+	if (!field)
 		return false;
-	int32_t entityIndex = ENT_INDEX_ON_PAGE(entityNumber);
-	if (ENTITY_TIME(&mEntityPages[pageNumber][entityIndex]) != ENTITY_INUSE_VALUE)
-		return false;
-	mEntityPages[pageNumber][entityIndex+fieldOffset] = f;
+	*field = f;
 	return true;
 }
 
 bool EntityManager::WriteVector(int32_t address, const float *v)
 {
-	int32_t entityNumber = address / mEntitySize;
-	int32_t fieldOffset  = address % mEntitySize;
-	if (fieldOffset < HEADER_SIZE || fieldOffset >= mEntitySize)
+	int32_t fieldOffset = address & mFieldMask;
+	if (fieldOffset < HEADER_SIZE || fieldOffset + 3 > mEntitySize)
 		return false;
-	// bounds check page
-	int32_t pageNumber = PAGE_NUMBER(entityNumber);
-	if (pageNumber < 0 || pageNumber >= (int32_t)mEntityPages.size())
+	float *field = LiveFieldForWrite(address);
+	if (!field)
 		return false;
-	int32_t entityIndex = ENT_INDEX_ON_PAGE(entityNumber);
-	if (ENTITY_TIME(&mEntityPages[pageNumber][entityIndex]) != ENTITY_INUSE_VALUE)
-		return false;
-	mEntityPages[pageNumber][entityIndex+fieldOffset  ] = v[0];
-	mEntityPages[pageNumber][entityIndex+fieldOffset+1] = v[1];
-	mEntityPages[pageNumber][entityIndex+fieldOffset+2] = v[2];
+	field[0] = v[0];
+	field[1] = v[1];
+	field[2] = v[2];
 	return true;
 }
 
 bool EntityManager::WriteInt(int32_t address, int i)
 {
-	int32_t entityNumber = address / mEntitySize;
-	int32_t fieldOffset  = address % mEntitySize;
+	int32_t fieldOffset = address & mFieldMask;
 	if (fieldOffset < HEADER_SIZE || fieldOffset >= mEntitySize)
 		return false;
-	// bounds check page
-	int32_t pageNumber = PAGE_NUMBER(entityNumber);
-	if (pageNumber < 0 || pageNumber >= (int32_t)mEntityPages.size())
+	float *field = LiveFieldForWrite(address);
+	if (!field)
 		return false;
-	int32_t entityIndex = ENT_INDEX_ON_PAGE(entityNumber);
-	if (ENTITY_TIME(&mEntityPages[pageNumber][entityIndex]) != ENTITY_INUSE_VALUE)
+	*(int32_t*)field = i;
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// Save/Restore
+//-----------------------------------------------------------------------------
+
+bool EntityManager::Save(ostream &out)
+{
+	assert(mInit);
+	int32_t layout[4] = { mEntitySize, mEntitiesPerPage, GetEntityGenerations(), (int32_t)mEntityPages.size() };
+	out.write((const char*)layout, sizeof(layout));
+	vector<float> scratch;
+	for (int i=0; i<(int)mEntityPages.size(); ++i)
+	{
+		out.write((const char*)PageForSave(i, scratch), mPageSize * sizeof(float));
+	}
+	return out.good();
+}
+
+bool EntityManager::Restore(istream &in)
+{
+	assert(mInit);
+	int32_t layout[4];
+	if (!in.read((char*)layout, sizeof(layout)))
+		return false;
+	if (layout[0] != mEntitySize || layout[1] != mEntitiesPerPage || layout[2] != GetEntityGenerations() ||
+		layout[3] <= 0 || (int64_t)layout[3] > ((int64_t)1 << (mSlotBits - mPageShift)))
 		return false;
-	((int32_t*)&mEntityPages[pageNumber])[entityIndex+fieldOffset] = i;
+	mFirstFree = 0;
+
+	// size our pages to match, then read over them
+	int32_t numPages = layout[3];
+	ResizePages(numPages);
+	for (int i=0; i<numPages; ++i)
+	{
+		// a shared page would be copied only to be overwritten
+		if (!mPageOwned[i] && mPages[i]->refCount > 1)
+		{
+			--mPages[i]->refCount;
+			mPages[i] = new EntityPage;
+			mPages[i]->refCount = 1;
+			mPages[i]->data     = AllocPageData();
+			mEntityPages[i]     = mPages[i]->data;
+		}
+		mPageOwned[i] = 1;
+		mPageStamps[i] = mWriteEpoch;
+		mEntityStamps[i].assign(mEntitiesPerPage, mWriteEpoch);
+		vector<int32_t>().swap(mReleasedGenerations[i]);
+		if (!in.read((char*)mEntityPages[i], mPageSize * sizeof(float)))
+			return false;
+	}
 	return true;
 }
 
+// Delta layout:
+//
+// int32[4]                        entity size, entities per page, generation
+//                                 bits, page count
+// { int32 first, int32 count, float[count * entity size] } per run
+// int32 -1                        end of runs
+//
+// Runs never cross a page, so each is contiguous in memory.
+
+bool EntityManager::SaveDelta(ostream &out, uint32_t checkpoint)
+{
+	assert(mInit);
+	int32_t layout[4] = { mEntitySize, mEntitiesPerPage, GetEntityGenerations(), (int32_t)mEntityPages.size() };
+	out.write((const char*)layout, sizeof(layout));
+	vector<float> scratch;
+	for (int i=0; i<(int)mEntityPages.size(); ++i)
+	{
+		if (mPageStamps[i] <= checkpoint)
+			continue;
+		const uint32_t *stamps = &mEntityStamps[i][0];
+		const float *page = PageForSave(i, scratch);
+		for (int j=0; j<mEntitiesPerPage; )
+		{
+			if (stamps[j] <= checkpoint)
+			{
+				++j;
+				continue;
+			}
+			int32_t run[2] = { (i << mPageShift) + j, 0 };
+			int first = j;
+			while (j < mEntitiesPerPage && stamps[j] > checkpoint)
+			{
+				++j;
+			}
+			run[1] = j - first;
+			out.write((const char*)run, sizeof(run));
+			out.write((const char*)&page[first*mEntitySize], run[1] * mEntitySize * sizeof(float));
+		}
+	}
+	int32_t end = -1;
+	out.write((const char*)&end, sizeof(end));
+	return out.good();
+}
+
+bool EntityManager::ApplyDelta(istream &in)
+{
+	assert(mInit);
+	int32_t layout[4];
+	if (!in.read((char*)layout, sizeof(layout)))
+		return false;
+	if (layout[0] != mEntitySize || layout[1] != mEntitiesPerPage || layout[2] != GetEntityGenerations() ||
+		layout[3] <= 0 || (int64_t)layout[3] > ((int64_t)1 << (mSlotBits - mPageShift)))
+		return false;
+	// the source may have released pages from its end
+	ResizePages(layout[3]);
+	mFirstFree = 0;
+
+	int32_t run[2];
+	while (in.read((char*)run, sizeof(int32_t)) && run[0] >= 0)
+	{
+		if (!in.read((char*)&run[1], sizeof(int32_t)))
+			return false;
+		int32_t pageNumber = PAGE_NUMBER(run[0]);
+		int32_t first      = ENT_NUM_ON_PAGE(run[0]);
+		if (pageNumber >= (int32_t)mEntityPages.size() ||
+			run[1] <= 0 || first + run[1] > mEntitiesPerPage)
+			return false;
+		float *page = PageForWrite(pageNumber, first);
+		for (int j=first+1; j<first+run[1]; ++j)
+		{
+			mEntityStamps[pageNumber][j] = mWriteEpoch;
+		}
+		if (!in.read((char*)&page[first*mEntitySize], run[1] * mEntitySize * sizeof(float)))
+			return false;
+	}
+	return in.good();
+}
+
+//-----------------------------------------------------------------------------
+// Columns
+//-----------------------------------------------------------------------------
+
+int32_t EntityManager::Gather(const int32_t *fieldOffsets, const int32_t *widths, int32_t count,
+	float *const *columns, int32_t maxEntities, int32_t *entities)
+{
+	assert(mInit);
+	for (int32_t f=0; f<count; ++f)
+	{
+		if (fieldOffsets[f] < 0 || widths[f] <= 0 || HEADER_SIZE + fieldOffsets[f] + widths[f] > mEntitySize)
+			return -1;
+	}
+	int32_t gathered = 0;
+	for (int i=0; i<(int)mEntityPages.size() && gathered<maxEntities; ++i)
+	{
+		const float *entity = mEntityPages[i];
+		for (int j=0; j<mEntitiesPerPage && gathered<maxEntities; ++j, entity+=mEntitySize)
+		{
+			if (ENTITY_TIME(entity) < ENTITY_INUSE_MIN)
+				continue;
+			for (int32_t f=0; f<count; ++f)
+			{
+				const float *field = &entity[HEADER_SIZE + fieldOffsets[f]];
+				float *column = &columns[f][gathered * widths[f]];
+				for (int32_t k=0; k<widths[f]; ++k)
+				{
+					column[k] = field[k];
+				}
+			}
+			entities[gathered++] = EntityNumber((i << mPageShift) + j);
+		}
+	}
+	return gathered;
+}
+
+bool EntityManager::Scatter(const int32_t *fieldOffsets, const int32_t *widths, int32_t count,
+	const float *const *columns, int32_t numEntities, const int32_t *entities)
+{
+	assert(mInit);
+	if (!mWritable)
+		return false;
+	for (int32_t f=0; f<count; ++f)
+	{
+		if (fieldOffsets[f] < 0 || widths[f] <= 0 || HEADER_SIZE + fieldOffsets[f] + widths[f] > mEntitySize)
+			return false;
+	}
+	bool watched = false;
+	for (int32_t f=0; f<count; ++f)
+	{
+		if (mWatchedField >= HEADER_SIZE + fieldOffsets[f] && mWatchedField < HEADER_SIZE + fieldOffsets[f] + widths[f])
+			watched = true;
+	}
+	bool allLive = true;
+	for (int32_t e=0; e<numEntities; ++e)
+	{
+		if (!LiveEntity(entities[e]))
+		{
+			allLive = false;
+			continue;
+		}
+		int32_t slot = entities[e] & mSlotMask;
+		float *entity = &PageForWrite(PAGE_NUMBER(slot), ENT_NUM_ON_PAGE(slot))[ENT_INDEX_ON_PAGE(slot)];
+		if (watched)
+			mWatchedWrites.push_back(slot);
+		for (int32_t f=0; f<count; ++f)
+		{
+			float *field = &entity[HEADER_SIZE + fieldOffsets[f]];
+			const float *column = &columns[f][e * widths[f]];
+			for (int32_t k=0; k<widths[f]; ++k)
+			{
+				field[k] = column[k];
+			}
+		}
+	}
+	return allLive;
+}
+
+//-----------------------------------------------------------------------------
+// Compaction
+//-----------------------------------------------------------------------------
+
+bool EntityManager::PageReusable(int32_t pageNumber, int64_t time)
+{
+	bool generations = mSlotBits < 31;
+	const float *page = mEntityPages[pageNumber];
+	for (int j=0; j<mEntitiesPerPage; ++j)
+	{
+		int64_t entityTime = ENTITY_TIME(&page[j*mEntitySize]);
+		if (entityTime >= ENTITY_INUSE_MIN || (!generations && entityTime > time))
+			return false;
+	}
+	return true;
+}
+
+int32_t EntityManager::ReleaseFreePages(int64_t time)
+{
+	assert(mInit);
+	bool generations = mSlotBits < 31;
+	int32_t released = 0;
+	for (int i=0; i<(int)mEntityPages.size(); ++i)
+	{
+		if (mPages[i] == mZeroPage || !PageReusable(i, time))
+			continue;
+		// the slots' next generations are kept aside, or a stale number
+		// would match whatever is created there next
+		if (generations)
+		{
+			vector<int32_t> &kept = mReleasedGenerations[i];
+			kept.resize(mEntitiesPerPage);
+			bool any = false;
+			for (int j=0; j<mEntitiesPerPage; ++j)
+			{
+				kept[j] = (int32_t)-ENTITY_TIME(&mEntityPages[i][j*mEntitySize]);
+				any = any || kept[j] != 0;
+			}
+			if (!any)
+				vector<int32_t>().swap(kept);
+		}
+		if (!mZeroPage)
+		{
+			mZeroPage = new EntityPage;
+			mZeroPage->refCount = 1;
+			mZeroPage->data     = AllocPageData();
+		}
+		if (--mPages[i]->refCount == 0)
+		{
+			FreePageData(mPages[i]->data);
+			delete mPages[i];
+		}
+		++mZeroPage->refCount;
+		mPages[i]       = mZeroPage;
+		mEntityPages[i] = mZeroPage->data;
+		// never ours, so the first write copies it
+		mPageOwned[i]   = 0;
+		mPageStamps[i]  = mWriteEpoch;
+		mEntityStamps[i].assign(mEntitiesPerPage, mWriteEpoch);
+		++released;
+	}
+	// keep the first page, as CreateEntity expects one, and those with
+	// generations kept aside
+	int32_t numPages = (int32_t)mEntityPages.size();
+	while (numPages > 1 && mPages[numPages-1] == mZeroPage && mReleasedGenerations[numPages-1].empty())
+	{
+		--numPages;
+	}
+	ResizePages(numPages);
+	return released;
+}
+
+void EntityManager::Defragment(int64_t time, vector<int32_t> &from, vector<int32_t> &to)
+{
+	assert(mInit);
+	from.clear();
+	to.clear();
+	bool generations = mSlotBits < 31;
+	int32_t low  = mFirstFree;
+	int32_t high = ((int32_t)mEntityPages.size() << mPageShift) - 1;
+	for (;;)
+	{
+		// the lowest reusable slot, and the highest in use above it
+		int64_t lowTime = 0;
+		for (; low < high; ++low)
+		{
+			lowTime = ENTITY_TIME(&mEntityPages[PAGE_NUMBER(low)][ENT_INDEX_ON_PAGE(low)]);
+			if (lowTime < ENTITY_INUSE_MIN && (generations || lowTime <= time))
+				break;
+		}
+		for (; high > low; --high)
+		{
+			if (ENTITY_TIME(&mEntityPages[PAGE_NUMBER(high)][ENT_INDEX_ON_PAGE(high)]) >= ENTITY_INUSE_MIN)
+				break;
+		}
+		if (low >= high)
+			break;
+
+		// get the destination first, as making it ours may move the source
+		float *dest = &PageForWrite(PAGE_NUMBER(low), ENT_NUM_ON_PAGE(low))[ENT_INDEX_ON_PAGE(low)];
+		const float *source = &mEntityPages[PAGE_NUMBER(high)][ENT_INDEX_ON_PAGE(high)];
+		memcpy(&dest[HEADER_SIZE], &source[HEADER_SIZE], (mEntitySize - HEADER_SIZE) * sizeof(float));
+		ENTITY_TIME(dest) = ENTITY_INUSE_VALUE - (generations ? -ENTITY_TIME(dest) : 0);
+		if (mWatchedField >= 0)
+			mWatchedWrites.push_back(low);
+
+		from.push_back(EntityNumber(high));
+		to.push_back(EntityNumber(low));
+		DeleteEntity(from.back(), time);
+		++low;
+		--high;
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Watch
+//-----------------------------------------------------------------------------
+
+void EntityManager::WatchField(int32_t fieldOffset)
+{
+	mWatchedField = fieldOffset < 0 ? -1 : HEADER_SIZE + fieldOffset;
+	mWatchedWrites.clear();
+}
+
+void EntityManager::TakeWatchedWrites(vector<int32_t> &slots)
+{
+	slots.clear();
+	slots.swap(mWatchedWrites);
+}
+
+void EntityManager::SetAccessLog(vector<int32_t> *reads, vector<int32_t> *writes)
+{
+	mReadLog  = reads;
+	mWriteLog = writes;
+}
+
+void EntityManager::CopyEntity(EntityManager &source, int32_t slot)
+{
+	assert(source.mEntitySize == mEntitySize && source.mEntitiesPerPage == mEntitiesPerPage);
+	if (PAGE_NUMBER(slot) >= (int32_t)source.mEntityPages.size())
+		return;
+	while (PAGE_NUMBER(slot) >= (int32_t)mEntityPages.size())
+		CreateEntityPage();
+	float *dest = &PageForWrite(PAGE_NUMBER(slot), ENT_NUM_ON_PAGE(slot))[ENT_INDEX_ON_PAGE(slot)];
+	memcpy(dest, &source.mEntityPages[PAGE_NUMBER(slot)][ENT_INDEX_ON_PAGE(slot)], mEntitySize * sizeof(float));
+	if (mWatchedField >= 0)
+		mWatchedWrites.push_back(slot);
+}
+
+bool EntityManager::WrittenSince(int32_t slot, uint32_t checkpoint)
+{
+	if (slot < 0 || PAGE_NUMBER(slot) >= (int32_t)mEntityPages.size())
+		return false;
+	return mEntityStamps[PAGE_NUMBER(slot)][ENT_NUM_ON_PAGE(slot)] > checkpoint;
+}
+
 //-----------------------------------------------------------------------------
 // Iterate
 //-----------------------------------------------------------------------------
 
+int32_t EntityManager::GetSlotEntity(int32_t slot)
+{
+	if (slot < 0 || PAGE_NUMBER(slot) >= (int32_t)mEntityPages.size())
+		return -1;
+	if (ENTITY_TIME(&mEntityPages[PAGE_NUMBER(slot)][ENT_INDEX_ON_PAGE(slot)]) < ENTITY_INUSE_MIN)
+		return -1;
+	return EntityNumber(slot);
+}
+
 int32_t EntityManager::GetFirstEntity()
 {
+	if (mReadLog)
+		mReadLog->push_back(-1);
 	for (int i=0; i<(int)mEntityPages.size(); ++i)
 	{
-		for (int j=0; j<ENTITIES_PER_PAGE; ++j)
+		for (int j=0; j<mEntitiesPerPage; ++j)
 		{
-			if (mEntityPages[i][j*mEntitySize] == ENTITY_INUSE_VALUE)
+			if (ENTITY_TIME(&mEntityPages[i][j*mEntitySize]) >= ENTITY_INUSE_MIN)
 			{
-				return i*ENTITIES_PER_PAGE + j;
+				return EntityNumber((i << mPageShift) + j);
 			}
 		}
 	}
@@ -318,28 +996,31 @@ int32_t EntityManager::GetNextEntity(int32_t entityNum)
 	// entities we will get the number we started with.
 	// Also it's a weird kind of loop.
 
-	int32_t pageNumber = PAGE_NUMBER(entityNum);
+	if (mReadLog)
+		mReadLog->push_back(-1);
+	int32_t slot = entityNum & mSlotMask;
+	int32_t pageNumber = PAGE_NUMBER(slot);
 	assert(pageNumber >= 0 && pageNumber < (int32_t)mEntityPages.size());
 
-	int num = entityNum + 1;
-	while (num != entityNum)
+	int num = slot + 1;
+	while (num != slot)
 	{
-		if (num > (int)mEntityPages.size()*ENTITIES_PER_PAGE)
+		if (PAGE_NUMBER(num) >= (int)mEntityPages.size())
 		{
 			num = 0;
-			if (num == entityNum)
+			if (num == slot)
 				break;
 		}
 
 		int pageNumber  = PAGE_NUMBER(num);
 		int entityIndex = ENT_INDEX_ON_PAGE(num);
 
-		if (ENTITY_TIME(&mEntityPages[pageNumber][entityIndex]) != ENTITY_INUSE_VALUE)
-			return num;
+		if (ENTITY_TIME(&mEntityPages[pageNumber][entityIndex]) >= ENTITY_INUSE_MIN)
+			return EntityNumber(num);
 
 		++num;
 	}
-	return num;
+	return entityNum;
 }
 
 //-----------------------------------------------------------------------------
@@ -31,22 +31,62 @@ kzqcvm/entitymanager.h
 
 #include <stdint.h>
 #include <vector>
+#include <atomic>
+#include <istream>
+#include <ostream>
 
 //-----------------------------------------------------------------------------
 namespace kzqcvm {
 	using std::vector;
+	using std::istream;
+	using std::ostream;
 //-----------------------------------------------------------------------------
 
 class EntityManager {
+	friend class StatePublisher;
+	friend class PublishedState;
 public:
 	EntityManager();
 	~EntityManager();
 
 	void Init(int32_t entitySize, float entityReuseTime);
 
+	// Entity numbers are a page number above the entity's place on its page,
+	// so pages hold a power of two entities: DEFAULT_ENTITIES_PER_PAGE
+	// unless set otherwise here. Returns false, changing nothing, if the
+	// count isn't a power of two within MAX_ENTITIES_PER_PAGE, or if any
+	// entity is in use.
+	bool SetEntitiesPerPage(int32_t entitiesPerPage);
+	int32_t GetEntitiesPerPage() const { return mEntitiesPerPage; }
+
+	static const int32_t DEFAULT_ENTITIES_PER_PAGE = 256;
+	static const int32_t MAX_ENTITIES_PER_PAGE     = 1 << 20;
+
+	// With generations, entity numbers carry the generation of their slot in
+	// the top generationBits of the number, and each deletion moves the slot
+	// on to the next generation. Numbers from before then no longer match,
+	// so reads through them fail, and the slot can be reused at once instead
+	// of after the reuse delay. 0 turns generations off. Returns false,
+	// changing nothing, if too few bits would be left for the slots or if
+	// any entity is in use.
+	bool SetEntityGenerations(int generationBits);
+	int GetEntityGenerations() const { return 31 - mSlotBits; }
+
+	static const int MAX_GENERATION_BITS = 16;
+
+	// Discards our own entities and shares all of source's pages instead.
+	// Pages are copied by whichever manager next writes to them, so this is
+	// O(pages) and the two managers are independent afterwards.
+	void Fork(EntityManager &source);
+	// Lets go of the pages still shared with others, so that writes to them
+	// elsewhere needn't copy them. Only entities on pages we have written
+	// since can be read afterwards, with CopyEntity, until the next Fork.
+	void ReleaseSharedPages();
+
 	// Returns an address usable by the Write* methods below.
 	// Returns 0 if the entity or field were out of bounds or if entityNum
-	// specifies an unused entity.
+	// specifies an unused entity. Addresses hold the slot but not the
+	// generation, so they should not be kept past a deletion.
 	int32_t  GetAddress(int32_t entityNum, int32_t fieldOffset);
 	// Returns a pointer to the actual data.
 	// Returns NULL if the entity or field were out of bounds or if entityNum
@@ -68,20 +108,257 @@ public:
 	bool ReadVector(int32_t entityNum, int32_t fieldOffset, float *v);
 	bool ReadInt   (int32_t entityNum, int32_t fieldOffset, int *i);
 
+	// As above, for callers which have already proven that the field lies
+	// within the entity, with room for the value. Only the entity itself is
+	// checked. The Write* addresses must each be either one GetAddress gave
+	// for such a field, or 0, which GetAddress gives on failure.
+	int32_t GetAddressInBounds(int32_t entityNum, int32_t fieldOffset)
+	{
+		int32_t slot = entityNum & mSlotMask;
+		if (!LiveEntity(entityNum) || slot > mMaxAddressEntity)
+			return 0;
+		return (int32_t)(((uint32_t)slot << mFieldShift) | (HEADER_SIZE + fieldOffset));
+	}
+	bool ReadFloatInBounds(int32_t entityNum, int32_t fieldOffset, float *f)
+	{
+		const float *entity = LiveEntity(entityNum);
+		if (!entity)
+			return false;
+		*f = entity[HEADER_SIZE+fieldOffset];
+		return true;
+	}
+	bool ReadVectorInBounds(int32_t entityNum, int32_t fieldOffset, float *v)
+	{
+		const float *entity = LiveEntity(entityNum);
+		if (!entity)
+			return false;
+		v[0] = entity[HEADER_SIZE+fieldOffset  ];
+		v[1] = entity[HEADER_SIZE+fieldOffset+1];
+		v[2] = entity[HEADER_SIZE+fieldOffset+2];
+		return true;
+	}
+	bool ReadIntInBounds(int32_t entityNum, int32_t fieldOffset, int *i)
+	{
+		const float *entity = LiveEntity(entityNum);
+		if (!entity)
+			return false;
+		*i = ((const int32_t*)entity)[HEADER_SIZE+fieldOffset];
+		return true;
+	}
+	bool WriteFloatInBounds(int32_t address, float f)
+	{
+		float *field = LiveFieldForWrite(address);
+		if (!field)
+			return false;
+		*field = f;
+		return true;
+	}
+	bool WriteVectorInBounds(int32_t address, const float *v)
+	{
+		float *field = LiveFieldForWrite(address);
+		if (!field)
+			return false;
+		field[0] = v[0];
+		field[1] = v[1];
+		field[2] = v[2];
+		return true;
+	}
+	bool WriteIntInBounds(int32_t address, int i)
+	{
+		float *field = LiveFieldForWrite(address);
+		if (!field)
+			return false;
+		*(int32_t*)field = i;
+		return true;
+	}
+
 	int32_t CreateEntity(int64_t time);
 	void    DeleteEntity(int32_t entityNum, int64_t time);
 
+	// As above for count entities at once, filling runs of free slots a
+	// page at a time and adding whole pages for the rest. Consecutive
+	// numbers are cleared together on deletion.
+	void CreateEntities(int32_t count, int64_t time, int32_t *entities);
+	void DeleteEntities(const int32_t *entities, int32_t count, int64_t time);
+
 	int32_t GetFirstEntity();
 	int32_t GetNextEntity(int32_t entityNum);
 
+	// The slot an entity number refers to, and the number of the entity in
+	// a slot, or -1 if it isn't in use.
+	int32_t GetSlot(int32_t entityNum) { return entityNum & mSlotMask; }
+	int32_t GetSlotEntity(int32_t slot);
+
+	// Notes the slot of each entity whose field at fieldOffset may have been
+	// written: by the Write* methods, or by Scatter or Defragment, or by
+	// handing out a pointer to that field or to the whole entity. The same
+	// slot can be noted more than once. -1 stops watching.
+	void WatchField(int32_t fieldOffset);
+	// Hands over the slots noted since the last call.
+	void TakeWatchedWrites(vector<int32_t> &slots);
+
+	// While set, the slot of every entity looked up to be read, or written,
+	// is added to reads or writes, repeating as often as it happens. Walking
+	// the entities reads them all, which is noted as a slot of -1. NULL
+	// stops logging.
+	void SetAccessLog(vector<int32_t> *reads, vector<int32_t> *writes);
+
+	// Copies the whole of an entity slot from source, which must have the
+	// same layout, as a write.
+	void CopyEntity(EntityManager &source, int32_t slot);
+
+	// While not writable, writes to fields fail as if the entity weren't in
+	// use, and so do GetPointer and Scatter. Creating and deleting entities
+	// still works. Writable by default.
+	void SetWritable(bool writable) { mWritable = writable; }
+	bool GetWritable() const { return mWritable; }
+
+	// Whether the entity slot has been written since the given checkpoint.
+	bool WrittenSince(int32_t slot, uint32_t checkpoint);
+
+	// Copies fields of every entity in use, lowest first, into columns: for
+	// each of the count fields, widths[i] floats per entity from fieldOffsets[i],
+	// stored one entity after another in columns[i]. Stops after
+	// maxEntities, and fills entities with the numbers of those copied.
+	// Returns how many were copied, or -1 if a field is out of bounds.
+	int32_t Gather(const int32_t *fieldOffsets, const int32_t *widths, int32_t count,
+		float *const *columns, int32_t maxEntities, int32_t *entities);
+	// The reverse, for numEntities given entities. Entities not in use are
+	// skipped. Returns false if any were, or if a field is out of bounds.
+	bool Scatter(const int32_t *fieldOffsets, const int32_t *widths, int32_t count,
+		const float *const *columns, int32_t numEntities, const int32_t *entities);
+
+	// Gives back the memory of pages none of whose entities are in use, and
+	// all of which could be reused by time. Such pages after the last in use
+	// are dropped; those before it share one page of zeros until written.
+	// Entity numbers are unaffected. With generations, those of the slots on
+	// a released page are kept aside, an int each, until it is written, and
+	// a page at the end with any to keep isn't dropped. Otherwise the reuse
+	// times start again from zero. Returns the number of pages released.
+	int32_t ReleaseFreePages(int64_t time);
+
+	// Moves entities in use from the top down into the lowest slots which
+	// could be reused by time, so later pages can be released. Each move
+	// is listed as a pair of entity numbers in from and to, and the old
+	// number is deleted as by DeleteEntity. References to moved entities
+	// held in field values are not updated here.
+	void Defragment(int64_t time, vector<int32_t> &from, vector<int32_t> &to);
+
+	// Writes or reads every page verbatim, including the reuse timestamps.
+	// Restore reads straight into our own pages, reusing those we have.
+	// Returns false if the stream fails or the layout doesn't match ours.
+	bool Save(ostream &out);
+	bool Restore(istream &in);
+
+	// Every write to an entity is stamped with the current checkpoint
+	// number. Checkpoint() returns that number and moves on to the next, so
+	// the entities written since a checkpoint are those with a higher stamp.
+	// GetPointer counts as a write, as the caller may write through it.
+	uint32_t Checkpoint() { return mWriteEpoch++; }
+
+	// Writes the entities changed since the given checkpoint as runs of
+	// consecutive entities, and reads them back over our own.
+	bool SaveDelta(ostream &out, uint32_t checkpoint);
+	bool ApplyDelta(istream &in);
+
 private:
+	// time is represented as a 64 bit int spread over two floats
+	static const int     HEADER_SIZE        = 2;
+	// An entity in use has a header of ENTITY_INUSE_VALUE less its
+	// generation, which is always 0 without generations. A free one has the
+	// time it can be reused, or with generations, its next generation negated.
+	static const int64_t ENTITY_INUSE_VALUE = INT64_MAX;
+	static const int64_t ENTITY_INUSE_MIN   = INT64_MAX - INT32_MAX;
+
+	// The entity's data if it is in use and of entityNum's generation, else
+	// NULL.
+	float *LiveEntity(int32_t entityNum)
+	{
+		int32_t slot = entityNum & mSlotMask;
+		if (mReadLog)
+			mReadLog->push_back(slot);
+		int32_t pageNumber = slot >> mPageShift;
+		if (pageNumber >= (int32_t)mEntityPages.size())
+			return NULL;
+		float *entity = &mEntityPages[pageNumber][(slot & mOnPageMask) * mEntitySize];
+		if (*(int64_t*)entity != ENTITY_INUSE_VALUE - (int64_t)((uint32_t)entityNum >> mSlotBits))
+			return NULL;
+		return entity;
+	}
+	// The field at an address known to be in bounds, ready to be written,
+	// if its entity is in use, else NULL.
+	float *LiveFieldForWrite(int32_t address)
+	{
+		if (address == 0 || !mWritable)
+			return NULL;
+		int32_t slot = (uint32_t)address >> mFieldShift;
+		int32_t pageNumber = slot >> mPageShift;
+		if (pageNumber >= (int32_t)mEntityPages.size())
+			return NULL;
+		int32_t entityIndex = (slot & mOnPageMask) * mEntitySize;
+		if (*(int64_t*)&mEntityPages[pageNumber][entityIndex] < ENTITY_INUSE_MIN)
+			return NULL;
+		float *page = PageForWrite(pageNumber, slot & mOnPageMask);
+		if ((address & mFieldMask) == mWatchedField)
+			mWatchedWrites.push_back(slot);
+		return &page[entityIndex + (address & mFieldMask)];
+	}
+	// The entity number for an entity in use in the given slot.
+	int32_t EntityNumber(int32_t slot)
+	{
+		const float *entity = &mEntityPages[slot >> mPageShift][(slot & mOnPageMask) * mEntitySize];
+		int64_t generation = ENTITY_INUSE_VALUE - *(const int64_t*)entity;
+		return (int32_t)((uint32_t)generation << mSlotBits | (uint32_t)slot);
+	}
+	void ResetPages();
+	void ResizePages(int32_t numPages);
+	bool PageReusable(int32_t pageNumber, int64_t time);
+
 	void CreateEntityPage();
+	float *AllocPageData();
+	void FreePageData(float *data);
+	void ReleasePages();
+	void UnsharePage(int32_t pageNumber);
+	void WriteGenerations(float *page, const vector<int32_t> &generations);
+	const float *PageForSave(int32_t pageNumber, vector<float> &scratch);
+
+	// Every path which can modify an entity must get its page through here.
+	float *PageForWrite(int32_t pageNumber, int32_t entityNumOnPage)
+	{
+		if (!mPageOwned[pageNumber])
+			UnsharePage(pageNumber);
+		mPageStamps[pageNumber] = mWriteEpoch;
+		mEntityStamps[pageNumber][entityNumOnPage] = mWriteEpoch;
+		if (mWriteLog)
+			mWriteLog->push_back((pageNumber << mPageShift) | entityNumOnPage);
+		return mEntityPages[pageNumber];
+	}
 
 	bool  mInit;
 
 	int   mEntitySize;
 	int   mPageSize;
+	int32_t mEntitiesPerPage;
+	int     mPageShift;
+	int32_t mOnPageMask;
+	// no entity below this is free, so CreateEntity starts looking here
+	int32_t mFirstFree;
+	// entity numbers are a generation above mSlotBits bits of slot, see
+	// SetEntityGenerations; 31 bits of slot without generations
+	int     mSlotBits;
+	int32_t mSlotMask;
+	// see GetAddress
+	int     mFieldShift;
+	int32_t mFieldMask;
+	int32_t mMaxAddressEntity;
 	float mEntityReuseTime;
+	// see WatchField; HEADER_SIZE on from the field, or -1
+	int32_t         mWatchedField;
+	vector<int32_t> mWatchedWrites;
+	// see SetAccessLog
+	vector<int32_t> *mReadLog;
+	vector<int32_t> *mWriteLog;
+	bool             mWritable;
 
 	// In this implementation, we divide entities up into pages.
 	// Used entities have a value of FLT_MAX while unused entities use the
@@ -89,6 +366,26 @@ private:
 	// On deletion we set to time + entityReuseTime
 	// On creation we requre that it <= time
 	vector<float*> mEntityPages;
+
+	// Pages can be shared between forked managers. We only track sharing
+	// here; the data pointers above are what the read paths use.
+	// mPageOwned is set when we know we hold the only reference.
+	struct EntityPage {
+		std::atomic<int> refCount;
+		float           *data;
+	};
+	vector<EntityPage*> mPages;
+	vector<char>        mPageOwned;
+	// shared by released pages, and never written; NULL until needed
+	EntityPage         *mZeroPage;
+	// with generations, the next generation of each slot on a released
+	// page, until the page is written; empty for other pages
+	vector<vector<int32_t> > mReleasedGenerations;
+
+	// Dirty tracking. These belong to this manager, not to shared pages.
+	uint32_t                 mWriteEpoch;
+	vector<uint32_t>         mPageStamps;
+	vector<vector<uint32_t> > mEntityStamps;
 };
 
 //-----------------------------------------------------------------------------
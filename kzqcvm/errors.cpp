@@ -32,6 +32,7 @@ kzqcvm/errors.cpp
 
 #include "kzqcvm.h"
 #include "instructions.h"
+#include "code.h"
 
 //-----------------------------------------------------------------------------
 namespace kzqcvm {
@@ -57,11 +58,11 @@ void Kzqcvm::AddErrorLine(string message)
 	mErrorLog << message << endl;
 }
 
-void Kzqcvm::TraceFunction(QcvmFunction *func, QcvmStatement *programCounter)
+void Kzqcvm::TraceFunction(const QcvmFunction *func, const QcvmStatement *programCounter)
 {
 	mErrorLog << "  in " << &mStringData[func->nameOffset] << endl;
 
-	QcvmStatement *statement = programCounter;
+	const QcvmStatement *statement = programCounter;
 	int statementNum = statement - mStatements;
 	for (int i=0; i<6 && statement >= mStatements; ++i, --statement, --statementNum)
 	{
@@ -102,6 +103,16 @@ void Kzqcvm::TraceFunction(QcvmFunction *func, QcvmStatement *programCounter)
 	}
 }
 
+// Traces code as the statements it was decoded from. Inlined code traces
+// the function it came from as well as the call it replaced.
+void Kzqcvm::TraceCode(const QcvmFunction *func, const Code *code, const CodeInstruction *programCounter)
+{
+	const CodeSource &source = code->sources[programCounter - &code->instructions[0]];
+	TraceFunction(&mFunctions[source.function], &mStatements[source.statement]);
+	if (source.callStatement >= 0)
+		TraceFunction(func, &mStatements[source.callStatement]);
+}
+
 QcvmError Kzqcvm::GetLastError()
 {
 	return mError;
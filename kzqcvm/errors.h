@@ -42,7 +42,8 @@ enum QcvmError {
 	ERR_INVALID_READ,
 	ERR_INVALID_WRITE,
 	ERR_INVALID_INSTRUCTION,
-	ERR_NOT_IMPLEMENTED
+	ERR_NOT_IMPLEMENTED,
+	ERR_FIELD_NOT_FOUND
 };
 
 //-----------------------------------------------------------------------------
@@ -27,13 +27,18 @@ kzqcvm/functions.cpp
 #include "kzqcvm.h"
 #include "data.h"
 
+#include <assert.h>
+#include <string.h>
 #include <string>
 #include <map>
+#include <vector>
 #include <iostream>
 
 //-----------------------------------------------------------------------------
 namespace kzqcvm {
 	using std::string;
+	using std::vector;
+	using std::endl;
 //-----------------------------------------------------------------------------
 
 Function Kzqcvm::GetFunction(string name)
@@ -54,6 +59,70 @@ bool Kzqcvm::RunFunction(Function &func)
 	return RunFunction(func.number, &count);
 }
 
+int32_t Kzqcvm::RunForEach(Function &func, EntityPointer &self, const vector<Entity> &entities,
+	vector<Entity> &failed)
+{
+	assert(self.qcvm == this && self);
+	failed.clear();
+	int functionNum = func.number;
+
+	vector<float> stackData;
+	bool hoisted = BeginBatch(functionNum, stackData);
+	for (int i=0; i<(int)entities.size(); ++i)
+	{
+		assert(entities[i].qcvm == this);
+		*self.value = entities[i].entNum;
+		int count = 0;
+		if (!RunBatched(functionNum, hoisted, stackData, &count))
+		{
+			mErrorLog << "  for entity " << entities[i].entNum << endl;
+			failed.push_back(entities[i]);
+		}
+	}
+	EndBatch(functionNum, hoisted, stackData);
+	return (int32_t)failed.size();
+}
+
+// Returns true if the function is QuakeC for the interpreter, in which case
+// its locals are saved in stackData once for the whole batch, and RunBatched
+// puts them back before running its code each time, so every run starts
+// from the same locals as it would under RunFunction. Builtins and native
+// functions have nothing to hoist, and are run by RunFunction as usual.
+bool Kzqcvm::BeginBatch(int functionNum, vector<float> &stackData)
+{
+	if (functionNum <= 0 || functionNum >= mHeader->functions_num ||
+		mFunctions[functionNum].offsetFirstStatement < 0 ||
+		(mNativeFunctions && mNativeFunctions[functionNum]))
+	{
+		return false;
+	}
+	const QcvmFunction *function = &mFunctions[functionNum];
+	stackData.assign(&mGlobalData[function->offsetLocalsInGlobals],
+		&mGlobalData[function->offsetLocalsInGlobals + function->numLocals]);
+	return true;
+}
+
+bool Kzqcvm::RunBatched(int functionNum, bool hoisted, const vector<float> &stackData,
+	int *instructionCount)
+{
+	if (!hoisted)
+		return RunFunction(functionNum, instructionCount);
+	if (!stackData.empty())
+	{
+		memcpy(&mGlobalData[mFunctions[functionNum].offsetLocalsInGlobals], &stackData[0],
+			stackData.size() * sizeof(float));
+	}
+	return RunCode(functionNum, instructionCount);
+}
+
+void Kzqcvm::EndBatch(int functionNum, bool hoisted, const vector<float> &stackData)
+{
+	if (!hoisted || stackData.empty())
+		return;
+	memcpy(&mGlobalData[mFunctions[functionNum].offsetLocalsInGlobals], &stackData[0],
+		stackData.size() * sizeof(float));
+}
+
 //-----------------------------------------------------------------------------
 } // namespace
 //-----------------------------------------------------------------------------
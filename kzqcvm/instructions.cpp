@@ -66,8 +66,8 @@ InstructionInfo instruction_info[] = {
 	{ Instructions::LOAD_V,     "LOAD_V",     { IT_ENTITY,   IT_FIELD,    IT_VECTOR   } },
 	{ Instructions::LOAD_S,     "LOAD_S",     { IT_ENTITY,   IT_FIELD,    IT_STRING   } },
 	{ Instructions::LOAD_ENT,   "LOAD_ENT",   { IT_ENTITY,   IT_FIELD,    IT_ENTITY   } },
-	{ Instructions::LOAD_F,     "LOAD_FLD",   { IT_ENTITY,   IT_FIELD,    IT_FIELD    } },
-	{ Instructions::LOAD_F,     "LOAD_FNC",   { IT_ENTITY,   IT_FIELD,    IT_FUNCTION } },
+	{ Instructions::LOAD_FLD,   "LOAD_FLD",   { IT_ENTITY,   IT_FIELD,    IT_FIELD    } },
+	{ Instructions::LOAD_FNC,   "LOAD_FNC",   { IT_ENTITY,   IT_FIELD,    IT_FUNCTION } },
 
 	{ Instructions::ADDRESS,    "ADDRESS",    { IT_ENTITY,   IT_FIELD,    IT_ADDRESS  } },
 
@@ -27,6 +27,7 @@ kzqcvm/kzqcvm.cpp
 #include "kzqcvm.h"
 #include "instructions.h"
 
+#include <string.h>
 #include <iostream>
 
 //-----------------------------------------------------------------------------
@@ -41,10 +42,81 @@ namespace kzqcvm {
 
 Kzqcvm::Kzqcvm(string filename)
 {
-	mFilename   = filename;
+	ProgsImage *image = new ProgsImage(filename);
+	Load(image);
+	image->Release();
+}
+
+Kzqcvm::Kzqcvm(ProgsImage *image)
+{
+	Load(image);
+}
+
+Kzqcvm::Kzqcvm(const void *data, size_t size)
+{
+	ProgsImage *image = new ProgsImage(data, size);
+	Load(image);
+	image->Release();
+}
+
+Kzqcvm::~Kzqcvm()
+{
+	Unload();
+}
+
+//-----------------------------------------------------------------------------
+// Fork
+//-----------------------------------------------------------------------------
 
-	mQcvmSize   = 0;
-	mQcvmData   = NULL;
+Kzqcvm *Kzqcvm::Fork()
+{
+	Kzqcvm *fork = new Kzqcvm(mImage);
+	if (!fork->IsLoaded())
+		return fork;
+
+	memcpy(fork->mGlobalData, mGlobalData, mHeader->globaldata_num * sizeof(float));
+	fork->ReleaseChangedConstants();
+	fork->mEntityManager.Fork(mEntityManager);
+	fork->mStringManager.Fork(mStringManager);
+	fork->mBuiltins   = mBuiltins;
+	fork->dataObject  = dataObject;
+	fork->mNextthinkField = mNextthinkField;
+	fork->mThinkField     = mThinkField;
+	if (mThinksEnabled)
+	{
+		fork->mThinksEnabled = true;
+		fork->WatchThinks();
+	}
+	fork->mParallelBuiltins = mParallelBuiltins;
+	fork->mThinkThreads     = mThinkThreads;
+	fork->mSharedGlobals    = mSharedGlobals;
+	if (mNativeHandle)
+		fork->LoadNativeModule(mNativeFilename);
+	return fork;
+}
+
+// Brings a fork made earlier back up to date with us, as Fork would.
+void Kzqcvm::SyncFork(Kzqcvm *fork)
+{
+	memcpy(fork->mGlobalData, mGlobalData, mHeader->globaldata_num * sizeof(float));
+	fork->ReleaseChangedConstants();
+	fork->mEntityManager.Fork(mEntityManager);
+	fork->mStringManager.Fork(mStringManager);
+	fork->mBuiltins         = mBuiltins;
+	fork->mParallelBuiltins = mParallelBuiltins;
+	fork->mSharedGlobals    = mSharedGlobals;
+	fork->dataObject        = dataObject;
+	fork->ClearErrors();
+	fork->mThinkAborted     = false;
+}
+
+//-----------------------------------------------------------------------------
+// Load/Unload
+//-----------------------------------------------------------------------------
+
+void Kzqcvm::Load(ProgsImage *image)
+{
+	mImage      = NULL;
 	mHeader     = NULL;
 	mStatements = NULL;
 	mGlobalDefs = NULL;
@@ -55,38 +127,153 @@ Kzqcvm::Kzqcvm(string filename)
 
 	mGlobalDefData = NULL;
 	mFieldOffsetTypes = NULL;
+	mEntityLayoutHash = 0;
+
+	mCurrentCode = NULL;
+	mOwnCode    = NULL;
 
 	mError      = ERR_NONE;
 
 	dataObject  = NULL;
 
-	Load();
-}
+	mNativeHandle    = NULL;
+	mNativeFunctions = NULL;
 
-Kzqcvm::~Kzqcvm()
-{
-	Unload();
-}
+	mThinksEnabled = false;
+	mThinksStale   = true;
+	mThinkThreads  = 1;
+	mThinkWorker   = false;
+	mThinkAborted  = false;
+	mThinkPool     = NULL;
 
-//-----------------------------------------------------------------------------
-// Unload
-//-----------------------------------------------------------------------------
+	if (image == NULL || !image->IsLoaded())
+		return;
+
+	image->AddRef();
+	mImage      = image;
+
+	mHeader     = image->mHeader;
+	mStatements = image->mStatements;
+	mGlobalDefs = image->mGlobalDefs;
+	mFieldDefs  = image->mFieldDefs;
+	mFunctions  = image->mFunctions;
+	mStringData = image->mStringData;
+
+	mGlobalDefData = image->mGlobalDefData;
+	mFieldOffsetTypes = image->mFieldOffsetTypes;
+
+	UseCode(&image->mCode);
+
+	// the only lump which changes at runtime, so take our own copy, along
+	// with the globals the image added after it
+	const Code &code = image->mCode;
+	mGlobalData = new float[code.globalsNum];
+	memcpy(mGlobalData, image->mGlobalData, mHeader->globaldata_num * sizeof(float));
+	if (!code.extraGlobalData.empty())
+	{
+		memcpy(&mGlobalData[mHeader->globaldata_num], &code.extraGlobalData[0],
+			code.extraGlobalData.size() * sizeof(float));
+	}
+
+	// init the managers
+	mEntityManager.Init(mHeader->entity_size, ENTITY_REUSE_DELAY);
+	mStringManager.Init(mStringData, mHeader->stringdata_size);
+	HashEntityLayout();
+	InitThinks();
+}
 
 void Kzqcvm::Unload()
 {
-	delete[] mQcvmData;
-	mQcvmSize   = 0;
-	mQcvmData   = NULL;
+	ReleaseThinkWorkers();
+	UnloadNativeModule();
+
+	delete[] mGlobalData;
+	mGlobalData = NULL;
+
+	if (mImage)
+		mImage->Release();
+	mImage      = NULL;
 	mHeader     = NULL;
 	mStatements = NULL;
 	mGlobalDefs = NULL;
 	mFieldDefs  = NULL;
 	mFunctions  = NULL;
 	mStringData = NULL;
-	mGlobalData = NULL;
 
-	delete[] mGlobalDefData;
-	delete[] mFieldOffsetTypes;
+	mGlobalDefData = NULL;
+	mFieldOffsetTypes = NULL;
+
+	mCurrentCode = NULL;
+
+	delete mOwnCode;
+	mOwnCode    = NULL;
+	for (size_t i=0; i<mRetiredCode.size(); ++i)
+	{
+		delete mRetiredCode[i];
+	}
+	mRetiredCode.clear();
+}
+
+//-----------------------------------------------------------------------------
+// Code
+//-----------------------------------------------------------------------------
+
+void Kzqcvm::UseCode(const Code *code)
+{
+	mCurrentCode = code;
+}
+
+// Stops treating the globals from offset as constants, by decoding our own
+// code without them. QC may be running the old code, and may go on running
+// it till it returns, so that is kept till we unload.
+void Kzqcvm::ReleaseConstants(int32_t offset, int32_t count)
+{
+	vector<char> constants = mCurrentCode->constants;
+	bool released = false;
+	for (int32_t i=offset; i<offset+count && i<(int32_t)constants.size(); ++i)
+	{
+		if (constants[i])
+		{
+			constants[i] = 0;
+			released = true;
+		}
+	}
+	if (released)
+		DecodeOwnCode(constants);
+}
+
+// For when the globals have been overwritten wholesale, from a fork's parent
+// or a saved state, either of which may have had constants of theirs
+// released and changed.
+void Kzqcvm::ReleaseChangedConstants()
+{
+	vector<char> constants = mCurrentCode->constants;
+	const int32_t *initialValues = (const int32_t*)mImage->mGlobalData;
+	const int32_t *intGlobalData = (const int32_t*)mGlobalData;
+	bool released = false;
+	for (int32_t i=0; i<(int32_t)constants.size(); ++i)
+	{
+		if (constants[i] && intGlobalData[i] != initialValues[i])
+		{
+			constants[i] = 0;
+			released = true;
+		}
+	}
+	if (released)
+		DecodeOwnCode(constants);
+}
+
+void Kzqcvm::DecodeOwnCode(const vector<char> &constants)
+{
+	Code *code = new Code();
+	mImage->Decode(*code, constants);
+	if (mOwnCode)
+		mRetiredCode.push_back(mOwnCode);
+	mOwnCode = code;
+	UseCode(mOwnCode);
+	// the released globals may be shared between thinks now
+	if (mThinkThreads > 1 && !mThinkWorker)
+		FindSharedGlobals();
 }
 
 //-----------------------------------------------------------------------------
@@ -109,7 +296,7 @@ string Kzqcvm::NameForGlobalOffset(int16_t ofs, QcvmDefinitionType type)
 {
 	for (int i=0; i<mHeader->globaldefs_num; ++i)
 	{
-		if (((mGlobalDefs[i].type & GLOBALDEF_TYPE_MASK) == type) && (mGlobalDefs[i].offset == ofs))
+		if (((mGlobalDefs[i].type & ProgsImage::GLOBALDEF_TYPE_MASK) == type) && (mGlobalDefs[i].offset == ofs))
 		{
 			return string(&mStringData[mGlobalDefs[i].nameOffset]);
 		}
@@ -133,7 +320,7 @@ string Kzqcvm::NameForFieldOffset(int16_t ofs, QcvmDefinitionType type)
 {
 	for (int i=0; i<mHeader->fielddefs_num; ++i)
 	{
-		if (((mFieldDefs[i].type & GLOBALDEF_TYPE_MASK) == type) && (mFieldDefs[i].offset == ofs))
+		if (((mFieldDefs[i].type & ProgsImage::GLOBALDEF_TYPE_MASK) == type) && (mFieldDefs[i].offset == ofs))
 		{
 			return string(&mStringData[mFieldDefs[i].nameOffset]);
 		}
@@ -154,7 +341,7 @@ void Kzqcvm::Dump()
 	{
 		cout << i << ",";
 		cout << &mStringData[mGlobalDefs[i].nameOffset] << ",";
-		cout << (mGlobalDefs[i].type & GLOBALDEF_TYPE_MASK) << ",";
+		cout << (mGlobalDefs[i].type & ProgsImage::GLOBALDEF_TYPE_MASK) << ",";
 		cout << mGlobalDefs[i].offset << ",";
 		if (mGlobalDefs[i].type == FLOAT)
 		{
@@ -32,18 +32,30 @@ kzqcvm/kzqcvm.h
 #include <stdint.h>
 #include <string>
 #include <map>
+#include <set>
+#include <vector>
 #include <sstream>
+#include <istream>
+#include <ostream>
+#include <utility>
 
 #include "structs.h"
+#include "progsimage.h"
 #include "errors.h"
+#include "native.h"
 #include "stringmanager.h"
 #include "entitymanager.h"
+#include "thinkwheel.h"
 
 //-----------------------------------------------------------------------------
 namespace kzqcvm {
 	using std::string;
 	using std::map;
+	using std::vector;
 	using std::ostringstream;
+	using std::istream;
+	using std::ostream;
+	using std::pair;
 //-----------------------------------------------------------------------------
 
 /*
@@ -129,16 +141,60 @@ class Kzqcvm {
 public:
 	/*
 	Constructs with a filename. It will try to load and validate the file.
+	As with ProgsImage, replace the file by renaming over it, not in place.
 	*/
 	Kzqcvm(string filename);
+	/*
+	Constructs from an already loaded image, sharing its read-only data. Only
+	the global data and the entity and string managers are allocated for this
+	instance. The image gains a reference, so the caller may release its own
+	as soon as the Kzqcvm is constructed. An image which failed to load gives
+	a Kzqcvm which also fails IsLoaded().
+	*/
+	Kzqcvm(ProgsImage *image);
+	/*
+	Constructs from a progs already in memory. The data is used in place, so
+	it must stay valid and unchanged for the life of this QCVM and any
+	others sharing its image.
+	*/
+	Kzqcvm(const void *data, size_t size);
 	~Kzqcvm();
 
 	/*
 	Returns true if a valid QCVM is loaded, else false.
 	*/
-	bool IsLoaded() { return mQcvmData != NULL; }
+	bool IsLoaded() { return mImage != NULL; }
 	int32_t GetCRC() { if (!IsLoaded()) return 0; return mHeader->crc; }
 
+	/*
+	Returns the image this QCVM runs, for constructing further instances of
+	the same progs. The pointer is only valid while this QCVM exists, unless
+	you AddRef() it.
+	*/
+	ProgsImage *GetImage() { return mImage; }
+
+	/*
+	Creates an independent copy of this QCVM, for simulating ahead and then
+	throwing the result away. The fork shares the progs image, and shares
+	entity pages and zoned strings copy-on-write, so the cost is in the pages
+	that either side goes on to modify. Globals are small and are copied
+	outright. Builtins and dataObject are carried over; errors and temp
+	strings are not. Don't fork while QC is running. Delete the fork when
+	finished with it.
+	*/
+	Kzqcvm *Fork();
+
+	/*
+	Threads. A Kzqcvm is used by one thread at a time: running QC changes its
+	globals, stack, temp strings and errors as it goes. Separate Kzqcvms,
+	including forks of each other, may run on different threads at once, as
+	the image they share is never modified after loading, and the pages and
+	strings they share are reference counted atomically and copied before
+	either side writes them. Forking reads the original, so it must not be
+	running at the time. See ExecutionContext in context.h for running QC
+	against a world from other threads.
+	*/
+
 	// DO NOT USE ANY OTHER FUNCTIONS IF IsLoaded() RETURNS FALSE
 
 	/*
@@ -153,6 +209,10 @@ public:
 	Global values are accessed with the following functions. They all return
 	either a valid pointer, or a null pointer if no global could be found with
 	the given name and the requested type.
+
+	Globals that no QC ever stores to are compiled into the code as constants.
+	Asking for a pointer to one gives that up for this QCVM, which costs it a
+	decode of its own; so get pointers once, up front, rather than per frame.
 	*/
 	FloatPointer    GetFloatPointer   (string name);
 	VectorPointer   GetVectorPointer  (string name);
@@ -174,8 +234,45 @@ public:
 	Entity CreateEntity(int64_t time);
 	void DeleteEntity(Entity entity, int64_t time);
 
+	/*
+	As above, for many entities at once, such as when a map loads. The new
+	entities are added to the end of entities. Creating them together finds
+	all the free slots in one pass, and any more are put on new pages.
+	*/
+	void CreateEntities(int32_t count, int64_t time, vector<Entity> &entities);
+	void DeleteEntities(const vector<Entity> &entities, int64_t time);
+
 	static constexpr float ENTITY_REUSE_DELAY = 2.0f;
 
+	/*
+	Entities are stored in pages, each holding a power of two entities. The
+	default of 256 suits a few thousand entities; worlds with hundreds of
+	thousands or millions of them should use larger pages, such as 4096, so
+	there are fewer pages to look through. The page size can only be changed
+	while no entities exist, and returns false if it can't be or if the count
+	is not a power of two. Saved states and deltas can only be loaded into an
+	instance with the same page size as the one they came from.
+	*/
+	bool SetEntitiesPerPage(int32_t entitiesPerPage);
+	int32_t GetEntitiesPerPage();
+
+	/*
+	Instead of the reuse delay, entities can carry a generation count in the
+	top generationBits of their numbers. Deleting an entity moves its slot on
+	to the next generation, so older copies of its number no longer refer to
+	anything: reading or writing through them raises ERR_INVALID_READ or
+	ERR_INVALID_WRITE, and deleting through them does nothing. The slot itself
+	is reused by the very next CreateEntity, whatever the time. Up to
+	MAX_GENERATION_BITS can be used; 8 still leaves room for 8 million
+	entities. 0 turns generations off again. As with the page size, this can
+	only be changed while no entities exist, and saved states only load into
+	instances with the same setting.
+	*/
+	bool SetEntityGenerations(int generationBits);
+	int GetEntityGenerations();
+
+	static const int MAX_GENERATION_BITS = EntityManager::MAX_GENERATION_BITS;
+
 	/*
 	Field offsets can be retrieved with the following functions. They return a
 	null field if none could be found with that name. If a type is given, then
@@ -194,6 +291,64 @@ public:
 	Entity GetFirstEntity();
 	Entity NextEntity(Entity entity);
 
+	/*
+	WriteEntityStruct writes a C++ header declaring a struct named structName
+	laid out exactly as an entity's fields are in this progs: a float for each
+	float field, float[3] for each vector and int32_t for the other types,
+	which hold string, entity, field and function numbers. The struct is
+	stamped with the progs CRC and GetEntityLayoutHash, a hash of the field
+	definitions. tools/kzqcstruct.cpp wraps this.
+
+	EntityData<T> checks those stamps against this progs and returns the
+	entity's fields as a T, or NULL if T doesn't match or the entity is not
+	in use. As with GetFloatPointer, it counts as a write for deltas. The
+	pointer is only good until entities are next created, deleted or
+	compacted, or the world is forked or restored.
+	*/
+	bool WriteEntityStruct(ostream &out, string structName);
+	uint64_t GetEntityLayoutHash() { return mEntityLayoutHash; }
+	template <class T> T *EntityData(Entity &entity)
+	{
+		if (T::PROGS_CRC != GetCRC() || T::LAYOUT_HASH != mEntityLayoutHash)
+			return NULL;
+		return (T*)GetEntityData(entity);
+	}
+
+	/*
+	Copies the given fields of every entity, in the order NextEntity visits
+	them from GetFirstEntity, into caller provided arrays, one per field.
+	Each entity takes 3 floats in a vector field's array and 1 in any other,
+	where non-float values are copied as their raw bits. At most maxEntities
+	are copied, and entities is filled with the Entity of each row. Returns
+	the number of rows, or -1 if a field is null.
+
+	ScatterFields writes rows laid out the same way back to the given
+	entities, skipping those no longer in use. It returns false if any were
+	skipped, or if a field is null. Both check each field once rather than
+	for every entity.
+	*/
+	int32_t GatherFields(const vector<Field> &fields, float *const *columns, int32_t maxEntities,
+		vector<Entity> &entities);
+	bool    ScatterFields(const vector<Field> &fields, const float *const *columns,
+		const vector<Entity> &entities);
+
+	/*
+	Entity pages only grow as entities are created. After a spike, call
+	ReleaseFreeEntityPages to give back the memory of pages with no entities
+	left on them, once time has passed their reuse delay. It returns how
+	many pages were released.
+
+	DefragmentEntities first moves entities from the highest slots down into
+	free ones, so that their pages can be released. Entity globals, and
+	entity fields of every entity, are updated to the new numbers, and each
+	move is added to moved as a pair of old and new Entity so the host can
+	update its own references. Any other copies of the old numbers, such as
+	in parameters, are not updated. It must not be called while a function
+	is running, for instance from a builtin.
+	*/
+	int32_t ReleaseFreeEntityPages(int64_t time);
+	void DefragmentEntities(int64_t time, vector<pair<Entity, Entity> > &moved);
+
 	// Get a fields's type (Using Field.GetType is prefered)
 	QcvmDefinitionType GetFieldType(Field f);
 
@@ -219,12 +374,15 @@ public:
 
 	/*
 	Allocate and free permanent Strings. Allocated Strings persist until Freed.
+	The String given to Alloc may come from another QCVM, or the text from
+	anywhere at all.
 	*/
 	String Alloc(String s);
+	String Alloc(string s);
 	bool   Free(String s);
 
 	// Get a string's value (Using String.GetValue is prefered)
-	char *GetStringValue(String s);
+	const char *GetStringValue(String s);
 
 	// ---- FUNCTIONS & PARAMETERS --------------------------------------------
 
@@ -236,6 +394,18 @@ public:
 	// Run a function (Using Function.Run is prefered)
 	bool RunFunction(Function &func);
 
+	/*
+	Runs a function once for each of the given entities, with self (usually
+	the "self" global) set to each in turn, as for a frame's think or touch
+	functions. The checks and the saving of the function's locals are done
+	once for the whole batch rather than for every entity. An error stops
+	only the run for that entity: it is added to failed, its trace is logged
+	as usual and followed by the entity's number, and the batch carries on.
+	Returns the number of entities that failed.
+	*/
+	int32_t RunForEach(Function &func, EntityPointer &self, const vector<Entity> &entities,
+		vector<Entity> &failed);
+
 	/*
 	These return pointers to the return value and the eight parameter values
 	respectively. The parameter value is always truncated to a value from 0
@@ -254,6 +424,68 @@ public:
 	FunctionPointer GetParameterFunctionPointer(int parm);
 	FieldPointer    GetParameterFieldPointer   (int parm);
 
+	// ---- THINKS ------------------------------------------------------------
+
+	/*
+	The QCVM can schedule each entity's think function by its nextthink
+	field, as a Quake server does, so that a frame costs only the thinks that
+	fall due rather than a look at every entity. EnableThinks names the float
+	field holding the time an entity next thinks and the function field it
+	calls then. It returns false if either is missing, or the progs has no
+	"self" entity or "time" float global. From then on every write to
+	nextthink by QC, and every pointer handed out to it, is noted, and the
+	entity is kept in a timing wheel by the time written. A pointer kept and
+	written through later, or an EntityData write, isn't seen, so follow
+	those with ScheduleThink.
+
+	RunThinks runs the think of each entity whose nextthink is above zero and
+	no later than endTime, earliest first, as Quake's SV_RunThink does: it
+	zeroes nextthink, and sets "time" to the nextthink, or to startTime if
+	that is later, "self" to the entity and "other", if there is one, to
+	world. Consecutive entities with the same think are run as one batch, as
+	by RunForEach. A think which sets a nextthink before endTime runs at the
+	next call, not this one. Failed entities are added to failed as with
+	RunForEach, and the number of thinks run is returned.
+
+	The STATE instruction, QuakeC's [frame, function] shorthand, sets self's
+	"frame" field to frame, its think to function and its nextthink to time
+	plus STATE_FRAME_TIME. It needs the same fields and globals, and uses
+	Quake's "nextthink" and "think" unless EnableThinks names others. A
+	progs using STATE without a "frame" field, or the "self" and "time"
+	globals, fails to load. Without the think fields it loads, but STATE
+	fails with ERR_FIELD_NOT_FOUND when run.
+	*/
+	bool    EnableThinks(string nextthinkField = "nextthink", string thinkField = "think");
+	void    ScheduleThink(Entity &entity);
+	int32_t RunThinks(float startTime, float endTime, vector<Entity> &failed);
+
+	static constexpr float STATE_FRAME_TIME = 0.1f;
+
+	/*
+	With SetThinkThreads above 1, RunThinks spreads the due thinks over that
+	many threads. Each runs a share of consecutive thinks in a fork of this
+	QCVM brought up to date for the purpose, logging the entities they read
+	and write and noting whether they change any global QC stores to, other
+	than those RunThinks sets itself. The shares are then taken back in
+	order, copying their written entities and globals, for as long as none
+	could have seen what an earlier one wrote or changed. The first that
+	could have is run again here, one think at a time, and the rest go round
+	again, so the outcome is always that of running the thinks in order.
+	Frames with too few thinks to be worth sharing are run here as usual.
+	The threads are started by the first frame which needs them, and kept
+	till the QCVM is unloaded or SetThinkThreads is called again.
+
+	Builtins are only called from the other threads if SetBuiltinParallel
+	has marked them safe to be: they must not create or delete entities or
+	strings, and must be thread safe in whatever else they use. A think
+	calling any other builtin stops its share, which is then run again here.
+	SetThinkThreads returns false if threads is below 1.
+	*/
+	bool SetThinkThreads(int threads);
+	void SetBuiltinParallel(int number, bool parallel);
+
+	static const int32_t MIN_THINKS_PER_THREAD = 16;
+
 	// ---- BUILTINS ----------------------------------------------------------
 
 	/*
@@ -291,6 +523,58 @@ public:
 	string GetFunctionName(int i);
 	Function GetFunction(int i);
 
+	// ---- STATE -------------------------------------------------------------
+
+	/*
+	Save and restore the complete state of the world: the globals, every
+	entity page including the reuse timestamps, and the zoned strings. The
+	format is binary and versioned, and is keyed by the progs CRC so a state
+	can only be loaded into a QCVM running the same progs. Temp strings are
+	not part of the state. Streams should be opened in binary mode.
+
+	LoadState returns false without changing anything if the state is from a
+	different progs or format. If the stream fails part way through it also
+	returns false, and the world should be considered garbage.
+	Don't save or load while QC is running.
+	*/
+	bool SaveState(ostream &out);
+	bool LoadState(istream &in);
+
+	/*
+	Incremental snapshots. Checkpoint() returns a number identifying the
+	current state of the world. SaveDelta writes only what has changed since
+	that checkpoint: the entities that were written, the zoned string slots
+	that changed, and the globals (which are small enough to always include).
+	ApplyDelta replays a delta onto a QCVM that is in the checkpoint's state,
+	such as one restored from a full state saved at that point.
+
+	Anything that can write to an entity counts as a change, including the
+	host asking for a pointer to one of its fields.
+	*/
+	uint32_t Checkpoint();
+	bool     SaveDelta(ostream &out, uint32_t checkpoint);
+	bool     ApplyDelta(istream &in);
+
+	// ---- NATIVE ------------------------------------------------------------
+
+	/*
+	Writes C++ source for every QuakeC function in the progs, to be compiled
+	into a shared object and loaded with LoadNativeModule. Each function is
+	translated statement for statement from what the interpreter would do,
+	so behaviour, errors and traces are unchanged. Builtins, and functions
+	whose jumps leave the progs, are left to the interpreter.
+
+	LoadNativeModule opens such a shared object and runs its functions in
+	place of the interpreter. It returns false, and the interpreter carries
+	on as before, if the module can't be opened or was built from a different
+	progs or against a different version of native.h. The progs must match
+	byte for byte, by CRC and a hash of its whole contents, since mods built
+	against the same engine share a CRC. A fork loads the same module.
+	*/
+	bool TranslateToCpp(ostream &out);
+	bool LoadNativeModule(string filename);
+	bool IsNative() { return mNativeFunctions != NULL; }
+
 	// ---- ERROR REPORTING ---------------------------------------------------
 
 	QcvmError GetLastError();
@@ -309,9 +593,23 @@ public:
 	void Dump();
 
 private:
-	void Load();
+	friend struct NativeCallbacks;
+	friend class ExecutionContext;
+	friend class StatePublisher;
+	friend class PublishedState;
+
+	void Load(ProgsImage *image);
 	void Unload();
+	void SyncFork(Kzqcvm *fork);
 	bool RunFunction(int functionNum, int *instructionCount);
+	bool RunCode(int functionNum, int *instructionCount);
+	// see RunForEach
+	bool BeginBatch(int functionNum, vector<float> &stackData);
+	bool RunBatched(int functionNum, bool hoisted, const vector<float> &stackData, int *instructionCount);
+	void EndBatch(int functionNum, bool hoisted, const vector<float> &stackData);
+	bool FieldColumns(const vector<Field> &fields, vector<int32_t> &offsets, vector<int32_t> &widths);
+	float *GetEntityData(Entity &entity);
+	void HashEntityLayout();
 
 	static const int16_t OFS_RETURN = 1;
 	static const int16_t OFS_PARM0  = 4;
@@ -323,28 +621,36 @@ private:
 	static const int16_t OFS_PARM6  = 22;
 	static const int16_t OFS_PARM7  = 25;
 
-	string           mFilename;
+	ProgsImage      *mImage;
 
-	int32_t          mQcvmSize;
-	char            *mQcvmData;
+	// these point into mImage, and are shared with any other instances
+	const QcvmHeader     *mHeader;
+	const QcvmStatement  *mStatements;
+	const QcvmDefinition *mGlobalDefs;
+	const QcvmDefinition *mFieldDefs;
+	const QcvmFunction   *mFunctions;
+	const char           *mStringData;
 
-	QcvmHeader      *mHeader;
-	QcvmStatement   *mStatements;
-	QcvmDefinition  *mGlobalDefs;
-	QcvmDefinition  *mFieldDefs;
-	QcvmFunction    *mFunctions;
-	char            *mStringData;
-	float           *mGlobalData;
+	const char           *mGlobalDefData;
 
-	static const int  GLOBALDEF_TYPE_MASK = 0x07;
+	const QcvmDefinitionType *mFieldOffsetTypes;
 
-	static const char GLOBAL_DEF_SYSTEM  = 1 << 0;
-	static const char GLOBAL_DEF_FIELD   = 1 << 1;
-	static const char GLOBAL_DEF_LOCAL   = 1 << 2;
-	static const char GLOBAL_DEF_SPECIAL = 1 << 3;
-	char            *mGlobalDefData;
+	// see WriteEntityStruct
+	uint64_t              mEntityLayoutHash;
 
-	QcvmDefinitionType *mFieldOffsetTypes;
+	// the decoded code, see code.h; the image's, unless we've had to decode
+	// our own with fewer constants. RunCode reads it once per call.
+	const Code            *mCurrentCode;
+	Code                  *mOwnCode;
+	// replaced code which QC might still be running
+	vector<Code*>          mRetiredCode;
+	void UseCode(const Code *code);
+	void ReleaseConstants(int32_t offset, int32_t count);
+	void ReleaseChangedConstants();
+	void DecodeOwnCode(const vector<char> &constants);
+
+	// this is our own copy
+	float           *mGlobalData;
 
 	string NameForGlobalOffset(int16_t ofs);
 	string NameForGlobalOffset(int16_t ofs, QcvmDefinitionType type);
@@ -359,12 +665,63 @@ private:
 	int                        mNumCallParameters;
 	bool RunBuiltin(int builtinNum);
 
+	// native module
+	string                mNativeFilename;
+	void                 *mNativeHandle;
+	const NativeFunction *mNativeFunctions;
+	NativeContext         mNativeContext;
+	void UnloadNativeModule();
+
+	// thinks, see EnableThinks; offsets are -1 if the progs lacks them
+	int32_t          mFrameField;
+	int32_t          mNextthinkField;
+	int32_t          mThinkField;
+	int32_t          mSelfGlobal;
+	int32_t          mTimeGlobal;
+	int32_t          mOtherGlobal;
+	bool             mThinksEnabled;
+	// the wheel must be rebuilt from every entity's nextthink
+	bool             mThinksStale;
+	ThinkWheel       mThinkWheel;
+	void InitThinks();
+	void WatchThinks();
+	void UpdateThinks();
+	void ScheduleThink(int32_t entityNum);
+	int32_t FindGlobal(const char *name, QcvmDefinitionType type);
+	QcvmError RunState(float frame, int32_t think);
+	struct DueThink;
+	int32_t RunDueThinks(const DueThink *due, int32_t count, float startTime, vector<Entity> &failed);
+
+	// parallel thinks, see SetThinkThreads
+	struct ThinkShare;
+	struct ThinkPool;
+	int              mThinkThreads;
+	vector<Kzqcvm*>  mThinkWorkers;
+	// threads which run the workers but the first, kept from frame to frame;
+	// NULL until needed
+	ThinkPool       *mThinkPool;
+	std::set<int>    mParallelBuiltins;
+	// set in the forks doing the work, and set again by one if it calls a
+	// builtin not marked parallel
+	bool             mThinkWorker;
+	bool             mThinkAborted;
+	// globals QC can store to, which a think might leave changed for the next
+	vector<int32_t>  mSharedGlobals;
+	void FindSharedGlobals();
+	void ReleaseThinkWorkers();
+	void StartThinkThreads(int threads);
+	static void ThinkThreadMain(ThinkPool *pool, int index, uint32_t round);
+	static void RunThinkShare(ThinkShare *share);
+	void TakeThinkShare(ThinkShare &share, vector<Entity> &failed);
+	int32_t RunThinksParallel(const vector<DueThink> &due, float startTime, vector<Entity> &failed);
+
 	// errors
 	QcvmError     mError;
 	ostringstream mErrorLog;
 
 	void StartError(QcvmError errorType, string errorName);
-	void TraceFunction(QcvmFunction *func, QcvmStatement *programCounter);
+	void TraceFunction(const QcvmFunction *func, const QcvmStatement *programCounter);
+	void TraceCode(const QcvmFunction *func, const Code *code, const CodeInstruction *programCounter);
 };
 
 //-----------------------------------------------------------------------------
@@ -24,13 +24,18 @@ SOFTWARE.
 kzqcvm/load.cpp
 */
 
-#include "kzqcvm.h"
+#include "progsimage.h"
 #include "instructions.h"
 
 #include <string.h>
 #include <iostream>
 #include <fstream>
 
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
 //-----------------------------------------------------------------------------
 namespace kzqcvm {
 	using std::cout;
@@ -40,19 +45,170 @@ namespace kzqcvm {
 	using std::ios_base;
 //-----------------------------------------------------------------------------
 
+//-----------------------------------------------------------------------------
+// Structors
+//-----------------------------------------------------------------------------
+
+ProgsImage::ProgsImage(string filename)
+{
+	Init();
+	mFilename   = filename;
+	Load();
+}
+
+ProgsImage::ProgsImage(string filename, string cacheFilename)
+{
+	Init();
+	mFilename   = filename;
+	mCacheFilename = cacheFilename;
+	Load();
+}
+
+ProgsImage::ProgsImage(const void *data, size_t size)
+{
+	Init();
+	mFilename   = "<memory>";
+
+	if (size > 0x7fffffff)
+	{
+		cout << "Progs " << mFilename << " is too large" << endl;
+		return;
+	}
+	// used in place; Setup copies it if it needs patching
+	mDataSource = DATA_EXTERNAL;
+	mQcvmSize   = size;
+	mQcvmData   = (char*)data;
+	Setup();
+}
+
+void ProgsImage::Init()
+{
+	mRefCount   = 1;
+
+	mContentHash = 0;
+	mFromCache   = false;
+
+	mDataSource = DATA_NONE;
+	mQcvmSize   = 0;
+	mQcvmData   = NULL;
+	mHeader     = NULL;
+	mStatements = NULL;
+	mGlobalDefs = NULL;
+	mFieldDefs  = NULL;
+	mFunctions  = NULL;
+	mStringData = NULL;
+	mStringCopy = NULL;
+	mGlobalData = NULL;
+
+	mGlobalDefData = NULL;
+	mFieldOffsetTypes = NULL;
+}
+
+ProgsImage::~ProgsImage()
+{
+	Unload();
+}
+
+void ProgsImage::AddRef()
+{
+	++mRefCount;
+}
+
+void ProgsImage::Release()
+{
+	if (--mRefCount == 0)
+		delete this;
+}
+
+//-----------------------------------------------------------------------------
+// Unload
+//-----------------------------------------------------------------------------
+
+void ProgsImage::Unload()
+{
+	switch (mDataSource)
+	{
+	case DATA_ALLOCATED:
+		delete[] mQcvmData;
+		break;
+	case DATA_MAPPED:
+		munmap(mQcvmData, mQcvmSize);
+		break;
+	default:
+		break;
+	}
+	mDataSource = DATA_NONE;
+	mQcvmSize   = 0;
+	mQcvmData   = NULL;
+	mHeader     = NULL;
+	mStatements = NULL;
+	mGlobalDefs = NULL;
+	mFieldDefs  = NULL;
+	mFunctions  = NULL;
+	mStringData = NULL;
+	mGlobalData = NULL;
+
+	delete[] mStringCopy;
+	mStringCopy = NULL;
+
+	delete[] mGlobalDefData;
+	delete[] mFieldOffsetTypes;
+	mGlobalDefData = NULL;
+	mFieldOffsetTypes = NULL;
+
+	mCode = Code();
+}
+
 //-----------------------------------------------------------------------------
 // Load
 //-----------------------------------------------------------------------------
 
-void Kzqcvm::Load()
+void ProgsImage::Load()
+{
+	if (!MapFile() && !ReadFile())
+	{
+		cout << "Could not open Progs " << mFilename << endl;
+		return;
+	}
+	Setup();
+}
+
+// Maps the file privately. The lumps are used where they lie, and the few
+// bytes Setup patches are copied by the kernel a page at a time. A private
+// mapping is no snapshot though: writes to the file still show through, and
+// truncating it faults, which is why the file must be replaced by rename and
+// why Setup copies the string lump out.
+bool ProgsImage::MapFile()
+{
+	int fd = open(mFilename.c_str(), O_RDONLY);
+	if (fd < 0)
+		return false;
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size <= 0 || st.st_size > 0x7fffffff)
+	{
+		close(fd);
+		return false;
+	}
+	void *data = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED)
+		return false;
+
+	mDataSource = DATA_MAPPED;
+	mQcvmSize   = st.st_size;
+	mQcvmData   = (char*)data;
+	return true;
+}
+
+// Fallback for files which can't be mapped.
+bool ProgsImage::ReadFile()
 {
 	// open
 	ifstream progsFile;
 	progsFile.open(mFilename.c_str(), ios::binary | ios::in);
 	if (!progsFile.is_open() || !progsFile.good() || progsFile.eof())
 	{
-		cout << "Could not open Progs " << mFilename << endl;
-		return;
+		return false;
 	}
 
 	// get file size
@@ -63,11 +219,20 @@ void Kzqcvm::Load()
 	int fileSize = end - beg;
 
 	// allocate and read
+	mDataSource = DATA_ALLOCATED;
 	mQcvmSize = fileSize;
 	mQcvmData = new char[mQcvmSize];
 	progsFile.read(mQcvmData, mQcvmSize);
 	progsFile.close();
+	return true;
+}
 
+//-----------------------------------------------------------------------------
+// Setup - validate and index the data
+//-----------------------------------------------------------------------------
+
+void ProgsImage::Setup()
+{
 	// validate the header and read the arrays
 	if (mQcvmSize < (int32_t)sizeof(QcvmHeader))
 	{
@@ -99,21 +264,90 @@ void Kzqcvm::Load()
 	SETUP_PROGS_LUMP(mHeader->stringdata_offset, mHeader->stringdata_size, char,           mStringData)
 	SETUP_PROGS_LUMP(mHeader->globaldata_offset, mHeader->globaldata_num,  float,          mGlobalData)
 #undef SETUP_PROGS_LUMP
+	if (mHeader->statements_num <= 0 || mHeader->stringdata_size <= 0)
+	{
+		cout << "Progs " << mFilename << " has no statements or strings" << endl;
+		Unload();
+		return;
+	}
+
+	// String constants are handed out as pointers for as long as an instance
+	// runs, so they don't stay in a mapping the file could change under.
+	if (mDataSource == DATA_MAPPED)
+	{
+		mStringCopy = new char[mHeader->stringdata_size];
+		memcpy(mStringCopy, mStringData, mHeader->stringdata_size);
+		mStringData = mStringCopy;
+	}
+
+	// These are the only changes made to the lumps. Compilers normally get
+	// them right already, and then a buffer we were given can be used as is.
+	if (mStringData[mHeader->stringdata_size - 1] != '\0' ||
+		mStatements[mHeader->statements_num - 1].instruction != Instructions::DONE)
+	{
+		if (mDataSource == DATA_EXTERNAL)
+		{
+			char *copy = new char[mQcvmSize];
+			memcpy(copy, mQcvmData, mQcvmSize);
+			ptrdiff_t relocate = copy - mQcvmData;
+			mDataSource = DATA_ALLOCATED;
+			mQcvmData   = copy;
+			mHeader     = (QcvmHeader*)    ((char*)mHeader     + relocate);
+			mStatements = (QcvmStatement*) ((char*)mStatements + relocate);
+			mGlobalDefs = (QcvmDefinition*)((char*)mGlobalDefs + relocate);
+			mFieldDefs  = (QcvmDefinition*)((char*)mFieldDefs  + relocate);
+			mFunctions  = (QcvmFunction*)  ((char*)mFunctions  + relocate);
+			mStringData = mStringData + relocate;
+			mGlobalData = (float*)         ((char*)mGlobalData + relocate);
+		}
+
+		// make sure the string data is null terminated
+		mStringData[mHeader->stringdata_size - 1] = '\0';
+
+		// make sure the last instruction is 'DONE'
+		mStatements[mHeader->statements_num - 1].instruction = Instructions::DONE;
+	}
+
+	// the cache only saves indexing and decoding, never validation
+	if (!Validate())
+	{
+		Unload();
+		return;
+	}
+	// identifies exactly this progs to the cache and to native modules
+	mContentHash = HashData(mQcvmData, mQcvmSize);
+	bool useCache = !mCacheFilename.empty();
+	mFromCache = useCache && LoadCache();
+	if (!mFromCache)
+	{
+		BuildIndexes();
+		Decode();
+		if (useCache)
+			SaveCache();
+	}
+
+	// and we're done
+	cout << "Successfully loaded progs " << mFilename << endl;
+}
 
+//-----------------------------------------------------------------------------
+// Validate - bounds check everything the interpreter will trust
+//-----------------------------------------------------------------------------
+
+bool ProgsImage::Validate()
+{
 	// Bounds checking - globaldefs
 	for (int i=0; i<mHeader->globaldefs_num; ++i)
 	{
 		if (mGlobalDefs[i].nameOffset < 0 || mGlobalDefs[i].nameOffset >= mHeader->stringdata_size)
 		{
 			cout << "GlobalDef " << i << " name offset out of bounds in " << mFilename << endl;
-			Unload();
-			return;
+			return false;
 		}
 		if (mGlobalDefs[i].offset < 0 || mGlobalDefs[i].offset >= mHeader->globaldata_num)
 		{
 			cout << "GlobalDef " << i << " offset out of bounds in " << mFilename << endl;
-			Unload();
-			return;
+			return false;
 		}
 	}
 	// Bounds checking - fielddefs
@@ -122,14 +356,12 @@ void Kzqcvm::Load()
 		if (mFieldDefs[i].nameOffset < 0 || mFieldDefs[i].nameOffset >= mHeader->stringdata_size)
 		{
 			cout << "FieldDef " << i << " name offset out of bounds in " << mFilename << endl;
-			Unload();
-			return;
+			return false;
 		}
 		if (mFieldDefs[i].offset < 0 || mFieldDefs[i].offset >= mHeader->entity_size)
 		{
 			cout << "FieldDef " << i << " offset out of bounds in " << mFilename << endl;
-			Unload();
-			return;
+			return false;
 		}
 	}
 	// Bounds checking - functions
@@ -138,45 +370,40 @@ void Kzqcvm::Load()
 		if (mFunctions[i].offsetFirstStatement >= mHeader->statements_num)
 		{
 			cout << "Function " << i << " first statement out of bounds in " << mFilename << endl;
-			Unload();
-			return;
+			return false;
 		}
 		if (mFunctions[i].offsetLocalsInGlobals < 0 ||
 			mFunctions[i].offsetLocalsInGlobals + mFunctions[i].numLocals >= mHeader->globaldata_num)
 		{
 			cout << "Function " << i << " local parameters out of bounds in " << mFilename << endl;
-			Unload();
-			return;
+			return false;
 		}
 		if (mFunctions[i].nameOffset < 0 || mFunctions[i].nameOffset >= mHeader->stringdata_size)
 		{
 			cout << "Function " << i << " name offset out of bounds in " << mFilename << endl;
-			Unload();
-			return;
+			return false;
 		}
 		if (mFunctions[i].fileNameOffset < 0 || mFunctions[i].fileNameOffset >= mHeader->stringdata_size)
 		{
 			cout << "Function " << i << " filename offset out of bounds in " << mFilename << endl;
-			Unload();
-			return;
+			return false;
 		}
 	}
 	// Bounds checking - statements
+	bool usesState = false;
 	for (int i=0; i<mHeader->statements_num; ++i)
 	{
 		if (mStatements[i].instruction < Instructions::MIN || mStatements[i].instruction > Instructions::MAX)
 		{
 			cout << "Instruction " << i << " is invalid in " << mFilename << endl;
-			Unload();
-			return;
+			return false;
 		}
 
 #define BOUNDS_CHECK_GLOBAL(n) \
 			if (mStatements[i].parameter[(n)] < 0 || mStatements[i].parameter[(n)] >= mHeader->globaldata_num)\
 			{\
 				cout << "Instruction " << i << " parameter " << (n) << " out of bounds (globals) in " << mFilename << endl;\
-				Unload();\
-				return;\
+				return false;\
 			}
 		int offset;
 		switch (mStatements[i].instruction)
@@ -204,12 +431,16 @@ void Kzqcvm::Load()
 			BOUNDS_CHECK_GLOBAL(0)
 			BOUNDS_CHECK_GLOBAL(1)
 			break;
+		case Instructions::STATE:
+			BOUNDS_CHECK_GLOBAL(0)
+			BOUNDS_CHECK_GLOBAL(1)
+			usesState = true;
+			break;
 		case Instructions::NOT_F:
 		case Instructions::NOT_V:
 		case Instructions::NOT_S:
 		case Instructions::NOT_ENT:
 		case Instructions::NOT_FNC:
-		case Instructions::STATE:
 			BOUNDS_CHECK_GLOBAL(0)
 			BOUNDS_CHECK_GLOBAL(2)
 			break;
@@ -220,8 +451,7 @@ void Kzqcvm::Load()
 			if (offset < 0 || offset >= mHeader->statements_num)
 			{
 				cout << "Instruction " << i << " parameter 1 out of bounds (statements) in " << mFilename << endl;
-				Unload();
-				return;
+				return false;
 			}
 			break;
 		case Instructions::CALL0:
@@ -241,8 +471,7 @@ void Kzqcvm::Load()
 			if (offset < 0 || offset >= mHeader->statements_num)
 			{
 				cout << "Instruction " << i << " parameter 0 out of bounds (statements) in " << mFilename << endl;
-				Unload();
-				return;
+				return false;
 			}
 			break;
 		default:
@@ -252,13 +481,40 @@ void Kzqcvm::Load()
 			break;
 		}
 	}
+	// STATE writes self's frame, so fail now rather than at the first STATE
+	// run. Its think fields can be renamed by EnableThinks, so are checked
+	// when it runs.
+	if (usesState &&
+		(!HasDefinition(mFieldDefs, mHeader->fielddefs_num, "frame", FLOAT) ||
+		 !HasDefinition(mGlobalDefs, mHeader->globaldefs_num, "self", ENTITY) ||
+		 !HasDefinition(mGlobalDefs, mHeader->globaldefs_num, "time", FLOAT)))
+	{
+		cout << "Progs Instruction STATE needs a frame field and self and time globals in "
+			<< mFilename << endl;
+		return false;
+	}
+	return true;
+}
 
-	// make sure the string data is null terminated
-	mStringData[mHeader->stringdata_size - 1] = '\0';
+// Whether defs holds one with the name and type. The names have been bounds
+// checked already.
+bool ProgsImage::HasDefinition(const QcvmDefinition *defs, int32_t count, const char *name,
+	QcvmDefinitionType type) const
+{
+	for (int i=0; i<count; ++i)
+	{
+		if ((defs[i].type & GLOBALDEF_TYPE_MASK) == type && strcmp(&mStringData[defs[i].nameOffset], name) == 0)
+			return true;
+	}
+	return false;
+}
 
-	// make sure the last instruction is 'DONE'
-	mStatements[mHeader->statements_num - 1].instruction = Instructions::DONE;
+//-----------------------------------------------------------------------------
+// Indexes - derived from the lumps
+//-----------------------------------------------------------------------------
 
+void ProgsImage::BuildIndexes()
+{
 	// write our global def metadata
 	mGlobalDefData = new char[mHeader->globaldefs_num];
 	// first build a temporary list of local variables
@@ -274,15 +530,14 @@ void Kzqcvm::Load()
 			isLocal[mFunctions[i].offsetLocalsInGlobals+j] = true;
 		}
 	}
-	// then parse all the globals
+	// then parse all the globaldefs
 	bool end_sys = false;
-	for (int i=0; i<mHeader->globaldata_num; ++i)
+	for (int i=0; i<mHeader->globaldefs_num; ++i)
 	{
+		mGlobalDefData[i] = 0;
 		if (!end_sys)
 		{
-			mGlobalDefData[i] = 0;
-			if (!end_sys)
-				mGlobalDefData[i] |= GLOBAL_DEF_SYSTEM;
+			mGlobalDefData[i] |= GLOBAL_DEF_SYSTEM;
 			if (!strcmp(&mStringData[mGlobalDefs[i].nameOffset], "end_sys_globals"))
 				mGlobalDefData[i] |= GLOBAL_DEF_SPECIAL;
 			if (!strcmp(&mStringData[mGlobalDefs[i].nameOffset], "end_sys_fields"))
@@ -290,10 +545,10 @@ void Kzqcvm::Load()
 				mGlobalDefData[i] |= GLOBAL_DEF_SPECIAL;
 				end_sys = true;
 			}
-			if (isLocal[mGlobalDefs[i].offset])
-			{
-				mGlobalDefData[i] |= GLOBAL_DEF_LOCAL;
-			}
+		}
+		if (isLocal[mGlobalDefs[i].offset])
+		{
+			mGlobalDefData[i] |= GLOBAL_DEF_LOCAL;
 		}
 	}
 
@@ -310,13 +565,6 @@ void Kzqcvm::Load()
 		if (mFieldOffsetTypes[offset] != VECTOR)
 			mFieldOffsetTypes[offset] = type;
 	}
-
-	// init the managers
-	mEntityManager.Init(mHeader->entity_size, ENTITY_REUSE_DELAY);
-	mStringManager.Init(mStringData, mHeader->stringdata_size);
-
-	// and we're done
-	cout << "Successfully loaded progs " << mFilename << endl;
 }
 
 //-----------------------------------------------------------------------------
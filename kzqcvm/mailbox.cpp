@@ -0,0 +1,162 @@
+/*
+Kzqcvm QuakeC VM Interpreter
+Copyright (c) 2010 David Laurie
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+/*
+kzqcvm/mailbox.cpp
+*/
+
+#include "mailbox.h"
+#include "data.h"
+
+#include <stdint.h>
+#include <string.h>
+#include <string>
+
+//-----------------------------------------------------------------------------
+namespace kzqcvm {
+	using std::string;
+	using std::memory_order_relaxed;
+	using std::memory_order_acquire;
+	using std::memory_order_release;
+//-----------------------------------------------------------------------------
+
+//-----------------------------------------------------------------------------
+// Structors
+//-----------------------------------------------------------------------------
+
+Mailbox::Mailbox(int32_t capacity)
+{
+	uint32_t size = 1;
+	while ((int32_t)size < capacity && size < (1u << 30))
+		size <<= 1;
+	mMessages.resize(size);
+	mMask = size - 1;
+	mHead = 0;
+	mTail = 0;
+}
+
+Mailbox::~Mailbox()
+{
+}
+
+int32_t Mailbox::GetCount() const
+{
+	return (int32_t)(mTail.load(memory_order_acquire) - mHead.load(memory_order_acquire));
+}
+
+//-----------------------------------------------------------------------------
+// Post
+//-----------------------------------------------------------------------------
+
+bool Mailbox::Post(Kzqcvm &from, const char *types)
+{
+	int count = (int)strlen(types);
+	if (count > MAX_VALUES)
+		return false;
+	uint32_t tail = mTail.load(memory_order_relaxed);
+	if (tail - mHead.load(memory_order_acquire) > mMask)
+		return false;
+
+	// the slot is ours until we move the tail past it
+	Message &message = mMessages[tail & mMask];
+	message.count = count;
+	for (int i=0; i<count; ++i)
+	{
+		message.types[i] = types[i];
+		switch (types[i])
+		{
+		case 'f':
+			message.values[i][0] = from.GetParameterFloatPointer(i).Get();
+			break;
+		case 'v':
+		{
+			VectorPointer v = from.GetParameterVectorPointer(i);
+			message.values[i][0] = v[0];
+			message.values[i][1] = v[1];
+			message.values[i][2] = v[2];
+			break;
+		}
+		case 's':
+		{
+			const char *s = from.GetParameterStringPointer(i).Get().GetValue();
+			message.strings[i] = s ? s : "";
+			break;
+		}
+		case 'e':
+			message.entities[i] = from.GetParameterEntityPointer(i).Get().entNum;
+			break;
+		default:
+			return false;
+		}
+	}
+	mTail.store(tail + 1, memory_order_release);
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// Drain
+//-----------------------------------------------------------------------------
+
+int32_t Mailbox::Drain(Kzqcvm &to, Function &handler, int32_t maxMessages, int32_t &failed)
+{
+	failed = 0;
+	uint32_t head = mHead.load(memory_order_relaxed);
+	uint32_t tail = mTail.load(memory_order_acquire);
+	int32_t delivered = 0;
+	for (; head != tail && delivered < maxMessages; ++head, ++delivered)
+	{
+		// the slot is ours until we move the head past it
+		Message &message = mMessages[head & mMask];
+		for (int i=0; i<message.count; ++i)
+		{
+			switch (message.types[i])
+			{
+			case 'f':
+				to.GetParameterFloatPointer(i).Set(message.values[i][0]);
+				break;
+			case 'v':
+			{
+				VectorPointer v = to.GetParameterVectorPointer(i);
+				v[0] = message.values[i][0];
+				v[1] = message.values[i][1];
+				v[2] = message.values[i][2];
+				break;
+			}
+			case 's':
+				to.GetParameterStringPointer(i).Set(to.Alloc(message.strings[i]));
+				message.strings[i].clear();
+				break;
+			case 'e':
+				to.GetParameterEntityPointer(i).Set(Entity(&to, message.entities[i]));
+				break;
+			}
+		}
+		if (!handler.Run())
+			++failed;
+		mHead.store(head + 1, memory_order_release);
+	}
+	return delivered;
+}
+
+//-----------------------------------------------------------------------------
+} // namespace
+//-----------------------------------------------------------------------------
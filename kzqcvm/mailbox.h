@@ -0,0 +1,132 @@
+/*
+Kzqcvm QuakeC VM Interpreter
+Copyright (c) 2010 David Laurie
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+/*
+kzqcvm/mailbox.h
+*/
+
+//-----------------------------------------------------------------------------
+#ifndef KZQCVM_MAILBOX_H
+#define KZQCVM_MAILBOX_H
+//-----------------------------------------------------------------------------
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <atomic>
+
+#include "kzqcvm.h"
+
+//-----------------------------------------------------------------------------
+namespace kzqcvm {
+	using std::string;
+	using std::vector;
+//-----------------------------------------------------------------------------
+
+/*
+A Mailbox carries messages one way between two QCVMs which may be running
+on different threads, such as neighbouring shards of a world: one thread
+posts, and one other thread drains, and neither ever waits for the other.
+For traffic both ways, or between many shards, use one per ordered pair.
+
+A message is up to MAX_VALUES values, as a builtin's parameters are. Its
+types are given as a string with a letter for each: 'f' float, 'v'
+vector, 's' string and 'e' entity. Strings are copied when posted and
+zoned into the receiver with Alloc when delivered, so they belong to it
+and last until freed. Entities are passed on as their numbers, which only
+mean the same entity if the host keeps the two worlds' numbers in step.
+
+Post is meant to be called from a builtin: it takes the values from the
+sending QCVM's parameters, so a builtin such as
+
+	bool SendBuiltin(Kzqcvm *qcvm, int number)
+	{
+		Mailbox *mailbox = ((Shard*)qcvm->dataObject)->outbox;
+		return mailbox->Post(*qcvm, "esf");
+	}
+
+sends an entity, a string and a float from QC. Drain, called in the
+receiver's frame, puts each message's values into the receiver's
+parameters in turn, and runs handler on them.
+*/
+class Mailbox {
+public:
+	/*
+	Holds up to capacity messages, rounded up to a power of two.
+	*/
+	Mailbox(int32_t capacity);
+	~Mailbox();
+
+	static const int MAX_VALUES = 8;
+
+	/*
+	From the posting thread. Returns false if the mailbox is full, or types
+	is longer than MAX_VALUES or has an unknown letter.
+	*/
+	bool Post(Kzqcvm &from, const char *types);
+
+	/*
+	From the draining thread. Delivers up to maxMessages messages in the
+	order they were posted, running handler in to for each, and returns how
+	many were delivered. Messages whose handler failed are still taken,
+	and counted in failed, with the errors left in to.
+	*/
+	int32_t Drain(Kzqcvm &to, Function &handler, int32_t maxMessages, int32_t &failed);
+
+	/*
+	Messages waiting. Only exact on a thread which isn't posting or
+	draining at the time.
+	*/
+	int32_t GetCount() const;
+	int32_t GetCapacity() const { return (int32_t)mMask + 1; }
+
+private:
+	Mailbox(const Mailbox &);
+	Mailbox &operator=(const Mailbox &);
+
+	struct Message {
+		int     count;
+		char    types[MAX_VALUES];
+		float   values[MAX_VALUES][3];
+		int32_t entities[MAX_VALUES];
+		string  strings[MAX_VALUES];
+	};
+
+	static const int CACHE_LINE = 64;
+
+	vector<Message>       mMessages;
+	uint32_t              mMask;
+	// next to be drained, written only by the draining thread
+	std::atomic<uint32_t> mHead;
+	char                  mPadHead[CACHE_LINE];
+	// next to be posted, written only by the posting thread
+	std::atomic<uint32_t> mTail;
+	char                  mPadTail[CACHE_LINE];
+};
+
+//-----------------------------------------------------------------------------
+} // namespace
+//-----------------------------------------------------------------------------
+
+//-----------------------------------------------------------------------------
+#endif
+//-----------------------------------------------------------------------------
@@ -0,0 +1,176 @@
+/*
+Kzqcvm QuakeC VM Interpreter
+Copyright (c) 2010 David Laurie
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+/*
+kzqcvm/native.cpp
+*/
+
+#include "kzqcvm.h"
+#include "native.h"
+
+#include <dlfcn.h>
+#include <iostream>
+
+//-----------------------------------------------------------------------------
+namespace kzqcvm {
+	using std::cout;
+	using std::endl;
+//-----------------------------------------------------------------------------
+
+//-----------------------------------------------------------------------------
+// Callbacks
+//-----------------------------------------------------------------------------
+
+// What a native module calls back into, each one the same as the
+// interpreter's handling of the instruction.
+struct NativeCallbacks {
+	static bool ReadFloat(void *vm, int32_t entityNum, int32_t fieldOffset, float *f)
+	{
+		return ((Kzqcvm*)vm)->mEntityManager.ReadFloat(entityNum, fieldOffset, f);
+	}
+	static bool ReadVector(void *vm, int32_t entityNum, int32_t fieldOffset, float *v)
+	{
+		return ((Kzqcvm*)vm)->mEntityManager.ReadVector(entityNum, fieldOffset, v);
+	}
+	static bool ReadInt(void *vm, int32_t entityNum, int32_t fieldOffset, int32_t *i)
+	{
+		return ((Kzqcvm*)vm)->mEntityManager.ReadInt(entityNum, fieldOffset, i);
+	}
+	static int32_t Address(void *vm, int32_t entityNum, int32_t fieldOffset)
+	{
+		return ((Kzqcvm*)vm)->mEntityManager.GetAddress(entityNum, fieldOffset);
+	}
+	static bool WriteFloat(void *vm, int32_t address, float f)
+	{
+		return ((Kzqcvm*)vm)->mEntityManager.WriteFloat(address, f);
+	}
+	static bool WriteVector(void *vm, int32_t address, const float *v)
+	{
+		return ((Kzqcvm*)vm)->mEntityManager.WriteVector(address, v);
+	}
+	static bool WriteInt(void *vm, int32_t address, int32_t i)
+	{
+		return ((Kzqcvm*)vm)->mEntityManager.WriteInt(address, i);
+	}
+	static const char *GetString(void *vm, int32_t s)
+	{
+		return ((Kzqcvm*)vm)->mStringManager.GetString(s);
+	}
+	static QcvmError State(void *vm, float frame, int32_t think)
+	{
+		return ((Kzqcvm*)vm)->RunState(frame, think);
+	}
+	static bool Call(void *vm, int32_t functionNum, int32_t numParameters, int *instructionCount)
+	{
+		Kzqcvm *qcvm = (Kzqcvm*)vm;
+		qcvm->mNumCallParameters = numParameters;
+		return qcvm->RunFunction(functionNum, instructionCount);
+	}
+	static void Error(void *vm, QcvmError errorType, int32_t functionNum, int32_t statement)
+	{
+		Kzqcvm *qcvm = (Kzqcvm*)vm;
+		switch (errorType)
+		{
+		case ERR_NONE:
+			break;
+		case ERR_INVALID_READ:
+			qcvm->StartError(errorType, "Attempted read from invalid entity");
+			break;
+		case ERR_INVALID_WRITE:
+			qcvm->StartError(errorType, "Attempted write to invalid entity");
+			break;
+		case ERR_RUNAWAY_LOOP:
+			qcvm->StartError(errorType, "Maximum instruction limit reached");
+			break;
+		case ERR_FIELD_NOT_FOUND:
+			qcvm->StartError(errorType, "Progs Instruction STATE needs frame, nextthink and think fields");
+			break;
+		default:
+			qcvm->StartError(errorType, "Invalid instruction");
+			break;
+		}
+		qcvm->TraceFunction(&qcvm->mFunctions[functionNum], &qcvm->mStatements[statement]);
+	}
+};
+
+//-----------------------------------------------------------------------------
+// Load/Unload
+//-----------------------------------------------------------------------------
+
+bool Kzqcvm::LoadNativeModule(string filename)
+{
+	UnloadNativeModule();
+	if (!IsLoaded())
+		return false;
+
+	void *handle = dlopen(filename.c_str(), RTLD_NOW | RTLD_LOCAL);
+	if (!handle)
+	{
+		cout << "Could not open native module " << filename << ": " << dlerror() << endl;
+		return false;
+	}
+
+	NativeModuleEntry entry = (NativeModuleEntry)dlsym(handle, KZQCVM_NATIVE_MODULE_ENTRY);
+	const NativeModule *module = entry ? entry() : NULL;
+	if (!module ||
+		module->abiVersion   != NATIVE_ABI_VERSION ||
+		module->crc          != mHeader->crc ||
+		module->progsHash    != mImage->mContentHash ||
+		module->functionsNum != mHeader->functions_num)
+	{
+		cout << "Native module " << filename << " does not match the progs, interpreting" << endl;
+		dlclose(handle);
+		return false;
+	}
+
+	mNativeContext.globals     = mGlobalData;
+	mNativeContext.vm          = this;
+	mNativeContext.readFloat   = NativeCallbacks::ReadFloat;
+	mNativeContext.readVector  = NativeCallbacks::ReadVector;
+	mNativeContext.readInt     = NativeCallbacks::ReadInt;
+	mNativeContext.address     = NativeCallbacks::Address;
+	mNativeContext.writeFloat  = NativeCallbacks::WriteFloat;
+	mNativeContext.writeVector = NativeCallbacks::WriteVector;
+	mNativeContext.writeInt    = NativeCallbacks::WriteInt;
+	mNativeContext.getString   = NativeCallbacks::GetString;
+	mNativeContext.state       = NativeCallbacks::State;
+	mNativeContext.call        = NativeCallbacks::Call;
+	mNativeContext.error       = NativeCallbacks::Error;
+
+	mNativeFilename  = filename;
+	mNativeHandle    = handle;
+	mNativeFunctions = module->functions;
+	return true;
+}
+
+void Kzqcvm::UnloadNativeModule()
+{
+	if (mNativeHandle)
+		dlclose(mNativeHandle);
+	mNativeHandle    = NULL;
+	mNativeFunctions = NULL;
+	mNativeFilename.clear();
+}
+
+//-----------------------------------------------------------------------------
+} // namespace
+//-----------------------------------------------------------------------------
@@ -0,0 +1,104 @@
+/*
+Kzqcvm QuakeC VM Interpreter
+Copyright (c) 2010 David Laurie
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+/*
+kzqcvm/native.h
+*/
+
+//-----------------------------------------------------------------------------
+#ifndef KZQCVM_NATIVE_H
+#define KZQCVM_NATIVE_H
+//-----------------------------------------------------------------------------
+
+#include <stdint.h>
+
+#include "errors.h"
+
+//-----------------------------------------------------------------------------
+namespace kzqcvm {
+//-----------------------------------------------------------------------------
+
+/*
+The interface between Kzqcvm and a natively compiled progs module, as written
+by Kzqcvm::TranslateToCpp. A module is a shared object built from that source
+and this header alone, so everything here is plain data and function
+pointers; bump NATIVE_ABI_VERSION whenever any of it changes.
+
+A module exports one function table, indexed by progs function number, whose
+entries replace the interpreter for that function. Each native function does
+what RunFunction does for a QuakeC function: it saves its locals, copies in
+its parameters, runs, restores its locals and returns false if execution was
+halted by an error, which it has already reported through the context.
+*/
+
+static const int32_t NATIVE_ABI_VERSION = 3;
+
+struct NativeContext {
+	// the instance's global data
+	float *globals;
+	// the Kzqcvm, passed back to each of the callbacks below
+	void  *vm;
+
+	bool    (*readFloat)  (void *vm, int32_t entityNum, int32_t fieldOffset, float *f);
+	bool    (*readVector) (void *vm, int32_t entityNum, int32_t fieldOffset, float *v);
+	bool    (*readInt)    (void *vm, int32_t entityNum, int32_t fieldOffset, int32_t *i);
+	int32_t (*address)    (void *vm, int32_t entityNum, int32_t fieldOffset);
+	bool    (*writeFloat) (void *vm, int32_t address, float f);
+	bool    (*writeVector)(void *vm, int32_t address, const float *v);
+	bool    (*writeInt)   (void *vm, int32_t address, int32_t i);
+
+	const char *(*getString)(void *vm, int32_t s);
+
+	// the STATE instruction, for self; returns the error to raise, if any
+	QcvmError (*state)(void *vm, float frame, int32_t think);
+
+	// calls any function, native, interpreted or builtin
+	bool    (*call) (void *vm, int32_t functionNum, int32_t numParameters, int *instructionCount);
+	// starts an error and traces the statement it occurred at; ERR_NONE
+	// only adds the trace, for an error already started by a callee
+	void    (*error)(void *vm, QcvmError errorType, int32_t functionNum, int32_t statement);
+};
+
+typedef bool (*NativeFunction)(const NativeContext *context, int *instructionCount);
+
+struct NativeModule {
+	int32_t  abiVersion;
+	// the progs this was translated from. Mods built against the same engine
+	// share a CRC, so the hash of the whole progs is what tells them apart.
+	int32_t  crc;
+	uint64_t progsHash;
+	int32_t  functionsNum;
+	// functionsNum entries, NULL for any left to the interpreter
+	const NativeFunction *functions;
+};
+
+// the one symbol a module exports
+typedef const NativeModule *(*NativeModuleEntry)();
+#define KZQCVM_NATIVE_MODULE_ENTRY "kzqcvm_native_module"
+
+//-----------------------------------------------------------------------------
+} // namespace
+//-----------------------------------------------------------------------------
+
+//-----------------------------------------------------------------------------
+#endif
+//-----------------------------------------------------------------------------
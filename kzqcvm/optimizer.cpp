@@ -0,0 +1,1073 @@
+/*
+Kzqcvm QuakeC VM Interpreter
+Copyright (c) 2010 David Laurie
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+/*
+kzqcvm/optimizer.cpp
+*/
+
+#include "optimizer.h"
+#include "instructions.h"
+
+#include <string.h>
+#include <iostream>
+
+//-----------------------------------------------------------------------------
+namespace kzqcvm {
+	using std::cout;
+	using std::endl;
+//-----------------------------------------------------------------------------
+
+// the null global, the return value and the 8 parameters
+static const int32_t RESERVED_GLOBALS = 28;
+
+static const int32_t MAX_ROUNDS = 16;
+static const int32_t MAX_JUMP_HOPS = 64;
+
+//-----------------------------------------------------------------------------
+// Structors
+//-----------------------------------------------------------------------------
+
+ProgsOptimizer::ProgsOptimizer()
+{
+	memset(&mHeader, 0, sizeof(mHeader));
+	memset(&mStats, 0, sizeof(mStats));
+}
+
+//-----------------------------------------------------------------------------
+// Load
+//-----------------------------------------------------------------------------
+
+bool ProgsOptimizer::Load(const ProgsImage *image)
+{
+	if (image == NULL || !image->IsLoaded())
+		return false;
+
+	mHeader = *image->mHeader;
+	mStatements.assign(image->mStatements, image->mStatements + mHeader.statements_num);
+	mGlobalDefs.assign(image->mGlobalDefs, image->mGlobalDefs + mHeader.globaldefs_num);
+	mFieldDefs .assign(image->mFieldDefs,  image->mFieldDefs  + mHeader.fielddefs_num);
+	mFunctions .assign(image->mFunctions,  image->mFunctions  + mHeader.functions_num);
+	mStringData.assign(image->mStringData, image->mStringData + mHeader.stringdata_size);
+	mGlobalData.assign(image->mGlobalData, image->mGlobalData + mHeader.globaldata_num);
+
+	// the loader only checks where operands start, but we rewrite whole
+	// ranges, so don't touch anything which writes past the end
+	for (int32_t i=0; i<mHeader.statements_num; ++i)
+	{
+		Effect effect;
+		GetEffect(mStatements[i].instruction, &effect);
+		for (int j=0; j<3; ++j)
+		{
+			if (effect.use[j] == USE_READ && mStatements[i].parameter[j] < 0)
+			{
+				cout << "Statement " << i << " reads outside the globals, not optimizing" << endl;
+				return false;
+			}
+			if (effect.use[j] == USE_WRITE && (mStatements[i].parameter[j] < 0 ||
+				mStatements[i].parameter[j] + effect.width[j] > mHeader.globaldata_num))
+			{
+				cout << "Statement " << i << " writes outside the globals, not optimizing" << endl;
+				return false;
+			}
+		}
+	}
+
+	memset(&mStats, 0, sizeof(mStats));
+	mStats.statementsBefore = mStats.statementsAfter = mHeader.statements_num;
+	mStats.globalsBefore    = mStats.globalsAfter    = mHeader.globaldata_num;
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// Instruction effects
+//-----------------------------------------------------------------------------
+
+void ProgsOptimizer::GetEffect(int16_t instruction, Effect *effect)
+{
+	OperandUse R = USE_READ, W = USE_WRITE, J = USE_JUMP, N = USE_NONE;
+	OperandUse use[3] = { N, N, N };
+	int32_t width[3] = { 1, 1, 1 };
+	effect->pure = true;
+	effect->terminates = false;
+
+	switch (instruction)
+	{
+	case NOP:
+		break;
+	case Instructions::DONE:
+	case Instructions::RETURN:
+		use[0] = R; width[0] = 3;
+		effect->pure = false;
+		effect->terminates = true;
+		break;
+	case Instructions::MUL_F:
+	case Instructions::DIV_F:
+	case Instructions::ADD_F:
+	case Instructions::SUB_F:
+	case Instructions::EQ_F:
+	case Instructions::EQ_S:
+	case Instructions::EQ_E:
+	case Instructions::EQ_FNC:
+	case Instructions::NE_F:
+	case Instructions::NE_S:
+	case Instructions::NE_E:
+	case Instructions::NE_FNC:
+	case Instructions::LE:
+	case Instructions::GE:
+	case Instructions::LT:
+	case Instructions::GT:
+	case Instructions::ADDRESS:
+	case Instructions::AND:
+	case Instructions::OR:
+	case Instructions::BITAND:
+	case Instructions::BITOR:
+		use[0] = R; use[1] = R; use[2] = W;
+		break;
+	case Instructions::MUL_V:
+	case Instructions::EQ_V:
+	case Instructions::NE_V:
+		use[0] = R; use[1] = R; use[2] = W;
+		width[0] = 3; width[1] = 3;
+		break;
+	case Instructions::ADD_V:
+	case Instructions::SUB_V:
+		use[0] = R; use[1] = R; use[2] = W;
+		width[0] = 3; width[1] = 3; width[2] = 3;
+		break;
+	case Instructions::MUL_FV:
+		use[0] = R; use[1] = R; use[2] = W;
+		width[1] = 3; width[2] = 3;
+		break;
+	case Instructions::MUL_VF:
+		use[0] = R; use[1] = R; use[2] = W;
+		width[0] = 3; width[2] = 3;
+		break;
+	// loads can fail, so are never removed
+	case Instructions::LOAD_F:
+	case Instructions::LOAD_S:
+	case Instructions::LOAD_ENT:
+	case Instructions::LOAD_FLD:
+	case Instructions::LOAD_FNC:
+		use[0] = R; use[1] = R; use[2] = W;
+		effect->pure = false;
+		break;
+	case Instructions::LOAD_V:
+		use[0] = R; use[1] = R; use[2] = W;
+		width[2] = 3;
+		effect->pure = false;
+		break;
+	case Instructions::STORE_F:
+	case Instructions::STORE_S:
+	case Instructions::STORE_ENT:
+	case Instructions::STORE_FLD:
+	case Instructions::STORE_FNC:
+		use[0] = R; use[1] = W;
+		break;
+	case Instructions::STORE_V:
+		use[0] = R; use[1] = W;
+		width[0] = 3; width[1] = 3;
+		break;
+	case Instructions::STOREP_F:
+	case Instructions::STOREP_S:
+	case Instructions::STOREP_ENT:
+	case Instructions::STOREP_FLD:
+	case Instructions::STOREP_FNC:
+		use[0] = R; use[1] = R;
+		effect->pure = false;
+		break;
+	case Instructions::STOREP_V:
+		use[0] = R; use[1] = R;
+		width[0] = 3;
+		effect->pure = false;
+		break;
+	case Instructions::NOT_F:
+	case Instructions::NOT_S:
+	case Instructions::NOT_ENT:
+	case Instructions::NOT_FNC:
+		use[0] = R; use[2] = W;
+		break;
+	case Instructions::NOT_V:
+		use[0] = R; use[2] = W;
+		width[0] = 3;
+		break;
+	case Instructions::IF:
+	case Instructions::IFNOT:
+		use[0] = R; use[1] = J;
+		effect->pure = false;
+		break;
+	case Instructions::GOTO:
+		use[0] = J;
+		effect->pure = false;
+		effect->terminates = true;
+		break;
+	// a call reads the parameters and writes the return value, neither of
+	// which is ever a constant or a function's own local
+	case Instructions::CALL0:
+	case Instructions::CALL1:
+	case Instructions::CALL2:
+	case Instructions::CALL3:
+	case Instructions::CALL4:
+	case Instructions::CALL5:
+	case Instructions::CALL6:
+	case Instructions::CALL7:
+	case Instructions::CALL8:
+		use[0] = R;
+		effect->pure = false;
+		break;
+	case Instructions::STATE:
+		use[0] = R; use[1] = R;
+		effect->pure = false;
+		break;
+	default:
+		// halts the interpreter
+		effect->pure = false;
+		effect->terminates = true;
+		break;
+	}
+
+	for (int j=0; j<3; ++j)
+	{
+		effect->use[j] = use[j];
+		effect->width[j] = use[j] == R || use[j] == W ? width[j] : 0;
+	}
+}
+
+bool ProgsOptimizer::IsJump(int16_t instruction)
+{
+	return instruction == Instructions::GOTO ||
+		instruction == Instructions::IF || instruction == Instructions::IFNOT;
+}
+
+int32_t ProgsOptimizer::JumpTarget(const QcvmStatement &statement, int32_t statementNum)
+{
+	if (statement.instruction == Instructions::GOTO)
+		return statementNum + statement.parameter[0];
+	return statementNum + statement.parameter[1];
+}
+
+void ProgsOptimizer::SetJumpTarget(QcvmStatement *statement, int32_t statementNum, int32_t target)
+{
+	if (statement->instruction == Instructions::GOTO)
+		statement->parameter[0] = target - statementNum;
+	else
+		statement->parameter[1] = target - statementNum;
+}
+
+// Marks everything reachable from entry. Returns false if anything falls
+// off the end, which the loader's checks should already have ruled out.
+bool ProgsOptimizer::Reach(const vector<QcvmStatement> &statements, int32_t entry, vector<char> &reached)
+{
+	int32_t statementsNum = statements.size();
+	vector<int32_t> pending(1, entry);
+	while (!pending.empty())
+	{
+		int32_t i = pending.back();
+		pending.pop_back();
+		if (i < 0 || i >= statementsNum)
+			return false;
+		if (reached[i])
+			continue;
+		reached[i] = 1;
+
+		const QcvmStatement &statement = statements[i];
+		if (statement.instruction == Instructions::GOTO)
+		{
+			pending.push_back(i + statement.parameter[0]);
+			continue;
+		}
+		if (statement.instruction == Instructions::IF || statement.instruction == Instructions::IFNOT)
+			pending.push_back(i + statement.parameter[1]);
+
+		switch (statement.instruction)
+		{
+		case Instructions::DONE:
+		case Instructions::RETURN:
+			break;
+		default:
+			if (statement.instruction != NOP &&
+				(statement.instruction < Instructions::MIN || statement.instruction > Instructions::MAX))
+				break;
+			pending.push_back(i + 1);
+			break;
+		}
+	}
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// Optimize
+//-----------------------------------------------------------------------------
+
+void ProgsOptimizer::Optimize()
+{
+	FindConstants();
+
+	for (int round=0; round<MAX_ROUNDS; ++round)
+	{
+		bool changed = false;
+		changed |= ThreadJumps();
+		changed |= FoldConstants();
+		changed |= RemoveUnreachable();
+		changed |= PropagateCopies();
+		RemoveStatements();
+		if (!changed)
+			break;
+	}
+	CompactGlobals();
+
+	mStats.statementsAfter = mHeader.statements_num;
+	mStats.globalsAfter    = mHeader.globaldata_num;
+}
+
+//-----------------------------------------------------------------------------
+// Jump threading
+//-----------------------------------------------------------------------------
+
+bool ProgsOptimizer::ThreadJumps()
+{
+	bool changed = false;
+	for (int32_t i=0; i<mHeader.statements_num; ++i)
+	{
+		QcvmStatement &statement = mStatements[i];
+		if (!IsJump(statement.instruction))
+			continue;
+
+		int32_t target = JumpTarget(statement, i);
+		int32_t threaded = target;
+		for (int hops=0; hops<MAX_JUMP_HOPS && mStatements[threaded].instruction == Instructions::GOTO; ++hops)
+		{
+			int32_t next = JumpTarget(mStatements[threaded], threaded);
+			if (next == threaded)
+				break;
+			threaded = next;
+		}
+		if (threaded != target && threaded - i >= INT16_MIN && threaded - i <= INT16_MAX)
+		{
+			SetJumpTarget(&statement, i, threaded);
+			++mStats.jumpsThreaded;
+			changed = true;
+		}
+
+		// a jump to the next statement does nothing either way
+		if (JumpTarget(statement, i) == i + 1)
+		{
+			statement.instruction = NOP;
+			++mStats.jumpsThreaded;
+			changed = true;
+		}
+	}
+	return changed;
+}
+
+//-----------------------------------------------------------------------------
+// Constants
+//-----------------------------------------------------------------------------
+
+void ProgsOptimizer::FindConstants()
+{
+	mConstant.assign(mHeader.globaldata_num, 1);
+
+	for (int32_t i=0; i<RESERVED_GLOBALS && i<mHeader.globaldata_num; ++i)
+	{
+		mConstant[i] = 0;
+	}
+	for (int32_t i=0; i<mHeader.functions_num; ++i)
+	{
+		for (int32_t j=0; j<mFunctions[i].numLocals; ++j)
+		{
+			mConstant[mFunctions[i].offsetLocalsInGlobals + j] = 0;
+		}
+	}
+	// anything named could be changed by the host
+	for (int32_t i=0; i<mHeader.globaldefs_num; ++i)
+	{
+		const QcvmDefinition &def = mGlobalDefs[i];
+		if (strcmp(&mStringData[def.nameOffset], "IMMEDIATE") == 0)
+			continue;
+		int32_t width = (def.type & ProgsImage::GLOBALDEF_TYPE_MASK) == VECTOR ? 3 : 1;
+		for (int32_t j=def.offset; j<def.offset+width && j<mHeader.globaldata_num; ++j)
+		{
+			mConstant[j] = 0;
+		}
+	}
+	for (int32_t i=0; i<mHeader.statements_num; ++i)
+	{
+		Effect effect;
+		GetEffect(mStatements[i].instruction, &effect);
+		for (int j=0; j<3; ++j)
+		{
+			if (effect.use[j] != USE_WRITE)
+				continue;
+			for (int32_t k=0; k<effect.width[j]; ++k)
+			{
+				mConstant[mStatements[i].parameter[j] + k] = 0;
+			}
+		}
+	}
+}
+
+bool ProgsOptimizer::IsConstant(int32_t offset, int32_t width) const
+{
+	if (offset < 0 || offset + width > (int32_t)mConstant.size())
+		return false;
+	for (int32_t i=0; i<width; ++i)
+	{
+		if (!mConstant[offset + i])
+			return false;
+	}
+	return true;
+}
+
+// returns the offset of a constant with this value, adding one if needed,
+// or -1 if there is no room
+int32_t ProgsOptimizer::AddConstant(const float *value, int32_t width)
+{
+	for (int32_t i=0; i+width<=(int32_t)mGlobalData.size(); ++i)
+	{
+		if (IsConstant(i, width) && memcmp(&mGlobalData[i], value, width * sizeof(float)) == 0)
+			return i;
+	}
+	int32_t offset = mGlobalData.size();
+	if (offset + width > INT16_MAX)
+		return -1;
+	for (int32_t i=0; i<width; ++i)
+	{
+		mGlobalData.push_back(value[i]);
+		mConstant.push_back(1);
+	}
+	mHeader.globaldata_num = mGlobalData.size();
+	return offset;
+}
+
+//-----------------------------------------------------------------------------
+// Constant folding
+//-----------------------------------------------------------------------------
+
+bool ProgsOptimizer::FoldConstants()
+{
+	bool changed = false;
+	for (int32_t i=0; i<mHeader.statements_num; ++i)
+	{
+		QcvmStatement &statement = mStatements[i];
+		int16_t A = statement.parameter[0];
+		int16_t B = statement.parameter[1];
+
+		Effect effect;
+		GetEffect(statement.instruction, &effect);
+
+		// conditional jumps become a GOTO or nothing
+		if (statement.instruction == Instructions::IF || statement.instruction == Instructions::IFNOT)
+		{
+			if (!IsConstant(A, 1))
+				continue;
+			bool taken = mGlobalData[A] != 0.0f;
+			if (statement.instruction == Instructions::IFNOT)
+				taken = !taken;
+			if (taken)
+			{
+				statement.instruction  = Instructions::GOTO;
+				statement.parameter[0] = B;
+				statement.parameter[1] = 0;
+			}
+			else
+			{
+				statement.instruction = NOP;
+			}
+			++mStats.constantsFolded;
+			changed = true;
+			continue;
+		}
+
+		if (!effect.pure || effect.use[2] != USE_WRITE)
+			continue;
+		if (!IsConstant(A, effect.width[0]))
+			continue;
+		if (effect.use[1] == USE_READ && !IsConstant(B, effect.width[1]))
+			continue;
+
+		const float *a = &mGlobalData[A];
+		const float *b = &mGlobalData[B];
+		int32_t ia, ib;
+		memcpy(&ia, a, sizeof(ia));
+		memcpy(&ib, b, sizeof(ib));
+		float result[3];
+		switch (statement.instruction)
+		{
+		case Instructions::MUL_F:  result[0] = a[0] * b[0]; break;
+		case Instructions::DIV_F:  result[0] = a[0] / b[0]; break;
+		case Instructions::ADD_F:  result[0] = a[0] + b[0]; break;
+		case Instructions::SUB_F:  result[0] = a[0] - b[0]; break;
+		case Instructions::MUL_V:  result[0] = a[0] * b[0] + a[1] * b[1] + a[2] * b[2]; break;
+		case Instructions::EQ_F:   result[0] = (a[0] == b[0]); break;
+		case Instructions::NE_F:   result[0] = (a[0] != b[0]); break;
+		case Instructions::EQ_V:   result[0] = (a[0] == b[0] && a[1] == b[1] && a[2] == b[2]); break;
+		case Instructions::NE_V:   result[0] = (a[0] != b[0] || a[1] != b[1] || a[2] != b[2]); break;
+		case Instructions::EQ_E:
+		case Instructions::EQ_FNC: result[0] = (ia == ib); break;
+		case Instructions::NE_E:
+		case Instructions::NE_FNC: result[0] = (ia != ib); break;
+		case Instructions::LE:     result[0] = (a[0] <= b[0]); break;
+		case Instructions::GE:     result[0] = (a[0] >= b[0]); break;
+		case Instructions::LT:     result[0] = (a[0] <  b[0]); break;
+		case Instructions::GT:     result[0] = (a[0] >  b[0]); break;
+		case Instructions::AND:    result[0] = a[0] && b[0]; break;
+		case Instructions::OR:     result[0] = a[0] || b[0]; break;
+		case Instructions::BITAND: result[0] = (float)((int)a[0] & (int)b[0]); break;
+		case Instructions::BITOR:  result[0] = (float)((int)a[0] | (int)b[0]); break;
+		case Instructions::NOT_F:  result[0] = !a[0]; break;
+		case Instructions::NOT_V:  result[0] = !a[0] && !a[1] && !a[2]; break;
+		case Instructions::NOT_S:
+		case Instructions::NOT_ENT:
+		case Instructions::NOT_FNC: result[0] = !ia; break;
+		case Instructions::ADD_V:
+			result[0] = a[0] + b[0]; result[1] = a[1] + b[1]; result[2] = a[2] + b[2];
+			break;
+		case Instructions::SUB_V:
+			result[0] = a[0] - b[0]; result[1] = a[1] - b[1]; result[2] = a[2] - b[2];
+			break;
+		case Instructions::MUL_FV:
+			result[0] = a[0] * b[0]; result[1] = a[0] * b[1]; result[2] = a[0] * b[2];
+			break;
+		case Instructions::MUL_VF:
+			result[0] = a[0] * b[0]; result[1] = a[1] * b[0]; result[2] = a[2] * b[0];
+			break;
+		// strings compare by contents, entities by address
+		default:
+			continue;
+		}
+
+		int32_t width = effect.width[2];
+		int32_t constant = AddConstant(result, width);
+		if (constant < 0)
+			continue;
+		statement.instruction  = width == 3 ? Instructions::STORE_V : Instructions::STORE_F;
+		statement.parameter[1] = statement.parameter[2];
+		statement.parameter[0] = constant;
+		statement.parameter[2] = 0;
+		++mStats.constantsFolded;
+		changed = true;
+	}
+	return changed;
+}
+
+//-----------------------------------------------------------------------------
+// Unreachable code
+//-----------------------------------------------------------------------------
+
+bool ProgsOptimizer::RemoveUnreachable()
+{
+	vector<char> reached(mHeader.statements_num, 0);
+	for (int32_t i=0; i<mHeader.functions_num; ++i)
+	{
+		if (mFunctions[i].offsetFirstStatement > 0)
+			Reach(mStatements, mFunctions[i].offsetFirstStatement, reached);
+	}
+
+	bool changed = false;
+	// statement 0 is never run, but is conventionally there, as is the
+	// DONE at the end
+	for (int32_t i=1; i<mHeader.statements_num; ++i)
+	{
+		if (i == mHeader.statements_num - 1 && mStatements[i].instruction == Instructions::DONE)
+			continue;
+		if (!reached[i] && mStatements[i].instruction != NOP)
+		{
+			mStatements[i].instruction = NOP;
+			++mStats.unreachable;
+			changed = true;
+		}
+	}
+	return changed;
+}
+
+//-----------------------------------------------------------------------------
+// Copy propagation and dead stores
+//-----------------------------------------------------------------------------
+
+void ProgsOptimizer::FindOwners()
+{
+	const int32_t SHARED = -2;
+	mOwner.assign(mHeader.statements_num, -1);
+	vector<char> reached;
+	for (int32_t f=0; f<mHeader.functions_num; ++f)
+	{
+		if (mFunctions[f].offsetFirstStatement <= 0)
+			continue;
+		reached.assign(mHeader.statements_num, 0);
+		Reach(mStatements, mFunctions[f].offsetFirstStatement, reached);
+		for (int32_t i=0; i<mHeader.statements_num; ++i)
+		{
+			if (reached[i])
+				mOwner[i] = mOwner[i] == -1 ? f : SHARED;
+		}
+	}
+}
+
+bool ProgsOptimizer::PropagateCopies()
+{
+	FindOwners();
+	bool changed = false;
+	for (int32_t f=0; f<mHeader.functions_num; ++f)
+	{
+		changed |= PropagateCopies(f);
+	}
+	return changed;
+}
+
+static bool Overlaps(int32_t a, int32_t aWidth, int32_t b, int32_t bWidth)
+{
+	return a < b + bWidth && b < a + aWidth;
+}
+
+// all of [l, l+width) are dead, other than those flagged in except
+static bool IsDeadAfter(const char *liveOut, int32_t l, int32_t width, const char *except)
+{
+	for (int32_t w=0; w<width; ++w)
+	{
+		if (liveOut[l + w] && !(except && except[w]))
+			return false;
+	}
+	return true;
+}
+
+bool ProgsOptimizer::PropagateCopies(int32_t functionNum)
+{
+	const QcvmFunction &function = mFunctions[functionNum];
+	const int32_t localsStart = function.offsetLocalsInGlobals;
+	const int32_t localsNum   = function.numLocals;
+	if (function.offsetFirstStatement <= 0 || localsNum <= 0)
+		return false;
+
+	// gather the function's statements, giving up if any are shared
+	vector<int32_t> body;
+	vector<int32_t> index(mHeader.statements_num, -1);
+	for (int32_t i=0; i<mHeader.statements_num; ++i)
+	{
+		if (mOwner[i] == functionNum)
+		{
+			index[i] = body.size();
+			body.push_back(i);
+		}
+	}
+	if (index[function.offsetFirstStatement] < 0)
+		return false;
+	int32_t bodyNum = body.size();
+
+	vector<char> jumpTarget(mHeader.statements_num, 0);
+	vector<Effect> effects(bodyNum);
+	for (int32_t k=0; k<bodyNum; ++k)
+	{
+		int32_t i = body[k];
+		GetEffect(mStatements[i].instruction, &effects[k]);
+		if (IsJump(mStatements[i].instruction))
+			jumpTarget[JumpTarget(mStatements[i], i)] = 1;
+	}
+
+	// liveness of the locals only, as everything else may be seen from
+	// outside; locals are restored on return, so nothing is live at exits
+	vector<char> liveIn (bodyNum * localsNum, 0);
+	vector<char> liveOut(bodyNum * localsNum, 0);
+	for (bool changed=true; changed; )
+	{
+		changed = false;
+		for (int32_t k=bodyNum-1; k>=0; --k)
+		{
+			int32_t i = body[k];
+			const QcvmStatement &statement = mStatements[i];
+			const Effect &effect = effects[k];
+			char *in  = &liveIn [k * localsNum];
+			char *out = &liveOut[k * localsNum];
+
+			int32_t successors[2];
+			int32_t successorsNum = 0;
+			if (IsJump(statement.instruction))
+				successors[successorsNum++] = JumpTarget(statement, i);
+			if (!effect.terminates && i + 1 < mHeader.statements_num)
+				successors[successorsNum++] = i + 1;
+			for (int s=0; s<successorsNum; ++s)
+			{
+				int32_t next = index[successors[s]];
+				if (next < 0)
+					continue;
+				const char *nextIn = &liveIn[next * localsNum];
+				for (int32_t l=0; l<localsNum; ++l)
+				{
+					out[l] |= nextIn[l];
+				}
+			}
+
+			vector<char> newIn(out, out + localsNum);
+			for (int j=0; j<3; ++j)
+			{
+				if (effect.use[j] != USE_WRITE)
+					continue;
+				for (int32_t w=0; w<effect.width[j]; ++w)
+				{
+					int32_t l = statement.parameter[j] + w - localsStart;
+					if (l >= 0 && l < localsNum)
+						newIn[l] = 0;
+				}
+			}
+			for (int j=0; j<3; ++j)
+			{
+				if (effect.use[j] != USE_READ)
+					continue;
+				for (int32_t w=0; w<effect.width[j]; ++w)
+				{
+					int32_t l = statement.parameter[j] + w - localsStart;
+					if (l >= 0 && l < localsNum)
+						newIn[l] = 1;
+				}
+			}
+			if (memcmp(in, &newIn[0], localsNum) != 0)
+			{
+				memcpy(in, &newIn[0], localsNum);
+				changed = true;
+			}
+		}
+	}
+
+	// the write operand of an instruction, or -1
+	#define WRITE_OPERAND(effect) \
+		((effect).use[1] == USE_WRITE ? 1 : (effect).use[2] == USE_WRITE ? 2 : -1)
+	#define IS_LOCAL(ofs, width) \
+		((ofs) >= localsStart && (ofs) + (width) <= localsStart + localsNum)
+	#define IS_DEAD_AFTER(k, ofs, width, except) \
+		(IsDeadAfter(&liveOut[(k) * localsNum], (ofs) - localsStart, (width), (except)))
+
+	bool changed = false;
+	for (int32_t k=0; k<bodyNum; ++k)
+	{
+		int32_t i = body[k];
+		QcvmStatement &statement = mStatements[i];
+		Effect &effect = effects[k];
+		int writeOperand = WRITE_OPERAND(effect);
+		if (writeOperand < 0)
+			continue;
+		int32_t T = statement.parameter[writeOperand];
+		int32_t width = effect.width[writeOperand];
+		if (!IS_LOCAL(T, width))
+			continue;
+
+		// dead store
+		if (effect.pure && IS_DEAD_AFTER(k, T, width, NULL))
+		{
+			statement.instruction = NOP;
+			GetEffect(NOP, &effect);
+			++mStats.deadStores;
+			changed = true;
+			continue;
+		}
+
+		// the rest pair this statement with the one after it
+		if (k + 1 >= bodyNum || body[k+1] != i + 1 || jumpTarget[i+1])
+			continue;
+		QcvmStatement &next = mStatements[i+1];
+		Effect &nextEffect = effects[k+1];
+		if (next.instruction == NOP)
+			continue;
+
+		// computed into a temp then stored: compute into the destination
+		bool nextIsStore = nextEffect.pure && nextEffect.use[1] == USE_WRITE && next.parameter[0] == T &&
+			nextEffect.width[0] == width;
+		if (nextIsStore && IS_DEAD_AFTER(k+1, T, width, NULL))
+		{
+			int32_t X = next.parameter[1];
+			bool safe = true;
+			if (width > 1)
+			{
+				bool elementwise = statement.instruction == Instructions::ADD_V ||
+					statement.instruction == Instructions::SUB_V ||
+					statement.instruction == Instructions::STORE_V;
+				for (int j=0; j<3; ++j)
+				{
+					if (effect.use[j] == USE_READ &&
+						Overlaps(statement.parameter[j], effect.width[j], X, width) &&
+						!(elementwise && statement.parameter[j] == X))
+					{
+						safe = false;
+					}
+				}
+			}
+			if (safe)
+			{
+				statement.parameter[writeOperand] = X;
+				next.instruction = NOP;
+				GetEffect(NOP, &nextEffect);
+				++mStats.copiesPropagated;
+				changed = true;
+				continue;
+			}
+		}
+
+		// stored into a temp then used: use the original
+		bool isStore = effect.pure && writeOperand == 1;
+		if (!isStore)
+			continue;
+		int32_t source = statement.parameter[0];
+		int nextWrite = WRITE_OPERAND(nextEffect);
+		// which of the temp the next statement writes itself
+		char redefined[3] = { 0, 0, 0 };
+		if (nextWrite >= 0)
+		{
+			for (int32_t w=0; w<width; ++w)
+			{
+				redefined[w] = Overlaps(T + w, 1, next.parameter[nextWrite], nextEffect.width[nextWrite]);
+			}
+		}
+		if (!IS_DEAD_AFTER(k+1, T, width, redefined))
+			continue;
+
+		QcvmStatement rewritten = next;
+		bool reads = false;
+		bool safe = true;
+		for (int j=0; j<3; ++j)
+		{
+			int32_t readWidth = nextEffect.width[j];
+			// a return always copies a vector, but only the first part of a
+			// scalar's is ever looked at
+			if (next.instruction == Instructions::RETURN || next.instruction == Instructions::DONE)
+				readWidth = width;
+			if (nextEffect.use[j] != USE_READ || !Overlaps(next.parameter[j], readWidth, T, width))
+				continue;
+			if (next.parameter[j] < T || next.parameter[j] + readWidth > T + width)
+				safe = false;
+			rewritten.parameter[j] = source + (next.parameter[j] - T);
+			reads = true;
+		}
+		if (!reads || !safe)
+			continue;
+		if (nextWrite >= 0 && nextEffect.width[nextWrite] > 1)
+		{
+			bool elementwise = next.instruction == Instructions::ADD_V ||
+				next.instruction == Instructions::SUB_V ||
+				next.instruction == Instructions::STORE_V;
+			int32_t X = next.parameter[nextWrite];
+			for (int j=0; j<3; ++j)
+			{
+				if (nextEffect.use[j] == USE_READ &&
+					Overlaps(rewritten.parameter[j], nextEffect.width[j], X, nextEffect.width[nextWrite]) &&
+					!(elementwise && rewritten.parameter[j] == X))
+				{
+					safe = false;
+				}
+			}
+			if (!safe)
+				continue;
+		}
+		next = rewritten;
+		statement.instruction = NOP;
+		GetEffect(NOP, &effect);
+		++mStats.copiesPropagated;
+		changed = true;
+	}
+
+	#undef IS_DEAD_AFTER
+	#undef IS_LOCAL
+	#undef WRITE_OPERAND
+
+	return changed;
+}
+
+//-----------------------------------------------------------------------------
+// Remove statements
+//-----------------------------------------------------------------------------
+
+// Drops every NOP, renumbering jumps and functions to match. A jump to a
+// NOP goes to whatever followed it.
+void ProgsOptimizer::RemoveStatements()
+{
+	int32_t statementsNum = mHeader.statements_num;
+	vector<int32_t> newIndex(statementsNum + 1);
+	int32_t kept = 0;
+	for (int32_t i=0; i<statementsNum; ++i)
+	{
+		newIndex[i] = kept;
+		if (mStatements[i].instruction != NOP)
+			++kept;
+	}
+	newIndex[statementsNum] = kept;
+	if (kept == statementsNum)
+		return;
+
+	vector<QcvmStatement> statements;
+	statements.reserve(kept + 1);
+	for (int32_t i=0; i<statementsNum; ++i)
+	{
+		QcvmStatement statement = mStatements[i];
+		if (statement.instruction == NOP)
+			continue;
+		if (IsJump(statement.instruction))
+			SetJumpTarget(&statement, newIndex[i], newIndex[JumpTarget(statement, i)]);
+		statements.push_back(statement);
+	}
+	// the interpreters insist on ending with DONE
+	if (statements.empty() || statements.back().instruction != Instructions::DONE)
+	{
+		QcvmStatement done = { Instructions::DONE, { 0, 0, 0 } };
+		statements.push_back(done);
+	}
+
+	for (int32_t f=0; f<mHeader.functions_num; ++f)
+	{
+		if (mFunctions[f].offsetFirstStatement > 0)
+			mFunctions[f].offsetFirstStatement = newIndex[mFunctions[f].offsetFirstStatement];
+	}
+
+	mStatements.swap(statements);
+	mHeader.statements_num = mStatements.size();
+}
+
+//-----------------------------------------------------------------------------
+// Compact globals
+//-----------------------------------------------------------------------------
+
+void ProgsOptimizer::CompactGlobals()
+{
+	int32_t globalsNum = mHeader.globaldata_num;
+	vector<char> used(globalsNum, 0);
+
+	for (int32_t i=0; i<RESERVED_GLOBALS && i<globalsNum; ++i)
+	{
+		used[i] = 1;
+	}
+	for (int32_t f=0; f<mHeader.functions_num; ++f)
+	{
+		for (int32_t j=0; j<mFunctions[f].numLocals; ++j)
+		{
+			used[mFunctions[f].offsetLocalsInGlobals + j] = 1;
+		}
+	}
+	for (int32_t i=0; i<mHeader.statements_num; ++i)
+	{
+		Effect effect;
+		GetEffect(mStatements[i].instruction, &effect);
+		for (int j=0; j<3; ++j)
+		{
+			for (int32_t w=0; w<effect.width[j] && mStatements[i].parameter[j] + w < globalsNum; ++w)
+			{
+				used[mStatements[i].parameter[j] + w] = 1;
+			}
+		}
+	}
+	// immediates are only kept if something still uses them
+	vector<QcvmDefinition> globalDefs;
+	for (int32_t i=0; i<mHeader.globaldefs_num; ++i)
+	{
+		const QcvmDefinition &def = mGlobalDefs[i];
+		if (strcmp(&mStringData[def.nameOffset], "IMMEDIATE") == 0 && !used[def.offset])
+			continue;
+		globalDefs.push_back(def);
+	}
+	for (size_t i=0; i<globalDefs.size(); ++i)
+	{
+		const QcvmDefinition &def = globalDefs[i];
+		int32_t width = (def.type & ProgsImage::GLOBALDEF_TYPE_MASK) == VECTOR ? 3 : 1;
+		for (int32_t w=0; w<width && def.offset + w < globalsNum; ++w)
+		{
+			used[def.offset + w] = 1;
+		}
+	}
+
+	// unused globals map to the next one kept, which only matters for
+	// functions with no locals
+	vector<int32_t> newOffset(globalsNum + 1);
+	vector<float> globalData;
+	for (int32_t i=0; i<globalsNum; ++i)
+	{
+		newOffset[i] = globalData.size();
+		if (used[i])
+			globalData.push_back(mGlobalData[i]);
+	}
+	newOffset[globalsNum] = globalData.size();
+
+	for (int32_t i=0; i<mHeader.statements_num; ++i)
+	{
+		Effect effect;
+		GetEffect(mStatements[i].instruction, &effect);
+		for (int j=0; j<3; ++j)
+		{
+			if (effect.use[j] == USE_READ || effect.use[j] == USE_WRITE)
+				mStatements[i].parameter[j] = newOffset[mStatements[i].parameter[j]];
+		}
+	}
+	for (size_t i=0; i<globalDefs.size(); ++i)
+	{
+		globalDefs[i].offset = newOffset[globalDefs[i].offset];
+	}
+	for (int32_t f=0; f<mHeader.functions_num; ++f)
+	{
+		mFunctions[f].offsetLocalsInGlobals = newOffset[mFunctions[f].offsetLocalsInGlobals];
+	}
+
+	mGlobalDefs.swap(globalDefs);
+	mGlobalData.swap(globalData);
+	mHeader.globaldefs_num = mGlobalDefs.size();
+	mHeader.globaldata_num = mGlobalData.size();
+	mConstant.clear();
+}
+
+//-----------------------------------------------------------------------------
+// Write
+//-----------------------------------------------------------------------------
+
+bool ProgsOptimizer::Write(ostream &out)
+{
+	if (mStatements.empty())
+		return false;
+
+	QcvmHeader header = mHeader;
+	int32_t offset = sizeof(header);
+	header.stringdata_offset = offset;
+	offset += mStringData.size();
+	header.statements_offset = offset;
+	offset += mStatements.size() * sizeof(QcvmStatement);
+	header.functions_offset  = offset;
+	offset += mFunctions.size()  * sizeof(QcvmFunction);
+	header.globaldefs_offset = offset;
+	offset += mGlobalDefs.size() * sizeof(QcvmDefinition);
+	header.fielddefs_offset  = offset;
+	offset += mFieldDefs.size()  * sizeof(QcvmDefinition);
+	header.globaldata_offset = offset;
+
+	for (size_t i=0; i<mFunctions.size(); ++i)
+	{
+		mFunctions[i].profiling = 0;
+	}
+
+	out.write((const char*)&header, sizeof(header));
+	out.write(&mStringData[0], mStringData.size());
+	out.write((const char*)&mStatements[0], mStatements.size() * sizeof(QcvmStatement));
+	if (!mFunctions.empty())
+		out.write((const char*)&mFunctions[0], mFunctions.size() * sizeof(QcvmFunction));
+	if (!mGlobalDefs.empty())
+		out.write((const char*)&mGlobalDefs[0], mGlobalDefs.size() * sizeof(QcvmDefinition));
+	if (!mFieldDefs.empty())
+		out.write((const char*)&mFieldDefs[0], mFieldDefs.size() * sizeof(QcvmDefinition));
+	if (!mGlobalData.empty())
+		out.write((const char*)&mGlobalData[0], mGlobalData.size() * sizeof(float));
+	return out.good();
+}
+
+//-----------------------------------------------------------------------------
+} // namespace
+//-----------------------------------------------------------------------------
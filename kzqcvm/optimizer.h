@@ -0,0 +1,158 @@
+/*
+Kzqcvm QuakeC VM Interpreter
+Copyright (c) 2010 David Laurie
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+/*
+kzqcvm/optimizer.h
+*/
+
+//-----------------------------------------------------------------------------
+#ifndef KZQCVM_OPTIMIZER_H
+#define KZQCVM_OPTIMIZER_H
+//-----------------------------------------------------------------------------
+
+#include <stdint.h>
+#include <vector>
+#include <ostream>
+
+#include "structs.h"
+#include "progsimage.h"
+
+//-----------------------------------------------------------------------------
+namespace kzqcvm {
+	using std::vector;
+	using std::ostream;
+//-----------------------------------------------------------------------------
+
+/*
+Rewrites a progs to do the same work in fewer statements and globals, and
+writes it back out as a standard version 6 progs that any interpreter can
+run. It works on a copy of a loaded image, so the input has already been
+validated. The passes are:
+
+- jump threading: jumps to a GOTO go straight to its target, and jumps to
+  the next statement are removed
+- constant folding: arithmetic, comparisons and conditional jumps on
+  constants are evaluated, with any new constants added to the globals
+- copy propagation: a result computed into a temp and then stored
+  elsewhere is computed there directly, and a value stored into a temp and
+  then used is used directly
+- dead store elimination: results stored into a function's locals and
+  never read again are not computed
+- unreachable code elimination
+- global compaction: globals no statement, definition or function refers to
+  are removed, and the rest renumbered
+
+A constant is a global with no definition (or one named IMMEDIATE) which no
+statement writes, outside the parameters and every function's locals.
+Liveness is only tracked for a function's own locals, which it restores
+before returning, so nothing the host or a builtin could see is affected.
+
+The CRC is kept, so the host still accepts the progs, but the layout of the
+globals changes; states saved with the original progs can't be loaded into
+the optimized one, and external line number files no longer match.
+*/
+class ProgsOptimizer {
+public:
+	ProgsOptimizer();
+
+	// copies the lumps out of a loaded image
+	bool Load(const ProgsImage *image);
+	// runs all the passes until they stop finding anything
+	void Optimize();
+	bool Write(ostream &out);
+
+	// counts of what was done, for reporting
+	struct Stats {
+		int32_t statementsBefore;
+		int32_t statementsAfter;
+		int32_t globalsBefore;
+		int32_t globalsAfter;
+		int32_t jumpsThreaded;
+		int32_t constantsFolded;
+		int32_t copiesPropagated;
+		int32_t deadStores;
+		int32_t unreachable;
+	};
+	const Stats &GetStats() const { return mStats; }
+
+private:
+	// operand use of each instruction, see GetEffect
+	enum OperandUse {
+		USE_NONE,
+		USE_READ,
+		USE_WRITE,
+		USE_JUMP
+	};
+	struct Effect {
+		OperandUse use[3];
+		int32_t    width[3];
+		// pure instructions can be removed if what they write is dead
+		bool       pure;
+		// no following statement
+		bool       terminates;
+	};
+	static void GetEffect(int16_t instruction, Effect *effect);
+	static bool IsJump(int16_t instruction);
+	static int32_t JumpTarget(const QcvmStatement &statement, int32_t statementNum);
+	static void SetJumpTarget(QcvmStatement *statement, int32_t statementNum, int32_t target);
+	static bool Reach(const vector<QcvmStatement> &statements, int32_t entry, vector<char> &reached);
+
+	// a statement a pass has removed, dropped by RemoveStatements
+	static const int16_t NOP = -1;
+
+	bool ThreadJumps();
+	bool FoldConstants();
+	bool RemoveUnreachable();
+	bool PropagateCopies();
+	bool PropagateCopies(int32_t functionNum);
+	void RemoveStatements();
+	void CompactGlobals();
+
+	// constants
+	void FindConstants();
+	bool IsConstant(int32_t offset, int32_t width) const;
+	int32_t AddConstant(const float *value, int32_t width);
+
+	// per statement, the function it belongs to, or -1 if shared or none
+	void FindOwners();
+	vector<int32_t>        mOwner;
+
+	QcvmHeader             mHeader;
+	vector<QcvmStatement>  mStatements;
+	vector<QcvmDefinition> mGlobalDefs;
+	vector<QcvmDefinition> mFieldDefs;
+	vector<QcvmFunction>   mFunctions;
+	vector<char>           mStringData;
+	vector<float>          mGlobalData;
+
+	vector<char>           mConstant;
+
+	Stats                  mStats;
+};
+
+//-----------------------------------------------------------------------------
+} // namespace
+//-----------------------------------------------------------------------------
+
+//-----------------------------------------------------------------------------
+#endif
+//-----------------------------------------------------------------------------
@@ -0,0 +1,280 @@
+/*
+Kzqcvm QuakeC VM Interpreter
+Copyright (c) 2010 David Laurie
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+/*
+kzqcvm/progscache.cpp
+*/
+
+#include "progsimage.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+#include <iostream>
+#include <fstream>
+
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+//-----------------------------------------------------------------------------
+namespace kzqcvm {
+	using std::vector;
+	using std::ofstream;
+	using std::ios;
+//-----------------------------------------------------------------------------
+
+// Layout of a cache file:
+//
+// CacheHeader
+// char[size]                         the progs as validated, compared in full
+// char[globaldefs_num]               mGlobalDefData
+// int8[entity_size]                  mFieldOffsetTypes
+// CodeInstruction[instructions_num] mCode.instructions
+// CodeSource[instructions_num]      mCode.sources
+// int32[functions_num]               mCode.functionStarts
+// float[extra_globals_num]           mCode.extraGlobalData
+// char[globaldata_num]               mCode.constants
+//
+// The decoded code is trusted as it stands, so a cache is only read if it
+// belongs to us and nobody else can write it, and only used for exactly the
+// progs it was made from. Bump CACHE_VERSION whenever the layout or the
+// meaning of anything in it changes, as old caches would otherwise be
+// trusted.
+
+static const char    CACHE_MAGIC[4] = { 'K', 'Z', 'Q', 'C' };
+static const int32_t CACHE_VERSION  = 2;
+
+struct CacheHeader {
+	char     magic[4];
+	int32_t  version;
+	uint64_t hash;
+	int32_t  size;
+	int32_t  globaldefs_num;
+	int32_t  entity_size;
+	int32_t  globaldata_num;
+	int32_t  functions_num;
+	int32_t  instructions_num;
+	int32_t  extra_globals_num;
+	// sizes of the structs as written, in case they differ between builds
+	int32_t  instruction_size;
+	int32_t  source_size;
+};
+
+//-----------------------------------------------------------------------------
+// Hash
+//-----------------------------------------------------------------------------
+
+// FNV-1a over 64 bit words, which is plenty to notice a changed progs and
+// runs at memory speed.
+uint64_t ProgsImage::HashData(const char *data, int32_t size)
+{
+	const uint64_t FNV_OFFSET = 0xcbf29ce484222325ULL;
+	const uint64_t FNV_PRIME  = 0x100000001b3ULL;
+
+	uint64_t hash = FNV_OFFSET;
+	int32_t i = 0;
+	for (; i + 8 <= size; i += 8)
+	{
+		uint64_t word;
+		memcpy(&word, &data[i], sizeof(word));
+		hash = (hash ^ word) * FNV_PRIME;
+	}
+	for (; i < size; ++i)
+	{
+		hash = (hash ^ (unsigned char)data[i]) * FNV_PRIME;
+	}
+	return hash ^ (uint64_t)size;
+}
+
+//-----------------------------------------------------------------------------
+// Load
+//-----------------------------------------------------------------------------
+
+// Reads the whole file, if it is ours alone to write.
+static bool ReadTrustedFile(const string &filename, vector<char> &contents)
+{
+	int fd = open(filename.c_str(), O_RDONLY);
+	if (fd < 0)
+		return false;
+	struct stat st;
+	if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_uid != geteuid() ||
+		(st.st_mode & (S_IWGRP | S_IWOTH)) != 0 || st.st_size <= 0 || st.st_size > 0x7fffffff)
+	{
+		close(fd);
+		return false;
+	}
+	contents.resize(st.st_size);
+	size_t done = 0;
+	while (done < contents.size())
+	{
+		ssize_t got = read(fd, &contents[done], contents.size() - done);
+		if (got <= 0)
+			break;
+		done += got;
+	}
+	close(fd);
+	return done == contents.size();
+}
+
+// Hands out a cache file's sections in turn.
+struct CacheReader {
+	const vector<char> &contents;
+	size_t              position;
+
+	CacheReader(const vector<char> &c) : contents(c), position(0) { }
+	const char *Take(size_t size)
+	{
+		if (size > contents.size() - position)
+			return NULL;
+		const char *section = &contents[position];
+		position += size;
+		return section;
+	}
+	template <class T> bool Read(vector<T> &v, int32_t count)
+	{
+		const char *section = Take(count * sizeof(T));
+		if (!section)
+			return false;
+		v.resize(count);
+		if (count > 0)
+			memcpy(&v[0], section, count * sizeof(T));
+		return true;
+	}
+};
+
+bool ProgsImage::LoadCache()
+{
+	vector<char> contents;
+	if (!ReadTrustedFile(mCacheFilename, contents))
+		return false;
+	CacheReader reader(contents);
+
+	CacheHeader header;
+	const char *section = reader.Take(sizeof(header));
+	if (!section)
+		return false;
+	memcpy(&header, section, sizeof(header));
+	if (memcmp(header.magic, CACHE_MAGIC, sizeof(header.magic)) != 0 ||
+		header.version           != CACHE_VERSION ||
+		header.hash              != mContentHash ||
+		header.size              != mQcvmSize ||
+		header.globaldefs_num    != mHeader->globaldefs_num ||
+		header.entity_size       != mHeader->entity_size ||
+		header.globaldata_num    != mHeader->globaldata_num ||
+		header.functions_num     != mHeader->functions_num ||
+		header.instruction_size  != (int32_t)sizeof(CodeInstruction) ||
+		header.source_size       != (int32_t)sizeof(CodeSource) ||
+		header.instructions_num  <= 0 ||
+		header.extra_globals_num < 0)
+	{
+		return false;
+	}
+	// a matching hash isn't enough to run the code on
+	section = reader.Take(mQcvmSize);
+	if (!section || memcmp(section, mQcvmData, mQcvmSize) != 0)
+		return false;
+
+	vector<char> globalDefData;
+	vector<signed char> fieldTypes;
+	Code code;
+	if (!reader.Read(globalDefData, mHeader->globaldefs_num) ||
+		!reader.Read(fieldTypes, mHeader->entity_size) ||
+		!reader.Read(code.instructions, header.instructions_num) ||
+		!reader.Read(code.sources, header.instructions_num) ||
+		!reader.Read(code.functionStarts, mHeader->functions_num) ||
+		!reader.Read(code.extraGlobalData, header.extra_globals_num) ||
+		!reader.Read(code.constants, mHeader->globaldata_num) ||
+		reader.position != contents.size())
+	{
+		return false;
+	}
+	code.globalsNum = mHeader->globaldata_num + header.extra_globals_num;
+
+	mGlobalDefData = new char[mHeader->globaldefs_num];
+	if (mHeader->globaldefs_num > 0)
+		memcpy(mGlobalDefData, &globalDefData[0], mHeader->globaldefs_num);
+	mFieldOffsetTypes = new QcvmDefinitionType[mHeader->entity_size];
+	for (int i=0; i<mHeader->entity_size; ++i)
+	{
+		mFieldOffsetTypes[i] = QcvmDefinitionType(fieldTypes[i]);
+	}
+	mCode = code;
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// Save
+//-----------------------------------------------------------------------------
+
+void ProgsImage::SaveCache()
+{
+	// write to a temporary and rename, so a reader never sees half a cache
+	string tempFilename = mCacheFilename + ".tmp";
+	ofstream cacheFile(tempFilename.c_str(), ios::binary | ios::out | ios::trunc);
+	if (!cacheFile.is_open())
+		return;
+
+	CacheHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, CACHE_MAGIC, sizeof(header.magic));
+	header.version           = CACHE_VERSION;
+	header.hash              = mContentHash;
+	header.size              = mQcvmSize;
+	header.globaldefs_num    = mHeader->globaldefs_num;
+	header.entity_size       = mHeader->entity_size;
+	header.globaldata_num    = mHeader->globaldata_num;
+	header.functions_num     = mHeader->functions_num;
+	header.instructions_num  = (int32_t)mCode.instructions.size();
+	header.extra_globals_num = (int32_t)mCode.extraGlobalData.size();
+	header.instruction_size  = (int32_t)sizeof(CodeInstruction);
+	header.source_size       = (int32_t)sizeof(CodeSource);
+	cacheFile.write((const char*)&header, sizeof(header));
+
+	cacheFile.write(mQcvmData, mQcvmSize);
+	cacheFile.write(mGlobalDefData, mHeader->globaldefs_num);
+	for (int i=0; i<mHeader->entity_size; ++i)
+	{
+		signed char type = mFieldOffsetTypes[i];
+		cacheFile.write((const char*)&type, 1);
+	}
+	cacheFile.write((const char*)&mCode.instructions[0], mCode.instructions.size() * sizeof(CodeInstruction));
+	cacheFile.write((const char*)&mCode.sources[0], mCode.sources.size() * sizeof(CodeSource));
+	if (!mCode.functionStarts.empty())
+		cacheFile.write((const char*)&mCode.functionStarts[0], mCode.functionStarts.size() * sizeof(int32_t));
+	if (!mCode.extraGlobalData.empty())
+		cacheFile.write((const char*)&mCode.extraGlobalData[0], mCode.extraGlobalData.size() * sizeof(float));
+	if (!mCode.constants.empty())
+		cacheFile.write(&mCode.constants[0], mCode.constants.size());
+	cacheFile.close();
+
+	// LoadCache won't read it if anyone else can write it
+	if (cacheFile.fail() || chmod(tempFilename.c_str(), S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH) != 0 ||
+		rename(tempFilename.c_str(), mCacheFilename.c_str()) != 0)
+	{
+		remove(tempFilename.c_str());
+	}
+}
+
+//-----------------------------------------------------------------------------
+} // namespace
+//-----------------------------------------------------------------------------
@@ -0,0 +1,197 @@
+/*
+Kzqcvm QuakeC VM Interpreter
+Copyright (c) 2010 David Laurie
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+/*
+kzqcvm/progsimage.h
+*/
+
+//-----------------------------------------------------------------------------
+#ifndef KZQCVM_PROGSIMAGE_H
+#define KZQCVM_PROGSIMAGE_H
+//-----------------------------------------------------------------------------
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+#include <vector>
+#include <atomic>
+
+#include "structs.h"
+#include "code.h"
+
+//-----------------------------------------------------------------------------
+namespace kzqcvm {
+	using std::string;
+	using std::vector;
+//-----------------------------------------------------------------------------
+
+/*
+A ProgsImage is the read-only part of a loaded progs: the statements,
+definitions, functions and string constants, plus the indexes derived from
+them at load time. It is validated once and can then be shared by any number
+of Kzqcvm instances, each of which only allocates its own global data and
+entity and string managers.
+
+Images are reference counted. A new image starts with one reference which
+belongs to whoever constructed it; each Kzqcvm attached to it holds another.
+Call Release() instead of deleting it. The count is atomic, so instances on
+different threads may be created and destroyed freely, but nothing in the
+image may be modified once it has loaded.
+*/
+class ProgsImage {
+	friend class Kzqcvm;
+	friend class ProgsOptimizer;
+public:
+	/*
+	Constructs with a filename. It will try to load and validate the file.
+	The file is mapped rather than read where possible, and the statements,
+	definitions and functions stay in the mapping for the life of the image;
+	only the string constants are copied out. So replace a progs which may
+	be loaded by writing a new file and renaming it over the old one, never
+	by rewriting it in place.
+	*/
+	ProgsImage(string filename);
+	/*
+	As above, but keeps the indexes and decoded code in the sidecar file
+	cacheFilename (conventionally filename + ".kzc"). The progs is still
+	validated on every load; when the cache holds an exact copy of it, later
+	loads skip indexing and decoding. Since the cached code is run as it
+	stands, a cache is only read if it is a regular file owned by the
+	current user and writable by nobody else, so keep it somewhere only
+	this user can create files. A stale, untrusted or unreadable cache is
+	simply rebuilt, and failing to write one is not an error.
+	*/
+	ProgsImage(string filename, string cacheFilename);
+	/*
+	Constructs from a progs already in memory, such as one embedded in the
+	executable. The data is used in place where possible, so it must stay
+	valid and unchanged for the life of the image.
+	*/
+	ProgsImage(const void *data, size_t size);
+
+	void AddRef();
+	void Release();
+
+	/*
+	Returns true if the file loaded and validated, else false.
+	*/
+	bool IsLoaded() const { return mQcvmData != NULL; }
+	int32_t GetCRC() const { if (!IsLoaded()) return 0; return mHeader->crc; }
+	const string &GetFilename() const { return mFilename; }
+	/*
+	Returns true if the indexes and code came from the sidecar cache.
+	*/
+	bool IsFromCache() const { return mFromCache; }
+
+	static const int  GLOBALDEF_TYPE_MASK = 0x07;
+
+	static const char GLOBAL_DEF_SYSTEM  = 1 << 0;
+	static const char GLOBAL_DEF_FIELD   = 1 << 1;
+	static const char GLOBAL_DEF_LOCAL   = 1 << 2;
+	static const char GLOBAL_DEF_SPECIAL = 1 << 3;
+
+	// functions reaching no more statements than this, and calling nothing,
+	// are inlined into their callers' code
+	static const int  INLINE_MAX_STATEMENTS = 8;
+
+private:
+	~ProgsImage();
+	ProgsImage(const ProgsImage &);
+	ProgsImage &operator=(const ProgsImage &);
+
+	void Init();
+	void Load();
+	bool MapFile();
+	bool ReadFile();
+	void Setup();
+	bool Validate();
+	bool HasDefinition(const QcvmDefinition *defs, int32_t count, const char *name,
+		QcvmDefinitionType type) const;
+	void BuildIndexes();
+	void Unload();
+
+	// code, see code.h
+	void Decode();
+	void Decode(Code &code, const vector<char> &constants) const;
+	void FindConstants(vector<char> &constants) const;
+	void FindAddresses(const Code &code, vector<int32_t> &addressRooms) const;
+	bool FieldInBounds(int32_t fieldOffset, int32_t width) const;
+	void Specialize(const Code &code, const vector<int32_t> &addressRooms,
+		CodeInstruction &instruction) const;
+	bool CanInline(int32_t functionNum, vector<char> &reached, vector<int32_t> &order) const;
+	void DecodeStatements(Code &code, const vector<int32_t> &addressRooms, int32_t functionNum,
+		const vector<int32_t> &order, const vector<int32_t> &inlineLocals, vector<char> &reached,
+		int32_t callStatement, int32_t inlineStart, vector<int32_t> &returns) const;
+	void DecodeInline(Code &code, const vector<int32_t> &addressRooms, int32_t functionNum,
+		int32_t callStatement, int32_t callee, const vector<int32_t> &inlineLocals, vector<char> &reached) const;
+
+	// sidecar cache
+	static uint64_t HashData(const char *data, int32_t size);
+	bool LoadCache();
+	void SaveCache();
+
+	string           mCacheFilename;
+	// HashData of the whole progs, once loaded
+	uint64_t         mContentHash;
+	bool             mFromCache;
+
+	std::atomic<int> mRefCount;
+
+	string           mFilename;
+
+	// where mQcvmData came from, and so how to free it
+	enum DataSource {
+		DATA_NONE,
+		DATA_ALLOCATED,
+		DATA_MAPPED,
+		DATA_EXTERNAL
+	};
+	DataSource       mDataSource;
+
+	int32_t          mQcvmSize;
+	char            *mQcvmData;
+
+	QcvmHeader      *mHeader;
+	QcvmStatement   *mStatements;
+	QcvmDefinition  *mGlobalDefs;
+	QcvmDefinition  *mFieldDefs;
+	QcvmFunction    *mFunctions;
+	char            *mStringData;
+	// the string lump of a mapped file, copied since it is served to callers
+	char            *mStringCopy;
+	// initial values, copied into each instance's own global data
+	float           *mGlobalData;
+
+	char            *mGlobalDefData;
+
+	QcvmDefinitionType *mFieldOffsetTypes;
+
+	Code             mCode;
+};
+
+//-----------------------------------------------------------------------------
+} // namespace
+//-----------------------------------------------------------------------------
+
+//-----------------------------------------------------------------------------
+#endif
+//-----------------------------------------------------------------------------
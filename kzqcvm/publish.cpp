@@ -0,0 +1,294 @@
+/*
+Kzqcvm QuakeC VM Interpreter
+Copyright (c) 2010 David Laurie
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+/*
+kzqcvm/publish.cpp
+*/
+
+#include "publish.h"
+
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+#include <atomic>
+
+//-----------------------------------------------------------------------------
+namespace kzqcvm {
+	using std::vector;
+	using std::atomic;
+	using std::atomic_thread_fence;
+	using std::memory_order_relaxed;
+	using std::memory_order_acquire;
+	using std::memory_order_release;
+//-----------------------------------------------------------------------------
+
+// A copy's pages. Tables only grow, by being replaced, and both they and
+// the pages in them are kept until the publisher goes, so a reader however
+// far behind never follows a pointer to freed memory.
+struct PublishedPageTable {
+	int32_t          capacity;
+	atomic<float*>  *pages;
+};
+
+struct PublishedState::Buffer {
+	// odd while being written
+	atomic<uint32_t>            sequence;
+	// the checkpoint this copy was last brought up to
+	uint32_t                    checkpoint;
+	vector<float>               globals;
+	atomic<int32_t>             pageCount;
+	atomic<PublishedPageTable*> pages;
+	vector<PublishedPageTable*> retired;
+};
+
+//-----------------------------------------------------------------------------
+// Structors
+//-----------------------------------------------------------------------------
+
+StatePublisher::StatePublisher(Kzqcvm &qcvm) : mVM(qcvm)
+{
+	EntityManager &entities = mVM.mEntityManager;
+	mGlobalCount     = mVM.mHeader->globaldata_num;
+	mEntitySize      = entities.mEntitySize;
+	mEntitiesPerPage = entities.mEntitiesPerPage;
+	mPageShift       = entities.mPageShift;
+	mOnPageMask      = entities.mOnPageMask;
+	mSlotBits        = entities.mSlotBits;
+	mSlotMask        = entities.mSlotMask;
+	mPageFloats      = entities.mPageSize;
+	for (int i=0; i<2; ++i)
+	{
+		PublishedState::Buffer *buffer = new PublishedState::Buffer;
+		buffer->sequence   = 0;
+		buffer->checkpoint = 0;
+		buffer->globals.assign(mGlobalCount, 0.0f);
+		buffer->pageCount  = 0;
+		buffer->pages      = NULL;
+		mBuffers[i] = buffer;
+	}
+	mVersion = 0;
+	mPagesCopied = 0;
+}
+
+StatePublisher::~StatePublisher()
+{
+	for (int i=0; i<2; ++i)
+	{
+		PublishedState::Buffer *buffer = mBuffers[i];
+		PublishedPageTable *table = buffer->pages;
+		if (table)
+		{
+			for (int32_t p=0; p<table->capacity; ++p)
+			{
+				delete [] table->pages[p].load();
+			}
+			buffer->retired.push_back(table);
+		}
+		for (size_t t=0; t<buffer->retired.size(); ++t)
+		{
+			delete [] buffer->retired[t]->pages;
+			delete buffer->retired[t];
+		}
+		delete buffer;
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Publish
+//-----------------------------------------------------------------------------
+
+bool StatePublisher::Publish()
+{
+	EntityManager &entities = mVM.mEntityManager;
+	if (entities.mEntitiesPerPage != mEntitiesPerPage || entities.mSlotBits != mSlotBits)
+		return false;
+
+	// the copy readers were sent to before the last publish
+	uint32_t version = mVersion.load(memory_order_relaxed);
+	PublishedState::Buffer *buffer = mBuffers[(version + 1) & 1];
+	uint32_t sequence = buffer->sequence.load(memory_order_relaxed);
+	buffer->sequence.store(sequence + 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+
+	memcpy(&buffer->globals[0], mVM.mGlobalData, mGlobalCount * sizeof(float));
+
+	int32_t pageCount = (int32_t)entities.mEntityPages.size();
+	mPagesCopied = 0;
+	PublishedPageTable *table = buffer->pages.load(memory_order_relaxed);
+	if (!table || table->capacity < pageCount)
+	{
+		PublishedPageTable *grown = new PublishedPageTable;
+		grown->capacity = table && table->capacity * 2 > pageCount ? table->capacity * 2 : pageCount;
+		grown->pages    = new atomic<float*>[grown->capacity];
+		for (int32_t p=0; p<grown->capacity; ++p)
+		{
+			grown->pages[p].store(table && p < table->capacity ? table->pages[p].load(memory_order_relaxed) : NULL,
+				memory_order_relaxed);
+		}
+		if (table)
+			buffer->retired.push_back(table);
+		table = grown;
+		buffer->pages.store(table, memory_order_release);
+	}
+	for (int32_t p=0; p<pageCount; ++p)
+	{
+		float *page = table->pages[p].load(memory_order_relaxed);
+		if (!page)
+		{
+			page = new float[mPageFloats];
+			memcpy(page, entities.mEntityPages[p], mPageFloats * sizeof(float));
+			table->pages[p].store(page, memory_order_release);
+			++mPagesCopied;
+		}
+		else if (entities.mPageStamps[p] > buffer->checkpoint)
+		{
+			memcpy(page, entities.mEntityPages[p], mPageFloats * sizeof(float));
+			++mPagesCopied;
+		}
+	}
+	buffer->pageCount.store(pageCount, memory_order_relaxed);
+	// the QCVM's, so its entity and string checkpoints stay in step; any
+	// the host holds stay good, as later writes are still stamped higher
+	buffer->checkpoint = mVM.Checkpoint();
+
+	buffer->sequence.store(sequence + 2, memory_order_release);
+	mVersion.store(version + 1, memory_order_release);
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// Read
+//-----------------------------------------------------------------------------
+
+uint32_t StatePublisher::BeginRead(const PublishedState::Buffer *buffer)
+{
+	return buffer->sequence.load(memory_order_acquire);
+}
+
+bool StatePublisher::EndRead(const PublishedState::Buffer *buffer, uint32_t sequence)
+{
+	atomic_thread_fence(memory_order_acquire);
+	return buffer->sequence.load(memory_order_relaxed) == sequence;
+}
+
+PublishedState::PublishedState(const StatePublisher *publisher, const Buffer *buffer, uint32_t version)
+	: mPublisher(publisher), mBuffer(buffer), mVersion(version)
+{
+	mCRC        = publisher->mVM.GetCRC();
+	mLayoutHash = publisher->mVM.GetEntityLayoutHash();
+}
+
+const float *PublishedState::GetGlobal(const float *pointer, int width) const
+{
+	int64_t offset = pointer - mPublisher->mVM.mGlobalData;
+	if (offset < 0 || offset + width > mPublisher->mGlobalCount)
+		return NULL;
+	return &mBuffer->globals[(size_t)offset];
+}
+
+// the entity's fields in our copy, if it was in use there
+const float *PublishedState::GetEntityFields(Entity &entity) const
+{
+	const StatePublisher &publisher = *mPublisher;
+	if (entity.qcvm != &publisher.mVM || entity.entNum < 0)
+		return NULL;
+	int32_t slot = entity.entNum & publisher.mSlotMask;
+	int32_t pageNumber = slot >> publisher.mPageShift;
+	const PublishedPageTable *table = mBuffer->pages.load(memory_order_acquire);
+	if (!table || pageNumber >= mBuffer->pageCount.load(memory_order_relaxed) || pageNumber >= table->capacity)
+		return NULL;
+	const float *page = table->pages[pageNumber].load(memory_order_acquire);
+	if (!page)
+		return NULL;
+	const float *data = &page[(slot & publisher.mOnPageMask) * publisher.mEntitySize];
+	int64_t generation = (uint32_t)entity.entNum >> publisher.mSlotBits;
+	if (*(const int64_t*)data != EntityManager::ENTITY_INUSE_VALUE - generation)
+		return NULL;
+	return data + EntityManager::HEADER_SIZE;
+}
+
+const float *PublishedState::GetField(Entity &entity, Field &field, int width) const
+{
+	if (field.offset < 0 || field.offset + width > mPublisher->mEntitySize - EntityManager::HEADER_SIZE)
+		return NULL;
+	const float *fields = GetEntityFields(entity);
+	if (!fields)
+		return NULL;
+	return fields + field.offset;
+}
+
+bool PublishedState::GetFloat(FloatPointer &global, float &f) const
+{
+	if (global.qcvm != &mPublisher->mVM)
+		return false;
+	const float *value = GetGlobal(global.value, 1);
+	if (!value)
+		return false;
+	f = *value;
+	return true;
+}
+
+bool PublishedState::GetVector(VectorPointer &global, float *v) const
+{
+	if (global.qcvm != &mPublisher->mVM)
+		return false;
+	const float *value = GetGlobal(global.value, 3);
+	if (!value)
+		return false;
+	v[0] = value[0];
+	v[1] = value[1];
+	v[2] = value[2];
+	return true;
+}
+
+bool PublishedState::GetFloat(Entity &entity, Field &field, float &f) const
+{
+	const float *value = GetField(entity, field, 1);
+	if (!value)
+		return false;
+	f = *value;
+	return true;
+}
+
+bool PublishedState::GetVector(Entity &entity, Field &field, float *v) const
+{
+	const float *value = GetField(entity, field, 3);
+	if (!value)
+		return false;
+	v[0] = value[0];
+	v[1] = value[1];
+	v[2] = value[2];
+	return true;
+}
+
+bool PublishedState::GetInt(Entity &entity, Field &field, int32_t &i) const
+{
+	const float *value = GetField(entity, field, 1);
+	if (!value)
+		return false;
+	i = *(const int32_t*)value;
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+} // namespace
+//-----------------------------------------------------------------------------
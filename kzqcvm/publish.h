@@ -0,0 +1,183 @@
+/*
+Kzqcvm QuakeC VM Interpreter
+Copyright (c) 2010 David Laurie
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+/*
+kzqcvm/publish.h
+*/
+
+//-----------------------------------------------------------------------------
+#ifndef KZQCVM_PUBLISH_H
+#define KZQCVM_PUBLISH_H
+//-----------------------------------------------------------------------------
+
+#include <stdint.h>
+#include <vector>
+#include <atomic>
+
+#include "kzqcvm.h"
+#include "data.h"
+
+//-----------------------------------------------------------------------------
+namespace kzqcvm {
+	using std::vector;
+//-----------------------------------------------------------------------------
+
+class StatePublisher;
+
+/*
+A view of one published state, handed to the function given to
+StatePublisher::Read. The getters return false, or NULL, for an entity
+which wasn't in use when the state was published, or a global or field
+from a different progs. Strings and entities come as their numbers only.
+*/
+class PublishedState {
+	friend class StatePublisher;
+public:
+	// the number of Publish calls before this state; 0 is all zeros
+	uint32_t GetVersion() const { return mVersion; }
+
+	bool GetFloat (FloatPointer &global, float &f) const;
+	bool GetVector(VectorPointer &global, float *v) const;
+
+	bool GetFloat (Entity &entity, Field &field, float &f) const;
+	bool GetVector(Entity &entity, Field &field, float *v) const;
+	bool GetInt   (Entity &entity, Field &field, int32_t &i) const;
+
+	// as Kzqcvm::EntityData
+	template <class T> const T *EntityData(Entity &entity) const
+	{
+		if (T::PROGS_CRC != mCRC || T::LAYOUT_HASH != mLayoutHash)
+			return NULL;
+		return (const T*)GetEntityFields(entity);
+	}
+
+private:
+	struct Buffer;
+	PublishedState(const StatePublisher *publisher, const Buffer *buffer, uint32_t version);
+
+	const float *GetGlobal(const float *pointer, int width) const;
+	const float *GetEntityFields(Entity &entity) const;
+	const float *GetField(Entity &entity, Field &field, int width) const;
+
+	const StatePublisher *mPublisher;
+	const Buffer         *mBuffer;
+	uint32_t              mVersion;
+	int32_t               mCRC;
+	uint64_t              mLayoutHash;
+};
+
+/*
+A StatePublisher keeps a copy of a QCVM's globals and entities for other
+threads to read while the QCVM goes on running, such as a renderer, a
+network sender or a replay recorder. The simulation thread calls
+Publish() between frames; readers call Read() whenever they like, and
+neither ever waits for the other.
+
+There are two copies. Publish writes whichever readers aren't being sent
+to, copying the globals and only those entity pages written since that
+copy was last brought up to date, then sends new readers to it. Each
+copy carries a sequence count, odd while it is being written, which Read
+checks before and after calling its reader; if the copy was written in
+between, which takes a reader slower than a whole frame, it calls the
+reader again on the newer one. So the reader must do nothing but copy out
+what it wants, as it may see a half written state the first time round.
+It always sees memory that exists, however slow it is.
+
+Each Publish takes a checkpoint of the QCVM, as Kzqcvm::Checkpoint does,
+to know which pages the next one into the same copy must bring up to
+date. Checkpoints the host holds are unaffected. As with deltas, writes
+through a pointer kept from an earlier GetFloatPointer or EntityData
+aren't noticed. The layout of the entities is fixed when the publisher is
+made: changing the page size or generations of the QCVM afterwards makes
+Publish fail.
+*/
+class StatePublisher {
+	friend class PublishedState;
+public:
+	/*
+	Publishes from qcvm, which must be loaded and outlive the publisher.
+	*/
+	StatePublisher(Kzqcvm &qcvm);
+	~StatePublisher();
+
+	/*
+	On the QCVM's thread, while no QC is running. Returns false, publishing
+	nothing, if the entity layout changed.
+	*/
+	bool Publish();
+
+	/*
+	From any thread: calls reader with a PublishedState until it has seen
+	one whole, and returns that state's version.
+	*/
+	template <class F> uint32_t Read(F reader) const
+	{
+		for (;;)
+		{
+			uint32_t version = mVersion.load(std::memory_order_acquire);
+			const PublishedState::Buffer *buffer = mBuffers[version & 1];
+			uint32_t sequence = BeginRead(buffer);
+			if (sequence & 1)
+				continue;
+			PublishedState state(this, buffer, version);
+			reader(state);
+			if (EndRead(buffer, sequence))
+				return version;
+		}
+	}
+
+	uint32_t GetVersion() const { return mVersion.load(std::memory_order_acquire); }
+	/*
+	On the QCVM's thread: the number of entity pages the last Publish copied.
+	*/
+	int32_t GetPagesCopied() const { return mPagesCopied; }
+
+private:
+	StatePublisher(const StatePublisher &);
+	StatePublisher &operator=(const StatePublisher &);
+
+	static uint32_t BeginRead(const PublishedState::Buffer *buffer);
+	static bool     EndRead(const PublishedState::Buffer *buffer, uint32_t sequence);
+
+	Kzqcvm   &mVM;
+	int32_t   mGlobalCount;
+	// the entity layout at construction
+	int32_t   mEntitySize;
+	int32_t   mEntitiesPerPage;
+	int       mPageShift;
+	int32_t   mOnPageMask;
+	int       mSlotBits;
+	int32_t   mSlotMask;
+	int32_t   mPageFloats;
+
+	PublishedState::Buffer *mBuffers[2];
+	std::atomic<uint32_t>   mVersion;
+	int32_t                 mPagesCopied;
+};
+
+//-----------------------------------------------------------------------------
+} // namespace
+//-----------------------------------------------------------------------------
+
+//-----------------------------------------------------------------------------
+#endif
+//-----------------------------------------------------------------------------
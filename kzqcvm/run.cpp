@@ -26,6 +26,7 @@ kzqcvm/run.cpp
 
 #include "kzqcvm.h"
 #include "instructions.h"
+#include "code.h"
 
 #include <string.h>
 
@@ -41,11 +42,20 @@ namespace kzqcvm {
 // Run Function
 //-----------------------------------------------------------------------------
 
+static inline float BitsFloat(int32_t bits)
+{
+	float value;
+	memcpy(&value, &bits, sizeof(value));
+	return value;
+}
+
 //#define FUNCTION_DEBUG
 
-#define PARM_A (currentStatement->parameter[0])
-#define PARM_B (currentStatement->parameter[1])
-#define PARM_C (currentStatement->parameter[2])
+#define PARM_A (currentInstruction->a)
+#define PARM_B (currentInstruction->b)
+#define PARM_C (currentInstruction->c)
+// the operand itself, as a float
+#define IMM_B (BitsFloat(PARM_B))
 #define COPY_VEC(a,b) (b)[0] = (a)[0]; (b)[1] = (a)[1]; (b)[2] = (a)[2];
 
 #define GET_STRING(a) (mStringManager.GetString(a))
@@ -60,7 +70,7 @@ bool Kzqcvm::RunFunction(int functionNum, int *instructionCount)
 		mErrorLog << "Invalid function index " << functionNum << endl;
 		return false;
 	}
-	QcvmFunction *function = &mFunctions[functionNum];
+	const QcvmFunction *function = &mFunctions[functionNum];
 #ifdef FUNCTION_DEBUG
 	cout << "Entering function " << &mStringData[function->nameOffset] << endl;
 #endif
@@ -76,13 +86,39 @@ bool Kzqcvm::RunFunction(int functionNum, int *instructionCount)
 		return result;
 	}
 
+	if (mNativeFunctions && mNativeFunctions[functionNum])
+	{
+		return mNativeFunctions[functionNum](&mNativeContext, instructionCount);
+	}
+
 	// backup the existing local values in global data
-	float stackData[function->numLocals];
+	float stackData[function->numLocals > 0 ? function->numLocals : 1];
 	for (int i=0; i<function->numLocals; ++i)
 	{
 		stackData[i] = mGlobalData[function->offsetLocalsInGlobals+i];
 	}
 
+	bool result = RunCode(functionNum, instructionCount);
+
+	// Then copy the stuff from our stack back into globals
+	for (int i=0; i<function->numLocals; ++i)
+	{
+		mGlobalData[function->offsetLocalsInGlobals+i] = stackData[i];
+	}
+
+#ifdef FUNCTION_DEBUG
+	cout << "Leaving function " << &mStringData[function->nameOffset] << endl;
+#endif
+
+	return result;
+}
+
+// Runs a QuakeC function's code, over whatever its locals held before.
+// RunFunction saves and restores those around it.
+bool Kzqcvm::RunCode(int functionNum, int *instructionCount)
+{
+	const QcvmFunction *function = &mFunctions[functionNum];
+
 	// copy the parameters over the local values in global data
 	for (int i=0, ofs=0; i<function->numParameters; ++i)
 	{
@@ -95,8 +131,14 @@ bool Kzqcvm::RunFunction(int functionNum, int *instructionCount)
 	// some useful stuff
 	int32_t *intGlobalData = (int32_t*)mGlobalData;
 
+	// the code this call runs to the end. A builtin may have us decode new
+	// code, numbered differently, but our jumps are into this; it is kept
+	// till we unload, see ReleaseConstants.
+	const Code *runningCode = mCurrentCode;
+	const CodeInstruction *code = &runningCode->instructions[0];
+
 	// iterate instructions till we get a return (or a crash)
-	QcvmStatement *currentStatement = &mStatements[function->offsetFirstStatement];
+	const CodeInstruction *currentInstruction = &code[runningCode->functionStarts[functionNum]];
 
 	int stopcode;
 	const int STOP_SUCCESS               =  1;
@@ -104,7 +146,7 @@ bool Kzqcvm::RunFunction(int functionNum, int *instructionCount)
 	const int STOP_ERROR_ENTITY_READ     = -2;
 	const int STOP_ERROR_ENTITY_WRITE    = -3;
 	const int STOP_ERROR_RUNAWAY_LOOP    = -4;
-	for (stopcode=0; stopcode==0; ++(*instructionCount), ++currentStatement)
+	for (stopcode=0; stopcode==0; ++(*instructionCount), ++currentInstruction)
 	{
 		// TODO: customize runaway loop length
 		// stop after 2097151 instructions
@@ -115,7 +157,7 @@ bool Kzqcvm::RunFunction(int functionNum, int *instructionCount)
 			goto end_of_instructions;
 		}
 
-		switch (currentStatement->instruction)
+		switch (currentInstruction->opcode)
 		{
 		//---------------------------------------------------------------------
 		// return
@@ -280,11 +322,12 @@ bool Kzqcvm::RunFunction(int functionNum, int *instructionCount)
 			break;
 		//---------------------------------------------------------------------
 		// if, ifnot (jump)
+		// the loop's increment takes the last step onto the target
 		case Instructions::IF:
-			if (mGlobalData[PARM_A]) currentStatement += PARM_B;
+			if (mGlobalData[PARM_A]) currentInstruction = &code[PARM_B - 1];
 			continue;
 		case Instructions::IFNOT:
-			if (!mGlobalData[PARM_A]) currentStatement += PARM_B;
+			if (!mGlobalData[PARM_A]) currentInstruction = &code[PARM_B - 1];
 			continue;
 		//---------------------------------------------------------------------
 		// function calls
@@ -297,22 +340,92 @@ bool Kzqcvm::RunFunction(int functionNum, int *instructionCount)
 		case Instructions::CALL6:
 		case Instructions::CALL7:
 		case Instructions::CALL8:
-			mNumCallParameters = (int)currentStatement->instruction - (int)Instructions::CALL0;
+			mNumCallParameters = (int)currentInstruction->opcode - (int)Instructions::CALL0;
 			if (!RunFunction(intGlobalData[PARM_A], instructionCount))
 				stopcode = STOP_ERROR_HANDLED_ALREADY;
 			break;
 		//---------------------------------------------------------------------
 		// state
 		case Instructions::STATE:
-			StartError(ERR_NOT_IMPLEMENTED, "Progs Instruction STATE not implemented");
-			stopcode = STOP_ERROR_HANDLED_ALREADY;
+			switch (RunState(mGlobalData[PARM_A], intGlobalData[PARM_B]))
+			{
+			case ERR_NONE:
+				break;
+			case ERR_INVALID_WRITE:
+				stopcode = STOP_ERROR_ENTITY_WRITE;
+				break;
+			default:
+				StartError(ERR_FIELD_NOT_FOUND, "Progs Instruction STATE needs frame and think fields");
+				stopcode = STOP_ERROR_HANDLED_ALREADY;
+				break;
+			}
 			break;
 		//---------------------------------------------------------------------
 		// goto (jump)
 		case Instructions::GOTO:
-			currentStatement += PARM_A;
+			currentInstruction = &code[PARM_A - 1];
+			continue;
+		//---------------------------------------------------------------------
+		// inlined call, unless the function global has changed
+		case CodeInstructions::INLINE:
+			if (intGlobalData[PARM_A] != PARM_B) currentInstruction = &code[PARM_C - 1];
 			continue;
 		//---------------------------------------------------------------------
+		// with a constant operand, see code.h
+		case CodeInstructions::EQ_F_IMM:
+			mGlobalData[PARM_C] = (mGlobalData[PARM_A] == IMM_B);
+			break;
+		case CodeInstructions::NE_F_IMM:
+			mGlobalData[PARM_C] = (mGlobalData[PARM_A] != IMM_B);
+			break;
+		case CodeInstructions::LE_IMM:
+			mGlobalData[PARM_C] = (mGlobalData[PARM_A] <= IMM_B);
+			break;
+		case CodeInstructions::GE_IMM:
+			mGlobalData[PARM_C] = (mGlobalData[PARM_A] >= IMM_B);
+			break;
+		case CodeInstructions::LT_IMM:
+			mGlobalData[PARM_C] = (mGlobalData[PARM_A] < IMM_B);
+			break;
+		case CodeInstructions::GT_IMM:
+			mGlobalData[PARM_C] = (mGlobalData[PARM_A] > IMM_B);
+			break;
+		case CodeInstructions::ADD_F_IMM:
+			mGlobalData[PARM_C] = mGlobalData[PARM_A] + IMM_B;
+			break;
+		case CodeInstructions::MUL_F_IMM:
+			mGlobalData[PARM_C] = mGlobalData[PARM_A] * IMM_B;
+			break;
+		case CodeInstructions::DIV_F_IMM:
+			mGlobalData[PARM_C] = mGlobalData[PARM_A] / IMM_B;
+			break;
+		case CodeInstructions::LOAD_F_IMM:
+			if (!mEntityManager.ReadFloatInBounds(intGlobalData[PARM_A], PARM_B, &mGlobalData[PARM_C]))
+				stopcode = STOP_ERROR_ENTITY_READ;
+			break;
+		case CodeInstructions::LOAD_V_IMM:
+			if (!mEntityManager.ReadVectorInBounds(intGlobalData[PARM_A], PARM_B, &mGlobalData[PARM_C]))
+				stopcode = STOP_ERROR_ENTITY_READ;
+			break;
+		case CodeInstructions::LOAD_I_IMM:
+			if (!mEntityManager.ReadIntInBounds(intGlobalData[PARM_A], PARM_B, &intGlobalData[PARM_C]))
+				stopcode = STOP_ERROR_ENTITY_READ;
+			break;
+		case CodeInstructions::ADDRESS_IMM:
+			intGlobalData[PARM_C] = mEntityManager.GetAddressInBounds(intGlobalData[PARM_A], PARM_B);
+			break;
+		case CodeInstructions::STORE_IMM:
+			intGlobalData[PARM_B] = PARM_A;
+			break;
+		case CodeInstructions::STOREP_V_INBOUNDS:
+			if (!mEntityManager.WriteVectorInBounds(intGlobalData[PARM_B], &mGlobalData[PARM_A]))
+				stopcode = STOP_ERROR_ENTITY_WRITE;
+			break;
+		case CodeInstructions::STOREP_I_INBOUNDS:
+			if (!mEntityManager.WriteIntInBounds(intGlobalData[PARM_B], intGlobalData[PARM_A]))
+				stopcode = STOP_ERROR_ENTITY_WRITE;
+			break;
+		//---------------------------------------------------------------------
 		// logical and/or
 		case Instructions::AND:
 			mGlobalData[PARM_C] = mGlobalData[PARM_A] && mGlobalData[PARM_B];
@@ -354,19 +467,9 @@ bool Kzqcvm::RunFunction(int functionNum, int *instructionCount)
 
 	if (stopcode < 0)
 	{
-		TraceFunction(function, --currentStatement);
-	}
-
-	// Then copy the stuff from our stack back into globals
-	for (int i=0; i<function->numLocals; ++i)
-	{
-		mGlobalData[function->offsetLocalsInGlobals+i] = stackData[i];
+		TraceCode(function, runningCode, --currentInstruction);
 	}
 
-#ifdef FUNCTION_DEBUG
-	cout << "Leaving function " << &mStringData[function->nameOffset] << endl;
-#endif
-
 	if (stopcode < 0)
 		return false;
 	return true;
@@ -0,0 +1,333 @@
+/*
+Kzqcvm QuakeC VM Interpreter
+Copyright (c) 2010 David Laurie
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+/*
+kzqcvm/runner.cpp
+*/
+
+#include "runner.h"
+#include "data.h"
+
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+#include <algorithm>
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+//-----------------------------------------------------------------------------
+namespace kzqcvm {
+	using std::vector;
+	using std::mutex;
+	using std::unique_lock;
+	using std::lock_guard;
+	using std::thread;
+	using std::chrono::duration_cast;
+	using std::chrono::microseconds;
+//-----------------------------------------------------------------------------
+
+//-----------------------------------------------------------------------------
+// Structors
+//-----------------------------------------------------------------------------
+
+WorldRunner::WorldRunner(int threads)
+{
+	if (threads < 1)
+		threads = (int)thread::hardware_concurrency();
+	if (threads < 1)
+		threads = 1;
+	mThreadCount = threads;
+	mPinned      = false;
+	mRunning     = false;
+	mStopping    = false;
+	for (int i=0; i<mThreadCount; ++i)
+	{
+		mQueues.push_back(new Queue);
+	}
+}
+
+WorldRunner::~WorldRunner()
+{
+	Stop();
+	for (size_t i=0; i<mWorlds.size(); ++i)
+	{
+		delete mWorlds[i]->vm;
+		delete mWorlds[i];
+	}
+	for (size_t i=0; i<mQueues.size(); ++i)
+	{
+		delete mQueues[i];
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Setup
+//-----------------------------------------------------------------------------
+
+int WorldRunner::AddWorld(Kzqcvm *world, float frameTime, FrameFunction frame)
+{
+	if (mRunning || !world || !world->IsLoaded() || !(frameTime > 0.0f))
+		return -1;
+	World *w = new World;
+	w->vm           = world;
+	w->frame        = frame;
+	w->frameSeconds = frameTime;
+	w->frameTime    = std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(frameTime));
+	if (w->frameTime <= Clock::duration::zero())
+		w->frameTime = Clock::duration(1);
+	// spread them round the threads
+	w->home         = (int)(mWorlds.size() % mThreadCount);
+	w->frameNumber  = 0;
+	memset(&w->stats, 0, sizeof(w->stats));
+	mWorlds.push_back(w);
+	return (int)mWorlds.size() - 1;
+}
+
+Kzqcvm *WorldRunner::GetWorld(int world)
+{
+	if (world < 0 || world >= (int)mWorlds.size())
+		return NULL;
+	return mWorlds[world]->vm;
+}
+
+bool WorldRunner::SetPinned(bool pinned)
+{
+	if (mRunning)
+		return false;
+#ifdef __linux__
+	mPinned = pinned;
+	return true;
+#else
+	mPinned = false;
+	return !pinned;
+#endif
+}
+
+bool WorldRunner::GetStats(int world, WorldStats &stats)
+{
+	if (world < 0 || world >= (int)mWorlds.size())
+		return false;
+	lock_guard<mutex> lock(mWorlds[world]->statsMutex);
+	stats = mWorlds[world]->stats;
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// Start/Stop
+//-----------------------------------------------------------------------------
+
+bool WorldRunner::Start()
+{
+	if (mRunning)
+		return false;
+	Clock::time_point now = Clock::now();
+	for (size_t i=0; i<mQueues.size(); ++i)
+	{
+		mQueues[i]->waiting.clear();
+		mQueues[i]->ready.clear();
+	}
+	for (size_t i=0; i<mWorlds.size(); ++i)
+	{
+		// carry on from the frame we stopped at
+		World *w = mWorlds[i];
+		w->origin = now - w->frameTime * w->frameNumber;
+		Requeue(w);
+	}
+	mStopping = false;
+	mRunning  = true;
+	for (int i=0; i<mThreadCount; ++i)
+	{
+		mThreads.push_back(thread(&WorldRunner::ThreadMain, this, i));
+	}
+	return true;
+}
+
+void WorldRunner::Stop()
+{
+	if (!mRunning)
+		return;
+	mStopping = true;
+	for (size_t i=0; i<mQueues.size(); ++i)
+	{
+		lock_guard<mutex> lock(mQueues[i]->mutex);
+		mQueues[i]->wake.notify_all();
+	}
+	for (size_t i=0; i<mThreads.size(); ++i)
+	{
+		mThreads[i].join();
+	}
+	mThreads.clear();
+	mRunning = false;
+}
+
+//-----------------------------------------------------------------------------
+// Threads
+//-----------------------------------------------------------------------------
+
+// heap orders, so the front is the soonest
+struct DueAfter {
+	template <class W> bool operator()(const W *a, const W *b) const { return a->due > b->due; }
+};
+struct DeadlineAfter {
+	template <class W> bool operator()(const W *a, const W *b) const { return a->deadline > b->deadline; }
+};
+
+void WorldRunner::PinThread(int index)
+{
+#ifdef __linux__
+	int cores = (int)thread::hardware_concurrency();
+	if (cores < 1)
+		return;
+	cpu_set_t cpus;
+	CPU_ZERO(&cpus);
+	CPU_SET(index % cores, &cpus);
+	pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+#else
+	(void)index;
+#endif
+}
+
+void WorldRunner::ThreadMain(int index)
+{
+	if (mPinned)
+		PinThread(index);
+	Queue &own = *mQueues[index];
+	while (!mStopping)
+	{
+		World *world = Take(index);
+		if (world)
+		{
+			RunFrame(world);
+			Requeue(world);
+			continue;
+		}
+		// sleep until our next world is due, looking round for work to
+		// steal now and then
+		unique_lock<mutex> lock(own.mutex);
+		Clock::time_point until = Clock::now() + microseconds((int64_t)STEAL_INTERVAL_MICROSECONDS);
+		if (!own.waiting.empty() && own.waiting.front()->due < until)
+			until = own.waiting.front()->due;
+		if (!mStopping)
+			own.wake.wait_until(lock, until);
+	}
+}
+
+// moves the worlds now due on to the ready heap; the queue must be locked
+void WorldRunner::MakeReady(Queue &queue, Clock::time_point now)
+{
+	while (!queue.waiting.empty() && queue.waiting.front()->due <= now)
+	{
+		std::pop_heap(queue.waiting.begin(), queue.waiting.end(), DueAfter());
+		queue.ready.push_back(queue.waiting.back());
+		queue.waiting.pop_back();
+		std::push_heap(queue.ready.begin(), queue.ready.end(), DeadlineAfter());
+	}
+}
+
+// the due world with the earliest deadline from our own queue, or failing
+// that from the first other with one
+WorldRunner::World *WorldRunner::Take(int index)
+{
+	Clock::time_point now = Clock::now();
+	for (int i=0; i<mThreadCount; ++i)
+	{
+		Queue &queue = *mQueues[(index + i) % mThreadCount];
+		lock_guard<mutex> lock(queue.mutex);
+		MakeReady(queue, now);
+		if (queue.ready.empty())
+			continue;
+		std::pop_heap(queue.ready.begin(), queue.ready.end(), DeadlineAfter());
+		World *world = queue.ready.back();
+		queue.ready.pop_back();
+		return world;
+	}
+	return NULL;
+}
+
+void WorldRunner::RunFrame(World *world)
+{
+	Clock::time_point start = Clock::now();
+	// every frame due by now, folded into one if there's more than one
+	int64_t frames = (start - world->origin) / world->frameTime - world->frameNumber + 1;
+	if (frames < 1)
+		frames = 1;
+	float time = (float)((double)world->frameSeconds * world->frameNumber);
+	float span = (float)((double)world->frameSeconds * frames);
+
+	bool ok;
+	if (world->frame)
+	{
+		ok = world->frame(world->vm, time, span);
+	}
+	else
+	{
+		vector<Entity> failed;
+		world->vm->RunThinks(time, time + span, failed);
+		ok = failed.empty();
+	}
+
+	Clock::time_point end = Clock::now();
+	Clock::time_point due = world->due;
+	world->frameNumber += frames;
+	int64_t latency = duration_cast<microseconds>(end - start).count();
+	int64_t wait    = duration_cast<microseconds>(start - due).count();
+	if (wait < 0)
+		wait = 0;
+	int bucket = 0;
+	while (bucket < WorldStats::LATENCY_BUCKETS-1 && latency >= ((int64_t)1 << bucket))
+		++bucket;
+
+	lock_guard<mutex> lock(world->statsMutex);
+	WorldStats &stats = world->stats;
+	++stats.frames;
+	if (!ok)
+		++stats.failedFrames;
+	if (end > world->origin + world->frameTime * world->frameNumber)
+		++stats.lateFrames;
+	stats.mergedFrames += frames - 1;
+	stats.lastLatency   = latency;
+	stats.totalLatency += latency;
+	if (latency > stats.maxLatency)
+		stats.maxLatency = latency;
+	stats.totalWait += wait;
+	if (wait > stats.maxWait)
+		stats.maxWait = wait;
+	++stats.latencyBuckets[bucket];
+}
+
+// back to its own thread, to wait for its next frame
+void WorldRunner::Requeue(World *world)
+{
+	world->due      = world->origin + world->frameTime * world->frameNumber;
+	world->deadline = world->due + world->frameTime;
+	Queue &queue = *mQueues[world->home];
+	lock_guard<mutex> lock(queue.mutex);
+	queue.waiting.push_back(world);
+	std::push_heap(queue.waiting.begin(), queue.waiting.end(), DueAfter());
+	queue.wake.notify_one();
+}
+
+//-----------------------------------------------------------------------------
+} // namespace
+//-----------------------------------------------------------------------------
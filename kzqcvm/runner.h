@@ -0,0 +1,191 @@
+/*
+Kzqcvm QuakeC VM Interpreter
+Copyright (c) 2010 David Laurie
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+/*
+kzqcvm/runner.h
+*/
+
+//-----------------------------------------------------------------------------
+#ifndef KZQCVM_RUNNER_H
+#define KZQCVM_RUNNER_H
+//-----------------------------------------------------------------------------
+
+#include <stdint.h>
+#include <vector>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <condition_variable>
+
+#include "kzqcvm.h"
+
+//-----------------------------------------------------------------------------
+namespace kzqcvm {
+	using std::vector;
+//-----------------------------------------------------------------------------
+
+/*
+Timings of one world's frames, in microseconds. A frame's latency is how
+long it took to run, and its wait how long after it fell due it started.
+latencyBuckets[i] counts the frames whose latency was below 2^i
+microseconds but not below 2^(i-1), the last taking all the rest, for
+percentiles.
+*/
+struct WorldStats {
+	static const int LATENCY_BUCKETS = 24;
+
+	int64_t frames;
+	int64_t failedFrames;
+	// frames which finished after the next was due
+	int64_t lateFrames;
+	// frames folded into a longer one to catch up
+	int64_t mergedFrames;
+	int64_t lastLatency;
+	int64_t maxLatency;
+	int64_t totalLatency;
+	int64_t maxWait;
+	int64_t totalWait;
+	int64_t latencyBuckets[LATENCY_BUCKETS];
+};
+
+/*
+A WorldRunner runs many independent worlds, each its own Kzqcvm, at their
+own frame rates on a pool of threads. Add the worlds, then Start(). Each
+world belongs to one thread, which may be pinned to a core so that the
+world's pages stay in that core's caches, but a thread with nothing due
+steals frames from the others rather than sit idle. Of the frames due, a
+thread runs the one whose deadline, the time the world's next frame falls
+due, is earliest, so a heavy world takes its own time rather than that of
+the worlds sharing its thread. A world which falls a whole frame or more
+behind runs the frames it missed as one longer frame, so it can't keep
+claiming the earliest deadline.
+
+A world is only ever run by one thread at a time, but may be run by
+different threads from frame to frame, so its builtins must not rely on
+which thread calls them. Leave the worlds alone while the runner is
+running, other than through GetStats.
+*/
+class WorldRunner {
+public:
+	/*
+	Advances world by frameTime seconds from time. Returns false if the
+	frame failed, which is counted but doesn't stop the world. Without one,
+	a world runs RunThinks over the frame, which fails if any think did.
+	*/
+	typedef bool (*FrameFunction)(Kzqcvm *world, float time, float frameTime);
+
+	/*
+	threads below 1 means one for each core.
+	*/
+	WorldRunner(int threads);
+	/*
+	Stops, and deletes the worlds.
+	*/
+	~WorldRunner();
+
+	/*
+	Takes ownership of world, to run every frameTime seconds from time 0.
+	Returns its number for GetStats, or -1, leaving the world yours, if it
+	isn't loaded, frameTime isn't above zero, or the runner is running.
+	*/
+	int  AddWorld(Kzqcvm *world, float frameTime, FrameFunction frame = NULL);
+	int  GetWorldCount() const { return (int)mWorlds.size(); }
+	Kzqcvm *GetWorld(int world);
+
+	/*
+	Whether to pin each thread to a core of its own, or as near as there
+	are cores. Returns false if the runner is running, or if pinning isn't
+	available here. Off by default.
+	*/
+	bool SetPinned(bool pinned);
+
+	/*
+	Start returns false if already running. The worlds' clocks stop while
+	the runner is stopped, and carry on from the same frame when it
+	restarts. Stop waits for the frames running to finish.
+	*/
+	bool Start();
+	void Stop();
+	bool IsRunning() const { return mRunning; }
+
+	/*
+	Copies out a world's timings so far. Returns false for no such world.
+	*/
+	bool GetStats(int world, WorldStats &stats);
+
+private:
+	WorldRunner(const WorldRunner &);
+	WorldRunner &operator=(const WorldRunner &);
+
+	typedef std::chrono::steady_clock Clock;
+
+	struct World {
+		Kzqcvm        *vm;
+		FrameFunction  frame;
+		Clock::duration frameTime;
+		float          frameSeconds;
+		// the thread it belongs to
+		int            home;
+		// the next frame to run, which falls due at origin + frameTime *
+		// frameNumber
+		int64_t        frameNumber;
+		Clock::time_point origin;
+		Clock::time_point due;
+		Clock::time_point deadline;
+		std::mutex     statsMutex;
+		WorldStats     stats;
+	};
+	// each thread's worlds, waiting by when they are due, and due by deadline
+	struct Queue {
+		std::mutex              mutex;
+		std::condition_variable wake;
+		vector<World*>          waiting;
+		vector<World*>          ready;
+	};
+
+	// how long a thread with nothing due waits before looking to steal
+	static const int STEAL_INTERVAL_MICROSECONDS = 1000;
+
+	void   ThreadMain(int index);
+	void   PinThread(int index);
+	static void MakeReady(Queue &queue, Clock::time_point now);
+	World *Take(int index);
+	void   RunFrame(World *world);
+	void   Requeue(World *world);
+
+	vector<World*>      mWorlds;
+	vector<Queue*>      mQueues;
+	vector<std::thread> mThreads;
+	int                 mThreadCount;
+	bool                mPinned;
+	bool                mRunning;
+	std::atomic<bool>   mStopping;
+};
+
+//-----------------------------------------------------------------------------
+} // namespace
+//-----------------------------------------------------------------------------
+
+//-----------------------------------------------------------------------------
+#endif
+//-----------------------------------------------------------------------------
@@ -0,0 +1,173 @@
+/*
+Kzqcvm QuakeC VM Interpreter
+Copyright (c) 2010 David Laurie
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+/*
+kzqcvm/state.cpp
+*/
+
+#include "kzqcvm.h"
+
+#include <string.h>
+#include <vector>
+
+//-----------------------------------------------------------------------------
+namespace kzqcvm {
+	using std::vector;
+//-----------------------------------------------------------------------------
+
+// Layout of a saved state:
+//
+// StateHeader
+// float[globaldata_num]         globals
+// int32[4]                      entity size, entities per page, generation
+//                               bits, page count
+// float[page size] * page count entity pages
+// int32                         zone string count
+// { int32 length, char[length] } * count, length -1 for a free slot
+//
+// and of a delta:
+//
+// StateHeader                   with DELTA_MAGIC
+// int32                         checkpoint the delta is relative to, for
+//                               reference only: the receiver's own
+//                               checkpoints count independently, so it is
+//                               skipped when applying
+// float[globaldata_num]         globals
+// EntityManager::SaveDelta
+// StringManager::SaveDelta
+
+static const char    STATE_MAGIC[4] = { 'K', 'Z', 'Q', 'S' };
+static const char    DELTA_MAGIC[4] = { 'K', 'Z', 'Q', 'D' };
+static const int32_t STATE_VERSION  = 4;
+
+struct StateHeader {
+	char    magic[4];
+	int32_t version;
+	int32_t crc;
+	int32_t globaldata_num;
+};
+
+//-----------------------------------------------------------------------------
+// Save
+//-----------------------------------------------------------------------------
+
+bool Kzqcvm::SaveState(ostream &out)
+{
+	StateHeader header;
+	memcpy(header.magic, STATE_MAGIC, sizeof(header.magic));
+	header.version        = STATE_VERSION;
+	header.crc            = mHeader->crc;
+	header.globaldata_num = mHeader->globaldata_num;
+	out.write((const char*)&header, sizeof(header));
+
+	out.write((const char*)mGlobalData, mHeader->globaldata_num * sizeof(float));
+
+	if (!mEntityManager.Save(out))
+		return false;
+	return mStringManager.Save(out);
+}
+
+//-----------------------------------------------------------------------------
+// Load
+//-----------------------------------------------------------------------------
+
+bool Kzqcvm::LoadState(istream &in)
+{
+	StateHeader header;
+	if (!in.read((char*)&header, sizeof(header)))
+		return false;
+	if (memcmp(header.magic, STATE_MAGIC, sizeof(header.magic)) != 0 ||
+		header.version        != STATE_VERSION ||
+		header.crc            != mHeader->crc ||
+		header.globaldata_num != mHeader->globaldata_num)
+	{
+		return false;
+	}
+
+	// hold the globals back until the entity layout has been checked too
+	vector<float> globals(mHeader->globaldata_num);
+	if (!in.read((char*)&globals[0], globals.size() * sizeof(float)))
+		return false;
+
+	if (!mEntityManager.Restore(in))
+		return false;
+	mThinksStale = true;
+	memcpy(mGlobalData, &globals[0], globals.size() * sizeof(float));
+	ReleaseChangedConstants();
+	return mStringManager.Restore(in);
+}
+
+//-----------------------------------------------------------------------------
+// Deltas
+//-----------------------------------------------------------------------------
+
+uint32_t Kzqcvm::Checkpoint()
+{
+	// the managers count in step
+	mStringManager.Checkpoint();
+	return mEntityManager.Checkpoint();
+}
+
+bool Kzqcvm::SaveDelta(ostream &out, uint32_t checkpoint)
+{
+	StateHeader header;
+	memcpy(header.magic, DELTA_MAGIC, sizeof(header.magic));
+	header.version        = STATE_VERSION;
+	header.crc            = mHeader->crc;
+	header.globaldata_num = mHeader->globaldata_num;
+	out.write((const char*)&header, sizeof(header));
+	out.write((const char*)&checkpoint, sizeof(checkpoint));
+
+	out.write((const char*)mGlobalData, mHeader->globaldata_num * sizeof(float));
+
+	if (!mEntityManager.SaveDelta(out, checkpoint))
+		return false;
+	return mStringManager.SaveDelta(out, checkpoint);
+}
+
+bool Kzqcvm::ApplyDelta(istream &in)
+{
+	StateHeader header;
+	if (!in.read((char*)&header, sizeof(header)) ||
+		!in.ignore(sizeof(uint32_t)))
+		return false;
+	if (memcmp(header.magic, DELTA_MAGIC, sizeof(header.magic)) != 0 ||
+		header.version        != STATE_VERSION ||
+		header.crc            != mHeader->crc ||
+		header.globaldata_num != mHeader->globaldata_num)
+	{
+		return false;
+	}
+
+	if (!in.read((char*)mGlobalData, mHeader->globaldata_num * sizeof(float)))
+		return false;
+	ReleaseChangedConstants();
+
+	mThinksStale = true;
+	if (!mEntityManager.ApplyDelta(in))
+		return false;
+	return mStringManager.ApplyDelta(in);
+}
+
+//-----------------------------------------------------------------------------
+} // namespace
+//-----------------------------------------------------------------------------
@@ -43,6 +43,7 @@ namespace kzqcvm {
 StringManager::StringManager()
 {
 	mInit = false;
+	mWriteEpoch = 1;
 }
 
 StringManager::~StringManager()
@@ -53,7 +54,16 @@ StringManager::~StringManager()
 	}
 	for (int i=0; i<(int)mZoneStrings.size(); ++i)
 	{
-		delete[] mZoneStrings[i];
+		ReleaseZoneString(mZoneStrings[i]);
+	}
+}
+
+void StringManager::ReleaseZoneString(ZoneString *zs)
+{
+	if (zs && --zs->refCount == 0)
+	{
+		delete[] zs->text;
+		delete zs;
 	}
 }
 
@@ -61,7 +71,7 @@ StringManager::~StringManager()
 // Init - must init
 //-----------------------------------------------------------------------------
 
-void StringManager::Init(char *stringConstants, int32_t stringConstantsSize)
+void StringManager::Init(const char *stringConstants, int32_t stringConstantsSize)
 {
 	mInit = true;
 
@@ -72,11 +82,38 @@ void StringManager::Init(char *stringConstants, int32_t stringConstantsSize)
 	mZoneStrings.reserve(512);
 }
 
+//-----------------------------------------------------------------------------
+// Fork
+//-----------------------------------------------------------------------------
+
+void StringManager::Fork(StringManager &source)
+{
+	assert(source.mInit);
+	ClearTempStrings();
+	for (int i=0; i<(int)mZoneStrings.size(); ++i)
+	{
+		ReleaseZoneString(mZoneStrings[i]);
+	}
+
+	mInit          = true;
+	mConstants     = source.mConstants;
+	mConstantsSize = source.mConstantsSize;
+
+	mZoneStrings   = source.mZoneStrings;
+	mWriteEpoch    = source.mWriteEpoch;
+	mZoneStamps    = source.mZoneStamps;
+	for (int i=0; i<(int)mZoneStrings.size(); ++i)
+	{
+		if (mZoneStrings[i])
+			++mZoneStrings[i]->refCount;
+	}
+}
+
 //-----------------------------------------------------------------------------
 // Get String
 //-----------------------------------------------------------------------------
 
-char *StringManager::GetString(int32_t stringnum)
+const char *StringManager::GetString(int32_t stringnum)
 {
 	assert(mInit);
 	if (stringnum >= 0)
@@ -88,8 +125,8 @@ char *StringManager::GetString(int32_t stringnum)
 		}
 		// zone
 		stringnum -= mConstantsSize;
-		if (stringnum < (int)mZoneStrings.size())
-			return mZoneStrings[stringnum];
+		if (stringnum < (int)mZoneStrings.size() && mZoneStrings[stringnum])
+			return mZoneStrings[stringnum]->text;
 	}
 	else
 	{
@@ -107,20 +144,22 @@ char *StringManager::GetString(int32_t stringnum)
 
 int32_t StringManager::Zone(string str)
 {
-	char *newstr = new char[str.length()+1];
-	strcpy(newstr, str.c_str());
+	ZoneString *newstr = new ZoneString;
+	newstr->refCount = 1;
+	newstr->text     = new char[str.length()+1];
+	strcpy(newstr->text, str.c_str());
 
 	for (int i=0; i<(int)mZoneStrings.size(); ++i)
 	{
 		if (mZoneStrings[i] == 0)
 		{
-			mZoneStrings[i] = newstr;
+			SetZoneString(i, newstr);
 			return i + mConstantsSize;
 		}
 	}
 
 	int32_t index = mZoneStrings.size();
-	mZoneStrings.push_back(newstr);
+	SetZoneString(index, newstr);
 	return index + mConstantsSize;
 }
 
@@ -136,12 +175,144 @@ bool StringManager::Unzone(int32_t stringnum)
 	if (mZoneStrings[stringnum] == 0)
 		return false;
 
-	delete[] mZoneStrings[stringnum];
-	mZoneStrings[stringnum] = 0;
+	SetZoneString(stringnum, 0);
 
 	return true;
 }
 
+// Replaces a slot, releasing whatever was there, growing to fit if needed.
+void StringManager::SetZoneString(int32_t index, ZoneString *zs)
+{
+	if (index >= (int)mZoneStrings.size())
+	{
+		mZoneStrings.resize(index+1, (ZoneString*)0);
+		mZoneStamps.resize(index+1, mWriteEpoch);
+	}
+	ReleaseZoneString(mZoneStrings[index]);
+	mZoneStrings[index] = zs;
+	mZoneStamps[index]  = mWriteEpoch;
+}
+
+//-----------------------------------------------------------------------------
+// Save/Restore
+//-----------------------------------------------------------------------------
+
+bool StringManager::Save(ostream &out)
+{
+	assert(mInit);
+	int32_t count = mZoneStrings.size();
+	out.write((const char*)&count, sizeof(count));
+	for (int i=0; i<count; ++i)
+	{
+		// freed slots are kept so the numbers of the others don't change
+		int32_t length = -1;
+		if (mZoneStrings[i])
+			length = strlen(mZoneStrings[i]->text);
+		out.write((const char*)&length, sizeof(length));
+		if (length > 0)
+			out.write(mZoneStrings[i]->text, length);
+	}
+	return out.good();
+}
+
+bool StringManager::Restore(istream &in)
+{
+	assert(mInit);
+	int32_t count;
+	if (!in.read((char*)&count, sizeof(count)) || count < 0)
+		return false;
+
+	ClearTempStrings();
+	for (int i=0; i<(int)mZoneStrings.size(); ++i)
+	{
+		ReleaseZoneString(mZoneStrings[i]);
+	}
+	mZoneStrings.assign(count, (ZoneString*)0);
+	mZoneStamps.assign(count, mWriteEpoch);
+
+	for (int i=0; i<count; ++i)
+	{
+		int32_t length;
+		if (!in.read((char*)&length, sizeof(length)))
+			return false;
+		if (length < 0)
+			continue;
+		ZoneString *zs = new ZoneString;
+		zs->refCount = 1;
+		zs->text     = new char[length+1];
+		zs->text[length] = '\0';
+		mZoneStrings[i] = zs;
+		if (!in.read(zs->text, length))
+			return false;
+	}
+	return true;
+}
+
+// Delta layout:
+//
+// int32                              zone string count
+// { int32 slot, int32 length, char[length] } per changed slot, -1 if free
+// int32 -1                           end of slots
+
+bool StringManager::SaveDelta(ostream &out, uint32_t checkpoint)
+{
+	assert(mInit);
+	int32_t count = mZoneStrings.size();
+	out.write((const char*)&count, sizeof(count));
+	for (int32_t i=0; i<count; ++i)
+	{
+		if (mZoneStamps[i] <= checkpoint)
+			continue;
+		int32_t slot[2] = { i, -1 };
+		if (mZoneStrings[i])
+			slot[1] = strlen(mZoneStrings[i]->text);
+		out.write((const char*)slot, sizeof(slot));
+		if (slot[1] > 0)
+			out.write(mZoneStrings[i]->text, slot[1]);
+	}
+	int32_t end = -1;
+	out.write((const char*)&end, sizeof(end));
+	return out.good();
+}
+
+bool StringManager::ApplyDelta(istream &in)
+{
+	assert(mInit);
+	int32_t count;
+	if (!in.read((char*)&count, sizeof(count)) || count < 0)
+		return false;
+	while ((int32_t)mZoneStrings.size() > count)
+	{
+		ReleaseZoneString(mZoneStrings.back());
+		mZoneStrings.pop_back();
+		mZoneStamps.pop_back();
+	}
+	mZoneStrings.resize(count, (ZoneString*)0);
+	mZoneStamps.resize(count, mWriteEpoch);
+
+	int32_t slot[2];
+	while (in.read((char*)slot, sizeof(int32_t)) && slot[0] >= 0)
+	{
+		if (!in.read((char*)&slot[1], sizeof(int32_t)) || slot[0] >= count)
+			return false;
+		ZoneString *zs = 0;
+		if (slot[1] >= 0)
+		{
+			zs = new ZoneString;
+			zs->refCount = 1;
+			zs->text     = new char[slot[1]+1];
+			zs->text[slot[1]] = '\0';
+			if (!in.read(zs->text, slot[1]))
+			{
+				ReleaseZoneString(zs);
+				return false;
+			}
+		}
+		SetZoneString(slot[0], zs);
+	}
+	return in.good();
+}
+
 //-----------------------------------------------------------------------------
 // TempStrings
 //-----------------------------------------------------------------------------
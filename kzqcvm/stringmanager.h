@@ -32,11 +32,16 @@ kzqcvm/stringmanager.h
 #include <stdint.h>
 #include <string>
 #include <vector>
+#include <atomic>
+#include <istream>
+#include <ostream>
 
 //-----------------------------------------------------------------------------
 namespace kzqcvm {
 	using std::string;
 	using std::vector;
+	using std::istream;
+	using std::ostream;
 //-----------------------------------------------------------------------------
 
 class StringManager {
@@ -44,10 +49,16 @@ public:
 	StringManager();
 	~StringManager();
 
-	void Init(char *stringConstants, int32_t stringConstantsSize);
+	// The constants are not copied, and must outlive the manager.
+	void Init(const char *stringConstants, int32_t stringConstantsSize);
+
+	// Discards our own zone strings and shares source's instead. Zoned
+	// strings never change, so they are shared until one side unzones them.
+	// Temp strings are not carried over.
+	void Fork(StringManager &source);
 
 	// returns 0 if the stringnum is invalid, but blank if it's null
-	char    *GetString(int32_t stringnum);
+	const char *GetString(int32_t stringnum);
 
 	int32_t  Zone(string str);
 	bool     Unzone(int32_t stringnum);
@@ -55,14 +66,36 @@ public:
 	int32_t  TempString(string str);
 	void     ClearTempStrings();
 
+	// Writes or reads the zoned strings, keeping their numbers. Temp strings
+	// are not saved, and are cleared by Restore.
+	bool     Save(ostream &out);
+	bool     Restore(istream &in);
+
+	// As EntityManager, zoning and unzoning stamp the slot with the current
+	// checkpoint number, and deltas hold the slots changed since one.
+	uint32_t Checkpoint() { return mWriteEpoch++; }
+	bool     SaveDelta(ostream &out, uint32_t checkpoint);
+	bool     ApplyDelta(istream &in);
+
 private:
 	bool     mInit;
 
-	char    *mConstants;
+	const char *mConstants;
 	int32_t  mConstantsSize;
 
-	vector<char*> mTempStrings;
-	vector<char*> mZoneStrings;
+	// zoned strings can be shared between forked managers
+	struct ZoneString {
+		std::atomic<int> refCount;
+		char            *text;
+	};
+	static void ReleaseZoneString(ZoneString *zs);
+
+	vector<char*>       mTempStrings;
+	vector<ZoneString*> mZoneStrings;
+
+	uint32_t            mWriteEpoch;
+	vector<uint32_t>    mZoneStamps;
+	void     SetZoneString(int32_t index, ZoneString *zs);
 };
 
 //-----------------------------------------------------------------------------
@@ -26,15 +26,29 @@ kzqcvm/test.cpp
 
 #include "test.h"
 
+#include <stdio.h>
+#include <string.h>
 #include <iostream>
+#include <sstream>
+#include <thread>
+#include <chrono>
+
+#include <sys/stat.h>
 
 #include "kzqcvm.h"
+#include "optimizer.h"
 #include "data.h"
+#include "context.h"
+#include "runner.h"
+#include "mailbox.h"
+#include "publish.h"
 
 //-----------------------------------------------------------------------------
 namespace kzqcvm {
 	using std::cout;
 	using std::endl;
+	using std::ios;
+	using std::stringstream;
 //-----------------------------------------------------------------------------
 
 //-----------------------------------------------------------------------------
@@ -91,6 +105,116 @@ bool vm_NextEntity(Kzqcvm *qcvm, int builtinNum)
 	return true;
 }
 
+//-----------------------------------------------------------------------------
+// Testing - parallel thinks
+//-----------------------------------------------------------------------------
+
+// Each of these sets self's next think a second on, after changing self
+// alone, one entity all of them share, or a global. The shared ones come
+// out differently in a different order.
+static void ThinkAgain(Kzqcvm *qcvm, Entity &self)
+{
+	Field nextthink = qcvm->GetEntityField("nextthink", FLOAT);
+	qcvm->GetFloatPointer(self, nextthink).Set(qcvm->GetFloatPointer("time").Get() + 1.0f);
+}
+
+bool vm_ThinkAlone(Kzqcvm *qcvm, int builtinNum)
+{
+	Entity self = qcvm->GetEntityPointer("self").Get();
+	Field field = qcvm->GetEntityField("health", FLOAT);
+	FloatPointer health = qcvm->GetFloatPointer(self, field);
+	health.Set(health.Get() * 2.0f + 1.0f);
+	ThinkAgain(qcvm, self);
+	return true;
+}
+
+bool vm_ThinkShared(Kzqcvm *qcvm, int builtinNum)
+{
+	Entity self = qcvm->GetEntityPointer("self").Get();
+	Entity shared = qcvm->GetFirstEntity();
+	Field field = qcvm->GetEntityField("health", FLOAT);
+	FloatPointer health = qcvm->GetFloatPointer(shared, field);
+	health.Set(health.Get() * 0.5f + qcvm->GetFloatPointer(self, field).Get());
+	ThinkAgain(qcvm, self);
+	return true;
+}
+
+bool vm_ThinkGlobal(Kzqcvm *qcvm, int builtinNum)
+{
+	Entity self = qcvm->GetEntityPointer("self").Get();
+	Field field = qcvm->GetEntityField("health", FLOAT);
+	FloatPointer counter = qcvm->GetFloatPointer("counter");
+	counter.Set(counter.Get() * 0.5f + qcvm->GetFloatPointer(self, field).Get());
+	ThinkAgain(qcvm, self);
+	return true;
+}
+
+// A progs with just those builtins, their fields and globals, so the test
+// doesn't depend on what test.dat has.
+static void MakeThinkProgs(vector<char> &progs)
+{
+	string strings(1, '\0');
+	auto name = [&](const char *s) {
+		int32_t offset = (int32_t)strings.size();
+		strings.append(s, strlen(s) + 1);
+		return offset;
+	};
+	// past the return value and parameters
+	const int16_t firstGlobal = 28;
+	QcvmStatement statements[1] = { { 0, { 0, 0, 0 } } };
+	// counter is no system global, and no QC stores to it, so it starts
+	// out a constant till the host asks for it
+	QcvmDefinition globalDefs[4] = {
+		{ FLOAT,  firstGlobal,     name("time") },
+		{ ENTITY, firstGlobal + 1, name("self") },
+		{ NOTYPE, firstGlobal + 2, name("end_sys_fields") },
+		{ FLOAT,  firstGlobal + 3, name("counter") } };
+	QcvmDefinition fieldDefs[3] = {
+		{ FLOAT,    0, name("nextthink") },
+		{ FUNCTION, 1, name("think") },
+		{ FLOAT,    2, name("health") } };
+	QcvmFunction functions[4];
+	memset(functions, 0, sizeof(functions));
+	const char *names[4] = { "", "think_alone", "think_shared", "think_global" };
+	for (int i=1; i<4; ++i)
+	{
+		functions[i].offsetFirstStatement = -i;
+		functions[i].nameOffset = name(names[i]);
+	}
+	int32_t globals[firstGlobal + 4] = { 0 };
+
+	QcvmHeader header;
+	progs.assign(sizeof(header), 0);
+	auto lump = [&](const void *data, size_t size) {
+		int32_t offset = (int32_t)progs.size();
+		progs.insert(progs.end(), (const char*)data, (const char*)data + size);
+		return offset;
+	};
+	header.version           = 6;
+	header.crc               = 0;
+	header.statements_offset = lump(statements, sizeof(statements));
+	header.statements_num    = 1;
+	header.globaldefs_offset = lump(globalDefs, sizeof(globalDefs));
+	header.globaldefs_num    = 4;
+	header.fielddefs_offset  = lump(fieldDefs, sizeof(fieldDefs));
+	header.fielddefs_num     = 3;
+	header.functions_offset  = lump(functions, sizeof(functions));
+	header.functions_num     = 4;
+	header.globaldata_offset = lump(globals, sizeof(globals));
+	header.globaldata_num    = firstGlobal + 4;
+	header.stringdata_offset = lump(strings.data(), strings.size());
+	header.stringdata_size   = (int32_t)strings.size();
+	header.entity_size       = 3;
+	memcpy(&progs[0], &header, sizeof(header));
+}
+
+// stands in for a struct from a different progs
+struct OtherEntityFields {
+	static const int32_t  PROGS_CRC   = 0;
+	static const uint64_t LAYOUT_HASH = 0;
+	float nextthink;
+};
+
 //-----------------------------------------------------------------------------
 // Testing - run tests
 //-----------------------------------------------------------------------------
@@ -175,6 +299,489 @@ bool Test()
 	cout << testProgs.GetErrorMessages() << endl;
 	testProgs.ClearErrors();
 
+	// a second instance sharing the image has its own globals
+	Kzqcvm sharedProgs(testProgs.GetImage());
+	if (!sharedProgs.IsLoaded() || sharedProgs.GetCRC() != testProgs.GetCRC())
+	{
+		cout << "could not share the progs image" << endl;
+		return false;
+	}
+	sharedProgs.AddBuiltin(vm_ThrowError, 1);
+	sharedProgs.AddBuiltin(vm_Spawn,      2);
+	sharedProgs.AddBuiltin(vm_Remove,     3);
+	sharedProgs.AddBuiltin(vm_Zone,       4);
+	sharedProgs.AddBuiltin(vm_Unzone,     5);
+	if (!sharedProgs.GetFunction("main").Run() || sharedProgs.GetReturnFloatPointer().Get() != 1.0f)
+	{
+		cout << "main function failed in shared instance" << endl;
+		return false;
+	}
+
+	// a fork has its own copy of the world
+	Kzqcvm *fork = sharedProgs.Fork();
+	for (Entity e = fork->GetFirstEntity(); e; e = fork->GetFirstEntity())
+	{
+		fork->DeleteEntity(e, 0);
+	}
+	bool forkSeparate = !fork->GetFirstEntity() &&
+		(sharedProgs.GetFirstEntity() || !testProgs.GetFirstEntity());
+	delete fork;
+	if (!forkSeparate)
+	{
+		cout << "deleting entities in a fork affected the original" << endl;
+		return false;
+	}
+
+	// the state saves and restores into another instance
+	stringstream state(ios::in | ios::out | ios::binary);
+	Kzqcvm restoredProgs(testProgs.GetImage());
+	if (!testProgs.SaveState(state) || !restoredProgs.LoadState(state) ||
+		!restoredProgs.GetFirstEntity() != !testProgs.GetFirstEntity())
+	{
+		cout << "could not save and restore the state" << endl;
+		return false;
+	}
+
+	// a million entities on large pages, each still individually addressable
+	Kzqcvm largeProgs(testProgs.GetImage());
+	const int32_t numLarge = 1 << 20;
+	if (!largeProgs.SetEntitiesPerPage(4096) || largeProgs.SetEntitiesPerPage(1000))
+	{
+		cout << "could not set the entities per page" << endl;
+		return false;
+	}
+	Field largeField = largeProgs.GetEntityField("nextthink", FLOAT);
+	for (int32_t i=0; i<numLarge; ++i)
+	{
+		Entity e = largeProgs.CreateEntity(0);
+		if (largeField)
+			largeProgs.GetFloatPointer(e, largeField).Set((float)i);
+	}
+	int32_t numFound = 0;
+	bool largeValues = true;
+	Entity first = largeProgs.GetFirstEntity();
+	for (Entity e = first; e; e = largeProgs.NextEntity(e))
+	{
+		if (largeField && largeProgs.GetFloatPointer(e, largeField).Get() != (float)numFound)
+			largeValues = false;
+		if (++numFound == numLarge)
+			break;
+	}
+	if (numFound != numLarge || !largeValues || largeProgs.SetEntitiesPerPage(256))
+	{
+		cout << "entities on large pages were not kept" << endl;
+		return false;
+	}
+	Entity e = first;
+	for (int32_t i=0; i<numLarge; ++i)
+	{
+		Entity next = largeProgs.NextEntity(e);
+		largeProgs.DeleteEntity(e, 0);
+		e = next;
+	}
+	if (largeProgs.GetFirstEntity() || !largeProgs.SetEntitiesPerPage(256))
+	{
+		cout << "could not delete the entities on large pages" << endl;
+		return false;
+	}
+
+	// with generations a slot is reused at once, and its old number is stale
+	Kzqcvm generationProgs(testProgs.GetImage());
+	Field generationField = generationProgs.GetEntityField("nextthink", FLOAT);
+	if (!generationProgs.SetEntityGenerations(8))
+	{
+		cout << "could not turn on entity generations" << endl;
+		return false;
+	}
+	Entity stale = generationProgs.CreateEntity(0);
+	generationProgs.DeleteEntity(stale, 0);
+	Entity fresh = generationProgs.CreateEntity(0);
+	generationProgs.DeleteEntity(stale, 0);
+	if (!generationProgs.GetFirstEntity() || (generationField &&
+		(generationProgs.GetFloatPointer(stale, generationField) ||
+		!generationProgs.GetFloatPointer(fresh, generationField))))
+	{
+		cout << "a stale entity number reached the new entity" << endl;
+		return false;
+	}
+
+	// nor once its page has been released and written again
+	Kzqcvm releasedProgs(testProgs.GetImage());
+	Field releasedField = releasedProgs.GetEntityField("nextthink", FLOAT);
+	vector<Entity> released, reused;
+	if (!releasedProgs.SetEntitiesPerPage(4) || !releasedProgs.SetEntityGenerations(8))
+	{
+		cout << "could not turn on entity generations" << endl;
+		return false;
+	}
+	releasedProgs.CreateEntities(12, 0, released);
+	vector<Entity> releasedStale(released.begin() + 4, released.end());
+	releasedProgs.DeleteEntities(releasedStale, 0);
+	bool releasedOk = releasedProgs.ReleaseFreeEntityPages(0) == 2;
+	releasedProgs.CreateEntities(8, 0, reused);
+	for (size_t i=0; i<releasedStale.size(); ++i)
+	{
+		releasedOk = releasedOk && releasedStale[i] != reused[i] &&
+			(!releasedField || (!releasedProgs.GetFloatPointer(releasedStale[i], releasedField) &&
+			releasedProgs.GetFloatPointer(reused[i], releasedField)));
+	}
+	if (!releasedOk)
+	{
+		cout << "a stale entity number reached an entity on a released page" << endl;
+		return false;
+	}
+
+	// entities created and deleted in bulk
+	Kzqcvm bulkProgs(testProgs.GetImage());
+	vector<Entity> bulk;
+	bulkProgs.CreateEntities(2000, 0, bulk);
+	bulkProgs.CreateEntities(10, 0, bulk);
+	bool bulkCreated = bulk.size() == 2010 && bulkProgs.GetFirstEntity() == bulk[0];
+
+	// their fields gather into columns and scatter back
+	vector<Field> columnFields(1, bulkProgs.GetEntityField("nextthink", FLOAT));
+	if (columnFields[0])
+	{
+		vector<float> nextthinks(bulk.size(), 1.0f);
+		float *columns[1] = { &nextthinks[0] };
+		vector<Entity> rows;
+		bulkCreated = bulkCreated && bulkProgs.ScatterFields(columnFields, columns, bulk);
+		nextthinks.assign(bulk.size(), 0.0f);
+		bulkCreated = bulkCreated && bulkProgs.GatherFields(columnFields, columns, (int32_t)bulk.size(), rows) == 2010 &&
+			rows == bulk && nextthinks[2009] == 1.0f;
+	}
+	bulkProgs.DeleteEntities(bulk, 0);
+	if (!bulkCreated || bulkProgs.GetFirstEntity())
+	{
+		cout << "could not create and delete entities in bulk" << endl;
+		return false;
+	}
+
+	// after a spike, the survivors move down and the empty pages are released
+	Kzqcvm spikeProgs(testProgs.GetImage());
+	Entity survivor;
+	for (int i=0; i<1000; ++i)
+	{
+		Entity e = spikeProgs.CreateEntity(0);
+		if (i == 0 || i == 999)
+			survivor = e;
+		else
+			spikeProgs.DeleteEntity(e, 0);
+	}
+	vector<pair<Entity, Entity> > moved;
+	spikeProgs.DefragmentEntities(10, moved);
+	if (moved.size() != 1 || moved[0].first != survivor ||
+		spikeProgs.ReleaseFreeEntityPages(100) != 3 ||
+		spikeProgs.NextEntity(spikeProgs.GetFirstEntity()) != moved[0].second)
+	{
+		cout << "could not compact the entities" << endl;
+		return false;
+	}
+
+	// the entity struct is stamped, and doesn't fit another progs' entities
+	stringstream entityStruct;
+	Entity structEntity = spikeProgs.GetFirstEntity();
+	if (!testProgs.WriteEntityStruct(entityStruct, "TestEntityFields") ||
+		entityStruct.str().find("struct TestEntityFields {") == string::npos ||
+		spikeProgs.EntityData<OtherEntityFields>(structEntity))
+	{
+		cout << "could not write the entity struct" << endl;
+		return false;
+	}
+
+	// a think runs once, when due; this one has no function to call, so fails
+	Kzqcvm thinkProgs(testProgs.GetImage());
+	if (thinkProgs.SetThinkThreads(0) || !thinkProgs.SetThinkThreads(2))
+	{
+		cout << "could not set the think threads" << endl;
+		return false;
+	}
+	if (thinkProgs.EnableThinks())
+	{
+		Entity thinker = thinkProgs.CreateEntity(0);
+		Field nextthink = thinkProgs.GetEntityField("nextthink", FLOAT);
+		thinkProgs.GetFloatPointer(thinker, nextthink).Set(1.5f);
+		vector<Entity> failedThinks;
+		if (thinkProgs.RunThinks(0.0f, 1.0f, failedThinks) != 0 ||
+			thinkProgs.RunThinks(1.0f, 2.0f, failedThinks) != 1 || failedThinks.size() != 1 ||
+			failedThinks[0] != thinker || thinkProgs.GetFloatPointer(thinker, nextthink).Get() != 0.0f ||
+			thinkProgs.RunThinks(2.0f, 3.0f, failedThinks) != 0)
+		{
+			cout << "could not schedule thinks" << endl;
+			return false;
+		}
+	}
+
+	// thinks spread over threads end as they would run in order, though
+	// some write the same entity and some the same global
+	vector<char> thinkData;
+	MakeThinkProgs(thinkData);
+	ProgsImage *thinkImage = new ProgsImage(&thinkData[0], thinkData.size());
+	Kzqcvm serialThinks(thinkImage), parallelThinks(thinkImage);
+	thinkImage->Release();
+	Kzqcvm *thinkWorlds[2] = { &serialThinks, &parallelThinks };
+	int32_t thinksRun[2] = { 0, 0 };
+	bool thinksFailed = false;
+	for (int w=0; w<2; ++w)
+	{
+		Kzqcvm &world = *thinkWorlds[w];
+		if (!world.IsLoaded() || !world.EnableThinks() || !world.SetThinkThreads(w == 0 ? 1 : 4))
+		{
+			cout << "could not load the parallel think progs" << endl;
+			return false;
+		}
+		world.AddBuiltin(vm_ThinkAlone,  1);
+		world.AddBuiltin(vm_ThinkShared, 2);
+		world.AddBuiltin(vm_ThinkGlobal, 3);
+		for (int b=1; b<=3; ++b)
+			world.SetBuiltinParallel(b, true);
+		world.GetFloatPointer("counter").Set(1.0f);
+		Field health    = world.GetEntityField("health", FLOAT);
+		Field nextthink = world.GetEntityField("nextthink", FLOAT);
+		Field think     = world.GetEntityField("think", FUNCTION);
+		Function thinks[3] = { world.GetFunction("think_alone"), world.GetFunction("think_shared"),
+			world.GetFunction("think_global") };
+		vector<Entity> thinkers;
+		world.CreateEntities(64, 0, thinkers);
+		// with four threads, the first and last quarters write the first
+		// entity and the last two the counter, leaving some to be taken
+		// together and some to be run again
+		for (int i=0; i<64; ++i)
+		{
+			int kind = (i == 0 || i == 5 || i == 50 || i == 60) ? 1 : (i == 40 || i == 44 || i == 62) ? 2 : 0;
+			world.GetFloatPointer(thinkers[i], health).Set((float)i);
+			world.GetFloatPointer(thinkers[i], nextthink).Set(1.0f + i / 128.0f);
+			world.GetFunctionPointer(thinkers[i], think).Set(thinks[kind]);
+		}
+		vector<Entity> failedThinks;
+		for (int frame=1; frame<=3; ++frame)
+		{
+			thinksRun[w] += world.RunThinks((float)frame, frame + 1.0f, failedThinks);
+		}
+		thinksFailed = thinksFailed || !failedThinks.empty();
+	}
+	bool thinksMatch = thinksRun[0] == 3 * 64 && thinksRun[1] == thinksRun[0] && !thinksFailed &&
+		serialThinks.GetFloatPointer("counter").Get() == parallelThinks.GetFloatPointer("counter").Get();
+	Field serialHealth   = serialThinks.GetEntityField("health", FLOAT);
+	Field parallelHealth = parallelThinks.GetEntityField("health", FLOAT);
+	Entity serialThinker = serialThinks.GetFirstEntity(), parallelThinker = parallelThinks.GetFirstEntity();
+	for (int i=0; i<64 && thinksMatch; ++i)
+	{
+		thinksMatch = serialThinks.GetFloatPointer(serialThinker, serialHealth).Get() ==
+			parallelThinks.GetFloatPointer(parallelThinker, parallelHealth).Get();
+		serialThinker   = serialThinks.NextEntity(serialThinker);
+		parallelThinker = parallelThinks.NextEntity(parallelThinker);
+	}
+	if (!thinksMatch)
+	{
+		cout << "parallel thinks came out differently from running them in order" << endl;
+		return false;
+	}
+
+	// contexts see the world as synced; a denied one can't write, and a
+	// committed one's writes reach the world unless the world got there first
+	Kzqcvm contextWorld(testProgs.GetImage());
+	Field contextField = contextWorld.GetEntityField("nextthink", FLOAT);
+	if (contextField)
+	{
+		Entity worldEntity = contextWorld.CreateEntity(0);
+		ExecutionContext denied(contextWorld, ExecutionContext::WRITES_DENIED);
+		ExecutionContext committed(contextWorld, ExecutionContext::WRITES_COMMITTED);
+		Entity deniedEntity = denied.ToContext(worldEntity);
+		Entity committedEntity = committed.ToContext(worldEntity);
+		Field deniedField = denied.GetVM().GetEntityField("nextthink", FLOAT);
+		Field committedField = committed.GetVM().GetEntityField("nextthink", FLOAT);
+		vector<Entity> rejected;
+		committed.GetVM().GetFloatPointer(committedEntity, committedField).Set(2.0f);
+		bool committedFirst = committed.Commit(rejected) == 1 && rejected.empty() &&
+			contextWorld.GetFloatPointer(worldEntity, contextField).Get() == 2.0f;
+		committed.Sync();
+		committed.GetVM().GetFloatPointer(committedEntity, committedField).Set(3.0f);
+		contextWorld.GetFloatPointer(worldEntity, contextField).Set(4.0f);
+		if (!denied.IsLoaded() || !committedFirst ||
+			denied.GetVM().GetFloatPointer(deniedEntity, deniedField) ||
+			committed.Commit(rejected) != 0 || rejected.size() != 1 || rejected[0] != worldEntity ||
+			contextWorld.GetFloatPointer(worldEntity, contextField).Get() != 4.0f)
+		{
+			cout << "could not commit from an execution context" << endl;
+			return false;
+		}
+	}
+
+	// syncing a context leaves the world's checkpoints in step, so a delta
+	// taken across a Sync still carries the strings changed since
+	Field deltaField = contextWorld.GetEntityField("classname", STRING);
+	if (deltaField)
+	{
+		Entity deltaEntity = contextWorld.CreateEntity(0);
+		ExecutionContext deltaContext(contextWorld, ExecutionContext::WRITES_PRIVATE);
+		deltaContext.Sync();
+		uint32_t deltaCheckpoint = contextWorld.Checkpoint();
+		contextWorld.GetStringPointer(deltaEntity, deltaField).Set(contextWorld.Alloc(string("delta")));
+		stringstream delta(ios::in | ios::out | ios::binary);
+		Entity appliedEntity = deltaContext.ToContext(deltaEntity);
+		Field appliedField = deltaContext.GetVM().GetEntityField("classname", STRING);
+		if (!contextWorld.SaveDelta(delta, deltaCheckpoint) || !deltaContext.GetVM().ApplyDelta(delta) ||
+			string(deltaContext.GetVM().GetStringPointer(appliedEntity, appliedField).Get().GetValue()) != "delta")
+		{
+			cout << "a delta across a context sync lost a string" << endl;
+			return false;
+		}
+	}
+
+	// a runner runs its worlds' frames until stopped, and times them
+	WorldRunner runner(2);
+	Kzqcvm *spareWorld = testProgs.Fork();
+	int runnerWorld = runner.AddWorld(testProgs.Fork(), 0.001f);
+	WorldStats runnerStats;
+	bool runnerStarted = runnerWorld == 0 && runner.AddWorld(spareWorld, 0.0f) == -1 &&
+		runner.Start() && !runner.Start() && runner.AddWorld(spareWorld, 0.001f) == -1;
+	delete spareWorld;
+	if (!runnerStarted)
+	{
+		cout << "could not start the world runner" << endl;
+		return false;
+	}
+	std::this_thread::sleep_for(std::chrono::milliseconds(20));
+	runner.Stop();
+	if (!runner.GetStats(runnerWorld, runnerStats) || runnerStats.frames < 1 || runner.GetStats(1, runnerStats))
+	{
+		cout << "the world runner ran no frames" << endl;
+		return false;
+	}
+
+	// a mailbox holds what's posted until drained, and no more than it has
+	// room for; strings arrive zoned in the receiver
+	Mailbox mailbox(3);
+	testProgs.GetParameterStringPointer(0).Set(testProgs.TempString("mail"));
+	bool mailPosted = mailbox.GetCapacity() == 4 && !mailbox.Post(testProgs, "x") &&
+		!mailbox.Post(testProgs, "fffffffff");
+	for (int i=0; i<4; ++i)
+	{
+		mailPosted = mailPosted && mailbox.Post(testProgs, "s");
+	}
+	Function mailHandler = sharedProgs.GetFunction("main_error_throw");
+	int32_t mailFailed = 0;
+	if (!mailPosted || mailbox.Post(testProgs, "s") || mailbox.GetCount() != 4 ||
+		mailbox.Drain(sharedProgs, mailHandler, 3, mailFailed) != 3 || mailFailed != 3 ||
+		mailbox.GetCount() != 1 || string(sharedProgs.GetParameterStringPointer(0).Get().GetValue()) != "mail")
+	{
+		cout << "could not pass messages through a mailbox" << endl;
+		return false;
+	}
+	sharedProgs.ClearErrors();
+
+	// readers see the world as it was last published, not as it is since
+	Kzqcvm publishWorld(testProgs.GetImage());
+	Field publishField = publishWorld.GetEntityField("nextthink", FLOAT);
+	if (publishField)
+	{
+		Entity published = publishWorld.CreateEntity(0);
+		publishWorld.GetFloatPointer(published, publishField).Set(5.0f);
+		StatePublisher publisher(publishWorld);
+		float publishedBefore = -1.0f, publishedAfter = -1.0f;
+		bool foundBefore = true;
+		publisher.Read([&](const PublishedState &state) {
+			foundBefore = state.GetFloat(published, publishField, publishedBefore);
+		});
+		bool publishedOk = publisher.Publish();
+		publishWorld.GetFloatPointer(published, publishField).Set(6.0f);
+		uint32_t publishedVersion = publisher.Read([&](const PublishedState &state) {
+			state.GetFloat(published, publishField, publishedAfter);
+		});
+		if (foundBefore || !publishedOk || publishedVersion != 1 || publishedAfter != 5.0f)
+		{
+			cout << "could not read a published state" << endl;
+			return false;
+		}
+	}
+
+	// once both copies are up to date, a publish copies only the pages
+	// written since that copy was last published
+	Kzqcvm pagedWorld(testProgs.GetImage());
+	Field pagedField = pagedWorld.GetEntityField("nextthink", FLOAT);
+	if (pagedField && pagedWorld.SetEntitiesPerPage(4))
+	{
+		vector<Entity> paged;
+		pagedWorld.CreateEntities(12, 0, paged);
+		StatePublisher pagedPublisher(pagedWorld);
+		bool pagedFirst = pagedPublisher.Publish() && pagedPublisher.Publish();
+		pagedWorld.GetFloatPointer(paged[5], pagedField).Set(7.0f);
+		bool pagedOnce = pagedPublisher.Publish() && pagedPublisher.GetPagesCopied() == 1;
+		bool pagedTwice = pagedPublisher.Publish() && pagedPublisher.GetPagesCopied() == 1;
+		bool pagedNone = pagedPublisher.Publish() && pagedPublisher.GetPagesCopied() == 0;
+		if (!pagedFirst || !pagedOnce || !pagedTwice || !pagedNone)
+		{
+			cout << "a publish copied pages that weren't written" << endl;
+			return false;
+		}
+	}
+
+	// every function translates, and a missing module leaves the interpreter
+	stringstream translation;
+	if (!testProgs.TranslateToCpp(translation) || translation.str().find("qc_") == string::npos ||
+		testProgs.LoadNativeModule("progs/missing.so") || testProgs.IsNative())
+	{
+		cout << "could not translate the progs" << endl;
+		return false;
+	}
+
+	// the optimized progs still runs main
+	ProgsOptimizer optimizer;
+	stringstream optimized(ios::in | ios::out | ios::binary);
+	if (!optimizer.Load(testProgs.GetImage()))
+	{
+		cout << "could not load the progs into the optimizer" << endl;
+		return false;
+	}
+	optimizer.Optimize();
+	if (!optimizer.Write(optimized))
+	{
+		cout << "could not write the optimized progs" << endl;
+		return false;
+	}
+	string optimizedData = optimized.str();
+	Kzqcvm optimizedProgs(optimizedData.data(), optimizedData.size());
+	optimizedProgs.AddBuiltin(vm_ThrowError, 1);
+	optimizedProgs.AddBuiltin(vm_Spawn,      2);
+	optimizedProgs.AddBuiltin(vm_Remove,     3);
+	optimizedProgs.AddBuiltin(vm_Zone,       4);
+	optimizedProgs.AddBuiltin(vm_Unzone,     5);
+	if (!optimizedProgs.IsLoaded() || !optimizedProgs.GetFunction("main").Run() ||
+		optimizedProgs.GetReturnFloatPointer().Get() != 1.0f)
+	{
+		cout << "main function failed in the optimized progs" << endl;
+		return false;
+	}
+
+	// the first load writes the cache and the second is served from it, but
+	// a cache anyone else could have written is never trusted
+	string cacheFilename = testProgs.GetImage()->GetFilename() + ".test.kzc";
+	remove(cacheFilename.c_str());
+	for (int i=0; i<3; ++i)
+	{
+		if (i == 2)
+			chmod(cacheFilename.c_str(), 0666);
+		ProgsImage *cachedImage = new ProgsImage(testProgs.GetImage()->GetFilename(), cacheFilename);
+		bool fromCache = cachedImage->IsFromCache();
+		Kzqcvm cachedProgs(cachedImage);
+		cachedImage->Release();
+		if (!cachedProgs.IsLoaded() || !cachedProgs.GetFunction("main") ||
+			cachedProgs.GetCRC() != testProgs.GetCRC())
+		{
+			cout << "could not load the progs through the cache" << endl;
+			remove(cacheFilename.c_str());
+			return false;
+		}
+		if (fromCache != (i == 1))
+		{
+			cout << "the cache was " << (fromCache ? "used" : "not used") << " on load " << i << endl;
+			remove(cacheFilename.c_str());
+			return false;
+		}
+	}
+	remove(cacheFilename.c_str());
+
 	return true;
 }
 
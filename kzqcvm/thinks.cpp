@@ -0,0 +1,619 @@
+/*
+Kzqcvm QuakeC VM Interpreter
+Copyright (c) 2010 David Laurie
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+/*
+kzqcvm/thinks.cpp
+*/
+
+#include "kzqcvm.h"
+#include "data.h"
+
+#include <assert.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <iostream>
+
+//-----------------------------------------------------------------------------
+namespace kzqcvm {
+	using std::string;
+	using std::vector;
+	using std::sort;
+	using std::unique;
+	using std::thread;
+	using std::mutex;
+	using std::condition_variable;
+	using std::lock_guard;
+	using std::unique_lock;
+	using std::endl;
+//-----------------------------------------------------------------------------
+
+//-----------------------------------------------------------------------------
+// Setup
+//-----------------------------------------------------------------------------
+
+// Quake's names, which STATE uses without EnableThinks
+void Kzqcvm::InitThinks()
+{
+	mFrameField     = GetEntityField("frame", FLOAT).offset;
+	mNextthinkField = GetEntityField("nextthink", FLOAT).offset;
+	mThinkField     = GetEntityField("think", FUNCTION).offset;
+	mSelfGlobal     = FindGlobal("self", ENTITY);
+	mTimeGlobal     = FindGlobal("time", FLOAT);
+	mOtherGlobal    = FindGlobal("other", ENTITY);
+	mThinksEnabled  = false;
+	mThinksStale    = true;
+}
+
+// As Get*Pointer, but without giving up the global as a constant.
+int32_t Kzqcvm::FindGlobal(const char *name, QcvmDefinitionType type)
+{
+	for (int i=0; i<mHeader->globaldefs_num; ++i)
+	{
+		if ((mGlobalDefs[i].type & ProgsImage::GLOBALDEF_TYPE_MASK) == type &&
+			(mGlobalDefData[i] & (ProgsImage::GLOBAL_DEF_SPECIAL | ProgsImage::GLOBAL_DEF_LOCAL)) == 0 &&
+			strcmp(name, &mStringData[mGlobalDefs[i].nameOffset]) == 0)
+		{
+			return mGlobalDefs[i].offset;
+		}
+	}
+	return -1;
+}
+
+bool Kzqcvm::EnableThinks(string nextthinkField, string thinkField)
+{
+	int32_t nextthink = GetEntityField(nextthinkField, FLOAT).offset;
+	int32_t think     = GetEntityField(thinkField, FUNCTION).offset;
+	if (nextthink < 0 || think < 0 || mSelfGlobal < 0 || mTimeGlobal < 0)
+		return false;
+	mNextthinkField = nextthink;
+	mThinkField     = think;
+	mThinksEnabled  = true;
+	WatchThinks();
+	return true;
+}
+
+void Kzqcvm::WatchThinks()
+{
+	// RunThinks sets these
+	ReleaseConstants(mSelfGlobal, 1);
+	ReleaseConstants(mTimeGlobal, 1);
+	if (mOtherGlobal >= 0)
+		ReleaseConstants(mOtherGlobal, 1);
+	mEntityManager.WatchField(mNextthinkField);
+	mThinksStale = true;
+}
+
+//-----------------------------------------------------------------------------
+// Schedule
+//-----------------------------------------------------------------------------
+
+void Kzqcvm::ScheduleThink(Entity &entity)
+{
+	assert(entity.qcvm == this);
+	if (mThinksEnabled && !mThinksStale)
+		ScheduleThink(entity.entNum);
+}
+
+void Kzqcvm::ScheduleThink(int32_t entityNum)
+{
+	float nextthink;
+	if (!mEntityManager.ReadFloat(entityNum, mNextthinkField, &nextthink))
+		return;
+	int32_t slot = mEntityManager.GetSlot(entityNum);
+	if (nextthink > 0.0f)
+		mThinkWheel.Schedule(slot, ThinkWheel::Tick(nextthink));
+	else
+		mThinkWheel.Unschedule(slot);
+}
+
+// Brings the wheel up to date with the nextthink writes since it was last
+// brought up to date, or with every entity if they may all have changed.
+void Kzqcvm::UpdateThinks()
+{
+	vector<int32_t> slots;
+	mEntityManager.TakeWatchedWrites(slots);
+	if (mThinksStale)
+	{
+		mThinkWheel.Clear();
+		int32_t first = mEntityManager.GetFirstEntity();
+		int32_t entityNum = first;
+		if (first >= 0)
+		{
+			do
+			{
+				ScheduleThink(entityNum);
+				entityNum = mEntityManager.GetNextEntity(entityNum);
+			} while (entityNum != first);
+		}
+		mThinksStale = false;
+		return;
+	}
+	for (size_t i=0; i<slots.size(); ++i)
+	{
+		int32_t entityNum = mEntityManager.GetSlotEntity(slots[i]);
+		if (entityNum < 0)
+			mThinkWheel.Unschedule(slots[i]);
+		else
+			ScheduleThink(entityNum);
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Run
+//-----------------------------------------------------------------------------
+
+// an entity whose think is due, see RunThinks
+struct Kzqcvm::DueThink {
+	float   time;
+	int32_t slot;
+	int32_t entityNum;
+	int32_t function;
+
+	bool operator<(const DueThink &other) const
+	{
+		if (time != other.time)
+			return time < other.time;
+		return slot < other.slot;
+	}
+};
+
+int32_t Kzqcvm::RunThinks(float startTime, float endTime, vector<Entity> &failed)
+{
+	failed.clear();
+	if (!mThinksEnabled)
+		return 0;
+	UpdateThinks();
+
+	// the wheel only has whole ticks, so check each against endTime
+	vector<int32_t> slots;
+	mThinkWheel.Advance(ThinkWheel::Tick(endTime), slots);
+	vector<DueThink> due;
+	for (size_t i=0; i<slots.size(); ++i)
+	{
+		DueThink think;
+		think.slot      = slots[i];
+		think.entityNum = mEntityManager.GetSlotEntity(think.slot);
+		if (think.entityNum < 0 ||
+			!mEntityManager.ReadFloat(think.entityNum, mNextthinkField, &think.time) ||
+			!mEntityManager.ReadInt(think.entityNum, mThinkField, &think.function) ||
+			!(think.time > 0.0f))
+		{
+			continue;
+		}
+		if (think.time > endTime)
+		{
+			mThinkWheel.Schedule(think.slot, ThinkWheel::Tick(think.time));
+			continue;
+		}
+		due.push_back(think);
+	}
+	sort(due.begin(), due.end());
+
+	if (mThinkThreads > 1 && !mThinkWorker)
+		return RunThinksParallel(due, startTime, failed);
+	return RunDueThinks(due.empty() ? NULL : &due[0], (int32_t)due.size(), startTime, failed);
+}
+
+int32_t Kzqcvm::RunDueThinks(const DueThink *due, int32_t count, float startTime, vector<Entity> &failed)
+{
+	int32_t *intGlobalData = (int32_t*)mGlobalData;
+	int32_t run = 0;
+	for (int32_t i=0; i<count && !mThinkAborted; )
+	{
+		int functionNum = due[i].function;
+		int32_t end = i + 1;
+		while (end < count && due[end].function == functionNum)
+			++end;
+
+		vector<float> stackData;
+		bool hoisted = BeginBatch(functionNum, stackData);
+		for (; i<end && !mThinkAborted; ++i)
+		{
+			// Earlier thinks may have deleted this entity or moved its
+			// nextthink, which the wheel will have from the write. One
+			// which only changed its think is run with the new one.
+			int32_t entityNum = due[i].entityNum;
+			float nextthink;
+			int think;
+			if (!mEntityManager.ReadFloat(entityNum, mNextthinkField, &nextthink) ||
+				nextthink != due[i].time ||
+				!mEntityManager.ReadInt(entityNum, mThinkField, &think))
+			{
+				continue;
+			}
+
+			mEntityManager.WriteFloat(mEntityManager.GetAddress(entityNum, mNextthinkField), 0.0f);
+			mGlobalData[mTimeGlobal] = nextthink > startTime ? nextthink : startTime;
+			intGlobalData[mSelfGlobal] = entityNum;
+			if (mOtherGlobal >= 0)
+				intGlobalData[mOtherGlobal] = 0;
+
+			int instructions = 0;
+			bool result = think == functionNum ?
+				RunBatched(functionNum, hoisted, stackData, &instructions) : RunFunction(think, &instructions);
+			if (mThinkAborted)
+				break;
+			if (!result)
+			{
+				mErrorLog << "  for entity " << entityNum << endl;
+				failed.push_back(Entity(this, entityNum));
+			}
+			++run;
+		}
+		EndBatch(functionNum, hoisted, stackData);
+	}
+	return run;
+}
+
+//-----------------------------------------------------------------------------
+// Parallel
+//-----------------------------------------------------------------------------
+
+// a run of due thinks for one worker, and what came of it
+struct Kzqcvm::ThinkShare {
+	Kzqcvm          *worker;
+	const DueThink  *due;
+	int32_t          count;
+	float            startTime;
+
+	int32_t          run;
+	vector<Entity>   failed;
+	bool             aborted;
+	bool             globalsChanged;
+	// sorted, without repeats
+	vector<int32_t>  reads;
+	vector<int32_t>  writes;
+};
+
+bool Kzqcvm::SetThinkThreads(int threads)
+{
+	if (threads < 1)
+		return false;
+	ReleaseThinkWorkers();
+	mThinkThreads = threads;
+	FindSharedGlobals();
+	return true;
+}
+
+// Everything but the parameters, function locals, constants and the
+// globals RunThinks sets before each think, whose values no think can see
+// from the one before.
+void Kzqcvm::FindSharedGlobals()
+{
+	int32_t globalsNum = mHeader->globaldata_num;
+	vector<char> scratch(globalsNum, 0);
+	for (int32_t i=0; i<OFS_PARM7+3 && i<globalsNum; ++i)
+	{
+		scratch[i] = 1;
+	}
+	for (int i=0; i<mHeader->functions_num; ++i)
+	{
+		for (int32_t j=0; j<mFunctions[i].numLocals; ++j)
+		{
+			int32_t offset = mFunctions[i].offsetLocalsInGlobals + j;
+			if (offset >= 0 && offset < globalsNum)
+				scratch[offset] = 1;
+		}
+	}
+	// ours, as the host may have released some
+	const vector<char> &constants = mCurrentCode->constants;
+	for (int32_t i=0; i<(int32_t)constants.size() && i<globalsNum; ++i)
+	{
+		if (constants[i])
+			scratch[i] = 1;
+	}
+	int32_t set[3] = { mSelfGlobal, mTimeGlobal, mOtherGlobal };
+	for (int i=0; i<3; ++i)
+	{
+		if (set[i] >= 0)
+			scratch[set[i]] = 1;
+	}
+
+	mSharedGlobals.clear();
+	for (int32_t i=0; i<globalsNum; ++i)
+	{
+		if (!scratch[i])
+			mSharedGlobals.push_back(i);
+	}
+}
+
+// Each thread waits for the round to move on, runs its share of it if it
+// has one, and counts itself done.
+struct Kzqcvm::ThinkPool {
+	std::mutex           mutex;
+	condition_variable   wake;
+	condition_variable   done;
+	vector<thread>       threads;
+	// the share of each thread this round, or NULL
+	vector<ThinkShare*>  shares;
+	uint32_t             round;
+	int                  running;
+	bool                 stopping;
+};
+
+void Kzqcvm::StartThinkThreads(int threads)
+{
+	if (!mThinkPool)
+	{
+		mThinkPool = new ThinkPool;
+		mThinkPool->round    = 0;
+		mThinkPool->running  = 0;
+		mThinkPool->stopping = false;
+	}
+	while ((int)mThinkPool->threads.size() < threads)
+	{
+		int index = (int)mThinkPool->threads.size();
+		mThinkPool->shares.push_back(NULL);
+		mThinkPool->threads.push_back(thread(ThinkThreadMain, mThinkPool, index, mThinkPool->round));
+	}
+}
+
+void Kzqcvm::ThinkThreadMain(ThinkPool *pool, int index, uint32_t round)
+{
+	for (;;)
+	{
+		ThinkShare *share;
+		{
+			unique_lock<mutex> lock(pool->mutex);
+			while (!pool->stopping && pool->round == round)
+				pool->wake.wait(lock);
+			if (pool->stopping)
+				return;
+			round = pool->round;
+			share = pool->shares[index];
+		}
+		if (share)
+			RunThinkShare(share);
+		lock_guard<mutex> lock(pool->mutex);
+		if (--pool->running == 0)
+			pool->done.notify_one();
+	}
+}
+
+void Kzqcvm::ReleaseThinkWorkers()
+{
+	if (mThinkPool)
+	{
+		{
+			lock_guard<mutex> lock(mThinkPool->mutex);
+			mThinkPool->stopping = true;
+		}
+		mThinkPool->wake.notify_all();
+		for (size_t i=0; i<mThinkPool->threads.size(); ++i)
+		{
+			mThinkPool->threads[i].join();
+		}
+		delete mThinkPool;
+		mThinkPool = NULL;
+	}
+	for (size_t i=0; i<mThinkWorkers.size(); ++i)
+	{
+		delete mThinkWorkers[i];
+	}
+	mThinkWorkers.clear();
+}
+
+static void SortUnique(vector<int32_t> &v)
+{
+	sort(v.begin(), v.end());
+	v.erase(unique(v.begin(), v.end()), v.end());
+}
+
+// both sorted
+static bool Overlaps(const vector<int32_t> &a, const vector<int32_t> &b)
+{
+	size_t i = 0, j = 0;
+	while (i < a.size() && j < b.size())
+	{
+		if (a[i] == b[j])
+			return true;
+		if (a[i] < b[j])
+			++i;
+		else
+			++j;
+	}
+	return false;
+}
+
+// on the worker's thread
+void Kzqcvm::RunThinkShare(ThinkShare *share)
+{
+	Kzqcvm *worker = share->worker;
+	const vector<int32_t> &shared = worker->mSharedGlobals;
+	const int32_t *intGlobalData = (const int32_t*)worker->mGlobalData;
+	vector<int32_t> before(shared.size());
+	for (size_t i=0; i<shared.size(); ++i)
+	{
+		before[i] = intGlobalData[shared[i]];
+	}
+
+	worker->mEntityManager.SetAccessLog(&share->reads, &share->writes);
+	share->run = worker->RunDueThinks(share->due, share->count, share->startTime, share->failed);
+	worker->mEntityManager.SetAccessLog(NULL, NULL);
+	share->aborted = worker->mThinkAborted;
+
+	share->globalsChanged = false;
+	for (size_t i=0; i<shared.size() && !share->globalsChanged; ++i)
+	{
+		share->globalsChanged = intGlobalData[shared[i]] != before[i];
+	}
+	SortUnique(share->reads);
+	SortUnique(share->writes);
+}
+
+// Takes on a share's results as if we had run it ourselves.
+void Kzqcvm::TakeThinkShare(ThinkShare &share, vector<Entity> &failed)
+{
+	Kzqcvm *worker = share.worker;
+	for (size_t i=0; i<share.writes.size(); ++i)
+	{
+		mEntityManager.CopyEntity(worker->mEntityManager, share.writes[i]);
+	}
+	if (share.globalsChanged)
+	{
+		for (size_t i=0; i<mSharedGlobals.size(); ++i)
+		{
+			mGlobalData[mSharedGlobals[i]] = worker->mGlobalData[mSharedGlobals[i]];
+		}
+	}
+	int32_t set[3] = { mSelfGlobal, mTimeGlobal, mOtherGlobal };
+	for (int i=0; i<3; ++i)
+	{
+		if (set[i] >= 0)
+			mGlobalData[set[i]] = worker->mGlobalData[set[i]];
+	}
+	if (worker->mError != ERR_NONE)
+	{
+		mError = worker->mError;
+		mErrorLog << worker->mErrorLog.str();
+	}
+	for (size_t i=0; i<share.failed.size(); ++i)
+	{
+		failed.push_back(Entity(this, share.failed[i].entNum));
+	}
+}
+
+int32_t Kzqcvm::RunThinksParallel(const vector<DueThink> &due, float startTime, vector<Entity> &failed)
+{
+	int32_t *intGlobalData = (int32_t*)mGlobalData;
+	int32_t run = 0;
+	int32_t next = 0;
+	int32_t total = (int32_t)due.size();
+	while (next < total)
+	{
+		int32_t shares = (total - next) / MIN_THINKS_PER_THREAD;
+		if (shares > mThinkThreads)
+			shares = mThinkThreads;
+		if (shares < 2)
+		{
+			run += RunDueThinks(&due[next], total - next, startTime, failed);
+			break;
+		}
+
+		// RunThinks zeroes it before each think anyway
+		if (mOtherGlobal >= 0)
+			intGlobalData[mOtherGlobal] = 0;
+		while ((int32_t)mThinkWorkers.size() < shares)
+		{
+			Kzqcvm *worker = Fork();
+			worker->mThinkWorker = true;
+			worker->mEntityManager.WatchField(-1);
+			mThinkWorkers.push_back(worker);
+		}
+		vector<ThinkShare> work(shares);
+		for (int32_t i=0; i<shares; ++i)
+		{
+			ThinkShare &share = work[i];
+			int32_t begin = next + (int32_t)((int64_t)(total - next) * i / shares);
+			int32_t end   = next + (int32_t)((int64_t)(total - next) * (i + 1) / shares);
+			share.worker    = mThinkWorkers[i];
+			share.due       = &due[begin];
+			share.count     = end - begin;
+			share.startTime = startTime;
+			SyncFork(share.worker);
+		}
+		StartThinkThreads(shares - 1);
+		{
+			lock_guard<mutex> lock(mThinkPool->mutex);
+			for (size_t i=0; i<mThinkPool->shares.size(); ++i)
+			{
+				mThinkPool->shares[i] = (int32_t)i + 1 < shares ? &work[i + 1] : NULL;
+			}
+			mThinkPool->running = (int)mThinkPool->threads.size();
+			++mThinkPool->round;
+		}
+		mThinkPool->wake.notify_all();
+		RunThinkShare(&work[0]);
+		{
+			unique_lock<mutex> lock(mThinkPool->mutex);
+			while (mThinkPool->running > 0)
+				mThinkPool->done.wait(lock);
+		}
+		// let go of the pages the workers haven't written, so that taking
+		// the shares, and our writes after, needn't copy them
+		for (int32_t i=0; i<shares; ++i)
+		{
+			work[i].worker->mEntityManager.ReleaseSharedPages();
+		}
+
+		// take shares while they couldn't have seen an earlier one's work
+		vector<int32_t> written;
+		bool globalsChanged = false;
+		int32_t taken = 0;
+		for (; taken<shares; ++taken)
+		{
+			ThinkShare &share = work[taken];
+			if (share.aborted)
+				break;
+			if (taken > 0 && (globalsChanged ||
+				(!share.reads.empty() && share.reads[0] == -1 && !written.empty()) ||
+				Overlaps(share.reads, written) || Overlaps(share.writes, written)))
+			{
+				break;
+			}
+			TakeThinkShare(share, failed);
+			run += share.run;
+			written.insert(written.end(), share.writes.begin(), share.writes.end());
+			SortUnique(written);
+			globalsChanged = globalsChanged || share.globalsChanged;
+		}
+		if (taken == shares)
+			break;
+
+		// that one can now run from where the ones before it left off
+		ThinkShare &conflict = work[taken];
+		run += RunDueThinks(conflict.due, conflict.count, startTime, failed);
+		next = (int32_t)(conflict.due - &due[0]) + conflict.count;
+	}
+	return run;
+}
+
+//-----------------------------------------------------------------------------
+// STATE
+//-----------------------------------------------------------------------------
+
+// [frame, think] for self, as Quake's interpreter does it
+QcvmError Kzqcvm::RunState(float frame, int32_t think)
+{
+	// the image refuses progs using STATE without a frame field or these
+	// globals, but the think fields are whichever EnableThinks named
+	if (mFrameField < 0 || mNextthinkField < 0 || mThinkField < 0 || mSelfGlobal < 0 || mTimeGlobal < 0)
+		return ERR_FIELD_NOT_FOUND;
+	int32_t self = ((const int32_t*)mGlobalData)[mSelfGlobal];
+	if (!mEntityManager.WriteFloat(mEntityManager.GetAddress(self, mNextthinkField),
+			mGlobalData[mTimeGlobal] + STATE_FRAME_TIME) ||
+		!mEntityManager.WriteFloat(mEntityManager.GetAddress(self, mFrameField), frame) ||
+		!mEntityManager.WriteInt(mEntityManager.GetAddress(self, mThinkField), think))
+	{
+		return ERR_INVALID_WRITE;
+	}
+	return ERR_NONE;
+}
+
+//-----------------------------------------------------------------------------
+} // namespace
+//-----------------------------------------------------------------------------
@@ -0,0 +1,185 @@
+/*
+Kzqcvm QuakeC VM Interpreter
+Copyright (c) 2010 David Laurie
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+/*
+kzqcvm/thinkwheel.cpp
+*/
+
+#include "thinkwheel.h"
+
+#include <assert.h>
+
+//-----------------------------------------------------------------------------
+namespace kzqcvm {
+//-----------------------------------------------------------------------------
+
+ThinkWheel::ThinkWheel()
+{
+	mNow = 0;
+	for (int level=0; level<LEVELS; ++level)
+	{
+		mLevelEntries[level] = 0;
+	}
+}
+
+void ThinkWheel::Clear()
+{
+	for (int level=0; level<LEVELS; ++level)
+	{
+		for (int bucket=0; bucket<BUCKETS; ++bucket)
+		{
+			mBuckets[level][bucket].clear();
+		}
+		mLevelEntries[level] = 0;
+	}
+	mOverdue.clear();
+	mScheduled.assign(mScheduled.size(), 0);
+}
+
+uint32_t ThinkWheel::Tick(float time)
+{
+	if (!(time > 0.0f))
+		return 0;
+	double ticks = (double)time * TICKS_PER_SECOND;
+	if (ticks >= (double)MAX_TICK)
+		return MAX_TICK;
+	return (uint32_t)ticks;
+}
+
+//-----------------------------------------------------------------------------
+// Schedule
+//-----------------------------------------------------------------------------
+
+void ThinkWheel::Schedule(int32_t slot, uint32_t tick)
+{
+	assert(slot >= 0);
+	if (tick > MAX_TICK)
+		tick = MAX_TICK;
+	if (slot >= (int32_t)mScheduled.size())
+		mScheduled.resize(slot + 1, 0);
+	if (mScheduled[slot] == tick + 1)
+		return;
+	mScheduled[slot] = tick + 1;
+	Entry entry = { slot, tick };
+	Insert(entry);
+}
+
+void ThinkWheel::Unschedule(int32_t slot)
+{
+	if (slot >= 0 && slot < (int32_t)mScheduled.size())
+		mScheduled[slot] = 0;
+}
+
+// Into the lowest level whose turn reaches the tick, in the bucket the
+// wheel will come round to just as the tick's turn of the level below
+// begins.
+void ThinkWheel::Insert(const Entry &entry)
+{
+	if (entry.tick <= mNow)
+	{
+		mOverdue.push_back(entry);
+		return;
+	}
+	uint32_t delta = entry.tick - mNow;
+	int level = 0;
+	while (level < LEVELS - 1 && delta >= (1u << (LEVEL_BITS * (level + 1))))
+		++level;
+	mBuckets[level][(entry.tick >> (LEVEL_BITS * level)) & (BUCKETS - 1)].push_back(entry);
+	++mLevelEntries[level];
+}
+
+//-----------------------------------------------------------------------------
+// Advance
+//-----------------------------------------------------------------------------
+
+void ThinkWheel::Advance(uint32_t tick, vector<int32_t> &due)
+{
+	while (mNow < tick)
+	{
+		int lowest = 0;
+		while (lowest < LEVELS && mLevelEntries[lowest] == 0)
+			++lowest;
+		if (lowest == LEVELS)
+		{
+			mNow = tick;
+			break;
+		}
+
+		// nothing can fall due before the lowest level in use next turns
+		uint64_t next = (((uint64_t)mNow >> (LEVEL_BITS * lowest)) + 1) << (LEVEL_BITS * lowest);
+		if (next > tick)
+		{
+			mNow = tick;
+			break;
+		}
+		mNow = (uint32_t)next;
+
+		for (int level=LEVELS-1; level>0; --level)
+		{
+			if ((mNow & ((1u << (LEVEL_BITS * level)) - 1)) == 0)
+				Cascade(level, (mNow >> (LEVEL_BITS * level)) & (BUCKETS - 1));
+		}
+		vector<Entry> &bucket = mBuckets[0][mNow & (BUCKETS - 1)];
+		mLevelEntries[0] -= (int32_t)bucket.size();
+		Collect(bucket, due);
+	}
+	Collect(mOverdue, due);
+}
+
+void ThinkWheel::Cascade(int level, int bucket)
+{
+	vector<Entry> entries;
+	entries.swap(mBuckets[level][bucket]);
+	mLevelEntries[level] -= (int32_t)entries.size();
+	for (size_t i=0; i<entries.size(); ++i)
+	{
+		if (mScheduled[entries[i].slot] == entries[i].tick + 1)
+			Insert(entries[i]);
+	}
+}
+
+void ThinkWheel::Collect(vector<Entry> &entries, vector<int32_t> &due)
+{
+	vector<Entry> collected;
+	collected.swap(entries);
+	for (size_t i=0; i<collected.size(); ++i)
+	{
+		const Entry &entry = collected[i];
+		if (mScheduled[entry.slot] != entry.tick + 1)
+			continue;
+		if (entry.tick > mNow)
+		{
+			Insert(entry);
+			continue;
+		}
+		mScheduled[entry.slot] = 0;
+		due.push_back(entry.slot);
+	}
+	// keep the bucket's memory for its next turn
+	collected.clear();
+	if (entries.empty())
+		entries.swap(collected);
+}
+
+//-----------------------------------------------------------------------------
+} // namespace
+//-----------------------------------------------------------------------------
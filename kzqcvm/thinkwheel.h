@@ -0,0 +1,100 @@
+/*
+Kzqcvm QuakeC VM Interpreter
+Copyright (c) 2010 David Laurie
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+/*
+kzqcvm/thinkwheel.h
+*/
+
+//-----------------------------------------------------------------------------
+#ifndef KZQCVM_THINKWHEEL_H
+#define KZQCVM_THINKWHEEL_H
+//-----------------------------------------------------------------------------
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+//-----------------------------------------------------------------------------
+namespace kzqcvm {
+	using std::vector;
+//-----------------------------------------------------------------------------
+
+// A hierarchical timing wheel of entity slots, each due at some tick. The
+// lowest level has a bucket per tick, and each level above a bucket per
+// whole turn of the one below, which is spread back down as the wheel comes
+// round to it. Scheduling is O(1), and advancing costs the slots that fall
+// due plus a step per tick, or per turn of the lowest level in use when the
+// levels below it are empty.
+class ThinkWheel {
+public:
+	ThinkWheel();
+
+	// Forgets every slot scheduled, without moving the wheel.
+	void Clear();
+
+	// Schedules slot for tick, in place of any tick it was scheduled for.
+	// Ticks the wheel has already passed fall due at the next Advance.
+	void Schedule(int32_t slot, uint32_t tick);
+	void Unschedule(int32_t slot);
+
+	// Moves the wheel on to tick, adding every slot scheduled at or before
+	// it to due. Those slots are no longer scheduled.
+	void Advance(uint32_t tick, vector<int32_t> &due);
+
+	// Milliseconds, from time zero, saturating a little under 50 days in.
+	static uint32_t Tick(float time);
+
+	static const int32_t TICKS_PER_SECOND = 1000;
+
+private:
+	static const int      LEVELS      = 4;
+	static const int      LEVEL_BITS  = 8;
+	static const int      BUCKETS     = 1 << LEVEL_BITS;
+	static const uint32_t MAX_TICK    = UINT32_MAX - 1;
+
+	struct Entry {
+		int32_t  slot;
+		uint32_t tick;
+	};
+
+	void Insert(const Entry &entry);
+	void Cascade(int level, int bucket);
+	void Collect(vector<Entry> &entries, vector<int32_t> &due);
+
+	uint32_t mNow;
+	// Rescheduling leaves the old entry where it was; it is dropped when
+	// reached, as it no longer matches mScheduled.
+	vector<Entry> mBuckets[LEVELS][BUCKETS];
+	int32_t       mLevelEntries[LEVELS];
+	// ticks already passed
+	vector<Entry> mOverdue;
+	// by slot, its tick plus one, or 0 if it isn't scheduled
+	vector<uint32_t> mScheduled;
+};
+
+//-----------------------------------------------------------------------------
+} // namespace
+//-----------------------------------------------------------------------------
+
+//-----------------------------------------------------------------------------
+#endif
+//-----------------------------------------------------------------------------
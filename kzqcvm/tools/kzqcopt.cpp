@@ -0,0 +1,75 @@
+/*
+Kzqcvm QuakeC VM Interpreter
+Copyright (c) 2010 David Laurie
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+/*
+kzqcvm/tools/kzqcopt.cpp
+
+Optimizes a progs, see ProgsOptimizer.
+
+	kzqcopt progs.dat progs.opt.dat
+*/
+
+#include "../optimizer.h"
+
+#include <iostream>
+#include <fstream>
+
+using namespace kzqcvm;
+using std::cout;
+using std::endl;
+using std::ofstream;
+using std::ios;
+
+int main(int argc, char **argv)
+{
+	if (argc != 3)
+	{
+		cout << "usage: " << argv[0] << " <progs.dat> <output.dat>" << endl;
+		return 1;
+	}
+
+	ProgsImage *image = new ProgsImage(argv[1]);
+	ProgsOptimizer optimizer;
+	bool loaded = optimizer.Load(image);
+	image->Release();
+	if (!loaded)
+		return 1;
+
+	optimizer.Optimize();
+
+	ofstream out(argv[2], ios::binary | ios::out | ios::trunc);
+	if (!out.is_open() || !optimizer.Write(out))
+	{
+		cout << "Could not write " << argv[2] << endl;
+		return 1;
+	}
+
+	const ProgsOptimizer::Stats &stats = optimizer.GetStats();
+	cout << "statements " << stats.statementsBefore << " -> " << stats.statementsAfter << endl;
+	cout << "globals    " << stats.globalsBefore    << " -> " << stats.globalsAfter    << endl;
+	cout << "  jumps threaded     " << stats.jumpsThreaded    << endl;
+	cout << "  constants folded   " << stats.constantsFolded  << endl;
+	cout << "  copies propagated  " << stats.copiesPropagated << endl;
+	cout << "  dead stores        " << stats.deadStores       << endl;
+	cout << "  unreachable        " << stats.unreachable      << endl;
+	return 0;
+}
@@ -0,0 +1,66 @@
+/*
+Kzqcvm QuakeC VM Interpreter
+Copyright (c) 2010 David Laurie
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+/*
+kzqcvm/tools/kzqcstruct.cpp
+
+Writes a header declaring a progs' entity fields as a struct, for
+Kzqcvm::EntityData. The struct is named EntityFields unless given.
+
+	kzqcstruct progs.dat entityfields.h [StructName]
+*/
+
+#include "../kzqcvm.h"
+
+#include <iostream>
+#include <fstream>
+
+using namespace kzqcvm;
+using std::cout;
+using std::endl;
+using std::ofstream;
+
+int main(int argc, char **argv)
+{
+	if (argc != 3 && argc != 4)
+	{
+		cout << "usage: " << argv[0] << " <progs.dat> <output.h> [struct name]" << endl;
+		return 1;
+	}
+
+	Kzqcvm progs(argv[1]);
+	if (!progs.IsLoaded())
+		return 1;
+
+	ofstream out(argv[2]);
+	if (!out.is_open())
+	{
+		cout << "Could not open " << argv[2] << endl;
+		return 1;
+	}
+	if (!progs.WriteEntityStruct(out, argc == 4 ? argv[3] : "EntityFields"))
+	{
+		cout << "Could not write the entity struct for " << argv[1] << endl;
+		return 1;
+	}
+	return 0;
+}
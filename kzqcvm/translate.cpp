@@ -0,0 +1,576 @@
+/*
+Kzqcvm QuakeC VM Interpreter
+Copyright (c) 2010 David Laurie
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+/*
+kzqcvm/translate.cpp
+*/
+
+#include "kzqcvm.h"
+#include "instructions.h"
+#include "native.h"
+
+#include <string.h>
+#include <ctype.h>
+#include <iostream>
+#include <sstream>
+#include <vector>
+#include <map>
+
+//-----------------------------------------------------------------------------
+namespace kzqcvm {
+	using std::endl;
+	using std::vector;
+	using std::map;
+	using std::ostringstream;
+//-----------------------------------------------------------------------------
+
+//-----------------------------------------------------------------------------
+// Translate to C++
+//-----------------------------------------------------------------------------
+
+// Each statement becomes the same expression RunFunction evaluates for it,
+// with the global offsets baked in as constants. Jumps become gotos to labels
+// named after the statement number, and the instruction count is charged a
+// whole basic block at a time.
+
+#define A (statement->parameter[0])
+#define B (statement->parameter[1])
+#define C (statement->parameter[2])
+
+#define EMIT_ERROR(type) \
+	"{ ctx->error(ctx->vm, " << type << ", " << functionNum << ", " << statementNum << "); goto fail; }"
+
+static void TranslateStatement(ostream &out, const QcvmStatement *statement, int functionNum, int statementNum)
+{
+	out << "\t";
+	switch (statement->instruction)
+	{
+	//-------------------------------------------------------------------------
+	// return
+	case Instructions::DONE:
+	case Instructions::RETURN:
+		out << "g[1] = g[" << A << "]; g[2] = g[" << A+1 << "]; g[3] = g[" << A+2 << "]; goto done;";
+		break;
+	//-------------------------------------------------------------------------
+	// arithmetic
+	case Instructions::MUL_F:
+		out << "g[" << C << "] = g[" << A << "] * g[" << B << "];";
+		break;
+	case Instructions::MUL_V:
+		out << "g[" << C << "] = g[" << A << "] * g[" << B << "] + g[" << A+1 << "] * g[" << B+1
+			<< "] + g[" << A+2 << "] * g[" << B+2 << "];";
+		break;
+	case Instructions::MUL_FV:
+		out << "{ float f = g[" << A << "]; g[" << C << "] = f * g[" << B << "]; g[" << C+1 << "] = f * g["
+			<< B+1 << "]; g[" << C+2 << "] = f * g[" << B+2 << "]; }";
+		break;
+	case Instructions::MUL_VF:
+		out << "{ float f = g[" << B << "]; g[" << C << "] = g[" << A << "] * f; g[" << C+1 << "] = g["
+			<< A+1 << "] * f; g[" << C+2 << "] = g[" << A+2 << "] * f; }";
+		break;
+	case Instructions::DIV_F:
+		out << "g[" << C << "] = g[" << A << "] / g[" << B << "];";
+		break;
+	case Instructions::ADD_F:
+		out << "g[" << C << "] = g[" << A << "] + g[" << B << "];";
+		break;
+	case Instructions::ADD_V:
+		out << "g[" << C << "] = g[" << A << "] + g[" << B << "]; g[" << C+1 << "] = g[" << A+1 << "] + g["
+			<< B+1 << "]; g[" << C+2 << "] = g[" << A+2 << "] + g[" << B+2 << "];";
+		break;
+	case Instructions::SUB_F:
+		out << "g[" << C << "] = g[" << A << "] - g[" << B << "];";
+		break;
+	case Instructions::SUB_V:
+		out << "g[" << C << "] = g[" << A << "] - g[" << B << "]; g[" << C+1 << "] = g[" << A+1 << "] - g["
+			<< B+1 << "]; g[" << C+2 << "] = g[" << A+2 << "] - g[" << B+2 << "];";
+		break;
+	//-------------------------------------------------------------------------
+	// logical equality
+	case Instructions::EQ_F:
+		out << "g[" << C << "] = (g[" << A << "] == g[" << B << "]);";
+		break;
+	case Instructions::EQ_V:
+		out << "g[" << C << "] = (g[" << A << "] == g[" << B << "] && g[" << A+1 << "] == g[" << B+1
+			<< "] && g[" << A+2 << "] == g[" << B+2 << "]);";
+		break;
+	case Instructions::EQ_S:
+		out << "g[" << C << "] = (strcmp(ctx->getString(ctx->vm, gi[" << A << "]), ctx->getString(ctx->vm, gi["
+			<< B << "])) == 0);";
+		break;
+	case Instructions::EQ_E:
+	case Instructions::EQ_FNC:
+		out << "g[" << C << "] = (gi[" << A << "] == gi[" << B << "]);";
+		break;
+	//-------------------------------------------------------------------------
+	// logical inequality
+	case Instructions::NE_F:
+		out << "g[" << C << "] = (g[" << A << "] != g[" << B << "]);";
+		break;
+	case Instructions::NE_V:
+		out << "g[" << C << "] = (g[" << A << "] != g[" << B << "] || g[" << A+1 << "] != g[" << B+1
+			<< "] || g[" << A+2 << "] != g[" << B+2 << "]);";
+		break;
+	case Instructions::NE_S:
+		out << "g[" << C << "] = (strcmp(ctx->getString(ctx->vm, gi[" << A << "]), ctx->getString(ctx->vm, gi["
+			<< B << "])) != 0);";
+		break;
+	case Instructions::NE_E:
+	case Instructions::NE_FNC:
+		out << "g[" << C << "] = (gi[" << A << "] != gi[" << B << "]);";
+		break;
+	//-------------------------------------------------------------------------
+	// comparison
+	case Instructions::LE:
+		out << "g[" << C << "] = (g[" << A << "] <= g[" << B << "]);";
+		break;
+	case Instructions::GE:
+		out << "g[" << C << "] = (g[" << A << "] >= g[" << B << "]);";
+		break;
+	case Instructions::LT:
+		out << "g[" << C << "] = (g[" << A << "] < g[" << B << "]);";
+		break;
+	case Instructions::GT:
+		out << "g[" << C << "] = (g[" << A << "] > g[" << B << "]);";
+		break;
+	//-------------------------------------------------------------------------
+	// load from entity
+	case Instructions::LOAD_F:
+		out << "if (!ctx->readFloat(ctx->vm, gi[" << A << "], gi[" << B << "], &g[" << C << "])) "
+			<< EMIT_ERROR("ERR_INVALID_READ");
+		break;
+	case Instructions::LOAD_V:
+		out << "if (!ctx->readVector(ctx->vm, gi[" << A << "], gi[" << B << "], &g[" << C << "])) "
+			<< EMIT_ERROR("ERR_INVALID_READ");
+		break;
+	case Instructions::LOAD_S:
+	case Instructions::LOAD_ENT:
+	case Instructions::LOAD_FLD:
+	case Instructions::LOAD_FNC:
+		out << "if (!ctx->readInt(ctx->vm, gi[" << A << "], gi[" << B << "], &gi[" << C << "])) "
+			<< EMIT_ERROR("ERR_INVALID_READ");
+		break;
+	//-------------------------------------------------------------------------
+	// address entity
+	case Instructions::ADDRESS:
+		out << "gi[" << C << "] = ctx->address(ctx->vm, gi[" << A << "], gi[" << B << "]);";
+		break;
+	//-------------------------------------------------------------------------
+	// store (copy)
+	case Instructions::STORE_F:
+	case Instructions::STORE_S:
+	case Instructions::STORE_ENT:
+	case Instructions::STORE_FLD:
+	case Instructions::STORE_FNC:
+		out << "g[" << B << "] = g[" << A << "];";
+		break;
+	case Instructions::STORE_V:
+		out << "g[" << B << "] = g[" << A << "]; g[" << B+1 << "] = g[" << A+1 << "]; g[" << B+2
+			<< "] = g[" << A+2 << "];";
+		break;
+	//-------------------------------------------------------------------------
+	// store (addressed)
+	case Instructions::STOREP_F:
+		out << "if (!ctx->writeFloat(ctx->vm, gi[" << B << "], g[" << A << "])) "
+			<< EMIT_ERROR("ERR_INVALID_WRITE");
+		break;
+	case Instructions::STOREP_V:
+		out << "if (!ctx->writeVector(ctx->vm, gi[" << B << "], &g[" << A << "])) "
+			<< EMIT_ERROR("ERR_INVALID_WRITE");
+		break;
+	case Instructions::STOREP_S:
+	case Instructions::STOREP_ENT:
+	case Instructions::STOREP_FLD:
+	case Instructions::STOREP_FNC:
+		out << "if (!ctx->writeInt(ctx->vm, gi[" << B << "], gi[" << A << "])) "
+			<< EMIT_ERROR("ERR_INVALID_WRITE");
+		break;
+	//-------------------------------------------------------------------------
+	// logical not
+	case Instructions::NOT_F:
+		out << "g[" << C << "] = !g[" << A << "];";
+		break;
+	case Instructions::NOT_V:
+		out << "g[" << C << "] = !g[" << A << "] && !g[" << A+1 << "] && !g[" << A+2 << "];";
+		break;
+	case Instructions::NOT_S:
+	case Instructions::NOT_ENT:
+	case Instructions::NOT_FNC:
+		out << "g[" << C << "] = !gi[" << A << "];";
+		break;
+	//-------------------------------------------------------------------------
+	// if, ifnot (jump)
+	case Instructions::IF:
+		out << "if (g[" << A << "]) goto s" << statementNum + B << ";";
+		break;
+	case Instructions::IFNOT:
+		out << "if (!g[" << A << "]) goto s" << statementNum + B << ";";
+		break;
+	//-------------------------------------------------------------------------
+	// function calls
+	case Instructions::CALL0:
+	case Instructions::CALL1:
+	case Instructions::CALL2:
+	case Instructions::CALL3:
+	case Instructions::CALL4:
+	case Instructions::CALL5:
+	case Instructions::CALL6:
+	case Instructions::CALL7:
+	case Instructions::CALL8:
+		out << "if (!ctx->call(ctx->vm, gi[" << A << "], "
+			<< statement->instruction - Instructions::CALL0 << ", ic)) " << EMIT_ERROR("ERR_NONE");
+		break;
+	//-------------------------------------------------------------------------
+	// state
+	case Instructions::STATE:
+		out << "{ QcvmError e = ctx->state(ctx->vm, g[" << A << "], gi[" << B << "]); "
+			<< "if (e != ERR_NONE) " << EMIT_ERROR("e") << " }";
+		break;
+	//-------------------------------------------------------------------------
+	// goto (jump)
+	case Instructions::GOTO:
+		out << "goto s" << statementNum + A << ";";
+		break;
+	//-------------------------------------------------------------------------
+	// logical and/or
+	case Instructions::AND:
+		out << "g[" << C << "] = g[" << A << "] && g[" << B << "];";
+		break;
+	case Instructions::OR:
+		out << "g[" << C << "] = g[" << A << "] || g[" << B << "];";
+		break;
+	//-------------------------------------------------------------------------
+	// bitwise and/or
+	case Instructions::BITAND:
+		out << "g[" << C << "] = (float)((int)g[" << A << "] & (int)g[" << B << "]);";
+		break;
+	case Instructions::BITOR:
+		out << "g[" << C << "] = (float)((int)g[" << A << "] | (int)g[" << B << "]);";
+		break;
+	//-------------------------------------------------------------------------
+	default:
+		out << EMIT_ERROR("ERR_INVALID_INSTRUCTION");
+		break;
+	}
+	out << endl;
+}
+
+#undef A
+#undef B
+#undef C
+#undef EMIT_ERROR
+
+// The statements a function can reach from its first, following jumps and
+// stopping at returns. Returns false if any of them fall outside the progs,
+// in which case the function is left to the interpreter.
+static bool FindReachable(const QcvmStatement *statements, int32_t statementsNum, int32_t first,
+	vector<char> &reachable, vector<char> &jumpTarget)
+{
+	reachable.assign(statementsNum, 0);
+	jumpTarget.assign(statementsNum, 0);
+
+	vector<int32_t> pending(1, first);
+	while (!pending.empty())
+	{
+		int32_t i = pending.back();
+		pending.pop_back();
+		if (i < 0 || i >= statementsNum)
+			return false;
+		if (reachable[i])
+			continue;
+		reachable[i] = 1;
+
+		const QcvmStatement &statement = statements[i];
+		switch (statement.instruction)
+		{
+		case Instructions::DONE:
+		case Instructions::RETURN:
+			break;
+		case Instructions::GOTO:
+			if (i + statement.parameter[0] < 0 || i + statement.parameter[0] >= statementsNum)
+				return false;
+			jumpTarget[i + statement.parameter[0]] = 1;
+			pending.push_back(i + statement.parameter[0]);
+			break;
+		case Instructions::IF:
+		case Instructions::IFNOT:
+			if (i + statement.parameter[1] < 0 || i + statement.parameter[1] >= statementsNum)
+				return false;
+			jumpTarget[i + statement.parameter[1]] = 1;
+			pending.push_back(i + statement.parameter[1]);
+			pending.push_back(i + 1);
+			break;
+		default:
+			if (statement.instruction < Instructions::MIN || statement.instruction > Instructions::MAX)
+				break;
+			pending.push_back(i + 1);
+			break;
+		}
+	}
+	return true;
+}
+
+static bool EndsBlock(int16_t instruction)
+{
+	return instruction == Instructions::IF || instruction == Instructions::IFNOT ||
+		instruction == Instructions::GOTO;
+}
+
+bool Kzqcvm::TranslateToCpp(ostream &out)
+{
+	if (!IsLoaded())
+		return false;
+
+	out << "// Translated from " << mImage->GetFilename() << " by Kzqcvm::TranslateToCpp." << endl;
+	out << "// Build with: g++ -O2 -fPIC -shared -fno-strict-aliasing -I<kzqcvm> -o progs.so <this file>" << endl;
+	out << endl;
+	out << "#include <string.h>" << endl;
+	out << "#include \"native.h\"" << endl;
+	out << endl;
+	out << "using namespace kzqcvm;" << endl;
+	out << endl;
+	out << "namespace {" << endl;
+
+	vector<char> translated(mHeader->functions_num, 0);
+	vector<char> reachable;
+	vector<char> jumpTarget;
+	for (int f=1; f<mHeader->functions_num; ++f)
+	{
+		const QcvmFunction *function = &mFunctions[f];
+		if (function->offsetFirstStatement <= 0)
+			continue;
+		if (!FindReachable(mStatements, mHeader->statements_num, function->offsetFirstStatement, reachable, jumpTarget))
+			continue;
+		translated[f] = 1;
+
+		int32_t locals = function->offsetLocalsInGlobals;
+		out << endl;
+		out << "// " << &mStringData[function->nameOffset] << endl;
+		out << "bool qc_" << f << "(const NativeContext *ctx, int *ic)" << endl;
+		out << "{" << endl;
+		out << "\tfloat *g = ctx->globals;" << endl;
+		out << "\tint32_t *gi = (int32_t*)g;" << endl;
+		out << "\t(void)gi;" << endl;
+		if (function->numLocals > 0)
+		{
+			out << "\tfloat saved[" << function->numLocals << "];" << endl;
+			out << "\tmemcpy(saved, &g[" << locals << "], sizeof(saved));" << endl;
+		}
+		for (int i=0, ofs=0; i<function->numParameters; ++i)
+		{
+			for (int j=0; j<function->parameterSizes[i]; ++j, ++ofs)
+			{
+				out << "\tg[" << locals + ofs << "] = g[" << OFS_PARM0 + (i*3) + j << "];" << endl;
+			}
+		}
+
+		bool blockStart = true;
+		for (int32_t i=0; i<mHeader->statements_num; ++i)
+		{
+			if (!reachable[i])
+				continue;
+			if (jumpTarget[i])
+			{
+				out << "s" << i << ":" << endl;
+				blockStart = true;
+			}
+			if (blockStart)
+			{
+				// charge the whole block, up to the next label or jump
+				int32_t length = 1;
+				for (int32_t j=i; j+1<mHeader->statements_num && reachable[j+1] && !jumpTarget[j+1] &&
+					!EndsBlock(mStatements[j].instruction); ++j)
+				{
+					++length;
+				}
+				out << "\tif ((*ic += " << length << ") & 0xffe00000) { ctx->error(ctx->vm, ERR_RUNAWAY_LOOP, "
+					<< f << ", " << i << "); goto fail; }" << endl;
+				blockStart = false;
+			}
+			TranslateStatement(out, &mStatements[i], f, i);
+			blockStart = EndsBlock(mStatements[i].instruction);
+		}
+
+		out << "done: __attribute__((unused));" << endl;
+		if (function->numLocals > 0)
+			out << "\tmemcpy(&g[" << locals << "], saved, sizeof(saved));" << endl;
+		out << "\treturn true;" << endl;
+		out << "fail: __attribute__((unused));" << endl;
+		if (function->numLocals > 0)
+			out << "\tmemcpy(&g[" << locals << "], saved, sizeof(saved));" << endl;
+		out << "\treturn false;" << endl;
+		out << "}" << endl;
+	}
+
+	out << endl;
+	out << "const NativeFunction functions[" << mHeader->functions_num << "] = {" << endl;
+	for (int f=0; f<mHeader->functions_num; ++f)
+	{
+		if (translated[f])
+			out << "\tqc_" << f << "," << endl;
+		else
+			out << "\tNULL," << endl;
+	}
+	out << "};" << endl;
+	out << endl;
+	out << "const NativeModule module = { NATIVE_ABI_VERSION, " << mHeader->crc << ", "
+		<< mImage->mContentHash << "ULL, " << mHeader->functions_num << ", functions };" << endl;
+	out << endl;
+	out << "} // namespace" << endl;
+	out << endl;
+	out << "extern \"C\" const NativeModule *" << KZQCVM_NATIVE_MODULE_ENTRY << "()" << endl;
+	out << "{" << endl;
+	out << "\treturn &module;" << endl;
+	out << "}" << endl;
+
+	return out.good();
+}
+
+//-----------------------------------------------------------------------------
+// Entity struct
+//-----------------------------------------------------------------------------
+
+// The field definition laid out at each offset of an entity, or -1 for none.
+// A vector is preferred to the floats naming its components.
+static void EntityStructLayout(const QcvmDefinition *fieldDefs, int32_t fieldDefsNum, int32_t entitySize,
+	vector<int32_t> &layout)
+{
+	layout.assign(entitySize, -1);
+	for (int32_t i=0; i<fieldDefsNum; ++i)
+	{
+		int32_t offset = fieldDefs[i].offset;
+		int type  = fieldDefs[i].type & ProgsImage::GLOBALDEF_TYPE_MASK;
+		int width = type == VECTOR ? 3 : 1;
+		if (type == NOTYPE || offset < 0 || offset + width > entitySize)
+			continue;
+		int32_t current = layout[offset];
+		if (current < 0 || (type == VECTOR && (fieldDefs[current].type & ProgsImage::GLOBALDEF_TYPE_MASK) != VECTOR))
+			layout[offset] = i;
+	}
+}
+
+void Kzqcvm::HashEntityLayout()
+{
+	vector<int32_t> layout;
+	EntityStructLayout(mFieldDefs, mHeader->fielddefs_num, mHeader->entity_size, layout);
+	ostringstream text;
+	text << mHeader->entity_size;
+	for (int32_t offset=0; offset<(int32_t)layout.size(); ++offset)
+	{
+		if (layout[offset] >= 0)
+		{
+			const QcvmDefinition *def = &mFieldDefs[layout[offset]];
+			text << ";" << offset << "," << (def->type & ProgsImage::GLOBALDEF_TYPE_MASK) << ","
+				<< &mStringData[def->nameOffset];
+		}
+	}
+	string hashed = text.str();
+	mEntityLayoutHash = ProgsImage::HashData(hashed.data(), (int32_t)hashed.size());
+}
+
+static bool IsCppKeyword(const string &name)
+{
+	static const char *keywords[] = {
+		"alignas", "alignof", "and", "asm", "auto", "bool", "break", "case", "catch", "char",
+		"class", "const", "constexpr", "continue", "decltype", "default", "delete", "do",
+		"double", "else", "enum", "explicit", "export", "extern", "false", "float", "for",
+		"friend", "goto", "if", "inline", "int", "long", "mutable", "namespace", "new",
+		"noexcept", "not", "nullptr", "operator", "or", "private", "protected", "public",
+		"register", "return", "short", "signed", "sizeof", "static", "struct", "switch",
+		"template", "this", "throw", "true", "try", "typedef", "typeid", "typename", "union",
+		"unsigned", "using", "virtual", "void", "volatile", "while", "xor", NULL
+	};
+	for (int i=0; keywords[i]; ++i)
+	{
+		if (name == keywords[i])
+			return true;
+	}
+	return false;
+}
+
+bool Kzqcvm::WriteEntityStruct(ostream &out, string structName)
+{
+	if (!IsLoaded())
+		return false;
+
+	vector<int32_t> layout;
+	EntityStructLayout(mFieldDefs, mHeader->fielddefs_num, mHeader->entity_size, layout);
+
+	string guard = "KZQCVM_ENTITY_" + structName + "_H";
+	for (int i=0; i<(int)guard.size(); ++i)
+	{
+		guard[i] = toupper(guard[i]);
+	}
+	out << "// Entity fields of " << mImage->GetFilename() << ", written by Kzqcvm::WriteEntityStruct." << endl;
+	out << "// Use with Kzqcvm::EntityData<" << structName << ">." << endl;
+	out << endl;
+	out << "#ifndef " << guard << endl;
+	out << "#define " << guard << endl;
+	out << endl;
+	out << "#include <stdint.h>" << endl;
+	out << endl;
+	out << "struct " << structName << " {" << endl;
+	out << "\tstatic const int32_t  PROGS_CRC   = " << mHeader->crc << ";" << endl;
+	out << "\tstatic const uint64_t LAYOUT_HASH = " << mEntityLayoutHash << "ULL;" << endl;
+	out << endl;
+
+	map<string, int> used;
+	for (int32_t offset=0; offset<(int32_t)layout.size(); )
+	{
+		if (layout[offset] < 0)
+		{
+			out << "\tfloat   unnamed_" << offset << ";" << endl;
+			++offset;
+			continue;
+		}
+		const QcvmDefinition *def = &mFieldDefs[layout[offset]];
+		int type = def->type & ProgsImage::GLOBALDEF_TYPE_MASK;
+		string name = &mStringData[def->nameOffset];
+		if (name.empty() || IsCppKeyword(name) || used.count(name))
+		{
+			ostringstream unique;
+			unique << name << "_" << offset;
+			name = unique.str();
+		}
+		used[name] = offset;
+		if (type == FLOAT)
+			out << "\tfloat   " << name << ";" << endl;
+		else if (type == VECTOR)
+			out << "\tfloat   " << name << "[3];" << endl;
+		else
+			out << "\tint32_t " << name << ";" << endl;
+		offset += type == VECTOR ? 3 : 1;
+	}
+
+	out << "} __attribute__((__packed__));" << endl;
+	out << endl;
+	out << "static_assert(sizeof(" << structName << ") == " << mHeader->entity_size << " * sizeof(float), \""
+		<< structName << " does not match the entity size\");" << endl;
+	out << endl;
+	out << "#endif" << endl;
+
+	return out.good();
+}
+
+//-----------------------------------------------------------------------------
+} // namespace
+//-----------------------------------------------------------------------------